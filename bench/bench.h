@@ -0,0 +1,99 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef BENCH_H
+#define BENCH_H
+
+
+#define BENCH_SAMPLE_RATE 48000
+
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+
+
+/* Small harness shared by the benchmark programs: a monotonic clock, a
+deterministic test signal and one line of output per measurement, so runs on
+different machines can be compared line by line. */
+
+
+
+/* Returns the monotonic time in seconds. */
+static inline double bench_now(void) {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+/* Returns the next value of a xorshift generator, so every run measures the
+same signal. */
+static inline uint32_t bench_random(uint32_t *state) {
+
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+
+/* Fills interleaved frames with a music-like signal at the specified bit
+depth: a few detuned partials per channel under a low noise floor, at about
+-6 dBFS. */
+static inline void bench_fill_signal(int32_t *samples, const size_t num_frames,
+                                     const size_t num_channels, const unsigned bit_depth,
+                                     uint32_t seed) {
+
+  const double full_scale = (double) ((1 << (bit_depth - 1)) - 1);
+  double t, value;
+  size_t f, c;
+
+  for (f=0; f < num_frames; ++f) {
+    t = (double) f / BENCH_SAMPLE_RATE;
+    for (c=0; c < num_channels; ++c) {
+      value = 0.25 * sin(2.0 * M_PI * (220.0 + 3.0 * c) * t)
+              + 0.15 * sin(2.0 * M_PI * (1375.0 + 11.0 * c) * t)
+              + 0.08 * sin(2.0 * M_PI * (5250.0 + 17.0 * c) * t)
+              + 0.01 * ((double) (bench_random(&seed) >> 8) / (1 << 24) - 0.5);
+      samples[f * num_channels + c] = (int32_t) lrint(value * full_scale);
+    }
+  }
+}
+
+
+/* Prints one measurement of processing the specified number of frames per
+channel, as throughput and as a multiple of real time. */
+static inline void bench_report(const char *name, const double seconds,
+                                const size_t num_frames, const size_t num_channels) {
+
+  printf("%-44s %9.2f Msamples/s %9.1fx realtime\n", name,
+         (double) num_frames * num_channels / seconds * 1e-6,
+         (double) num_frames / BENCH_SAMPLE_RATE / seconds);
+}
+
+
+
+#endif /* BENCH_H */
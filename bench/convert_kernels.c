@@ -0,0 +1,136 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "convert.h"
+
+
+#define BENCH_SECONDS 30
+#define BENCH_PERIOD 256
+#define BENCH_BIT_DEPTH 24
+#define MAX_CHANNELS 8
+
+
+
+/* Throughput of every conversion kernel the running CPU supports, for each
+interleaved channel count, converting one JACK period at a time. The choice
+convert_select() makes for each count is marked, so the table of counts it
+sends to AVX-512 can be checked against the numbers. */
+
+
+
+/* Runs the kernel over every period of the port buffers and returns the
+elapsed time. */
+static double run_kernel(const fj_convert_func_t convert, float * const *ports,
+                         const size_t num_frames, const size_t num_channels,
+                         int32_t *dest) {
+
+  const float scale = (float) ((1 << (BENCH_BIT_DEPTH - 1)) - 1);
+  const float *buffers[MAX_CHANNELS];
+  double start, end;
+  size_t f, c;
+
+  start = bench_now();
+  for (f=0; f < num_frames; f += BENCH_PERIOD) {
+    for (c=0; c < num_channels; ++c) {
+      buffers[c] = &(ports[c][f]);
+    }
+    convert(buffers, num_channels, BENCH_PERIOD, scale, &(dest[f * num_channels]));
+  }
+  end = bench_now();
+
+  return end - start;
+}
+
+
+
+
+int main() {
+
+  static const char * const isa_names[] = {"scalar", "SSE2", "AVX2", "AVX-512"};
+  const size_t num_frames = (size_t) BENCH_SECONDS * BENCH_SAMPLE_RATE
+                            / BENCH_PERIOD * BENCH_PERIOD;
+  float *ports[MAX_CHANNELS];
+  int32_t *signal, *dest;
+  fj_convert_func_t convert;
+  const char *selected;
+  char name[64];
+  size_t num_channels, i, f, c;
+  double seconds;
+
+
+  signal = (int32_t*) malloc(sizeof(int32_t) * num_frames * MAX_CHANNELS);
+  dest = (int32_t*) malloc(sizeof(int32_t) * num_frames * MAX_CHANNELS);
+  if (signal == NULL || dest == NULL) {
+    fprintf(stderr, "Cannot allocate the signal.\n");
+    return 1;
+  }
+  bench_fill_signal(signal, num_frames, MAX_CHANNELS, BENCH_BIT_DEPTH, 1);
+
+  for (c=0; c < MAX_CHANNELS; ++c) {
+    ports[c] = (float*) malloc(sizeof(float) * num_frames);
+    if (ports[c] == NULL) {
+      fprintf(stderr, "Cannot allocate the port buffers.\n");
+      return 1;
+    }
+    for (f=0; f < num_frames; ++f) {
+      ports[c][f] = (float) signal[f * MAX_CHANNELS + c] / (1 << (BENCH_BIT_DEPTH - 1));
+    }
+  }
+
+  printf("%zu s of signal at %d Hz, %d bits, period %d.\n\n",
+         num_frames / BENCH_SAMPLE_RATE, BENCH_SAMPLE_RATE, BENCH_BIT_DEPTH, BENCH_PERIOD);
+
+  for (num_channels=1; num_channels <= MAX_CHANNELS; ++num_channels) {
+
+    if (convert_select(num_channels, BENCH_BIT_DEPTH, &selected) == NULL) {
+      continue;
+    }
+
+    for (i=0; i < sizeof(isa_names) / sizeof(isa_names[0]); ++i) {
+      convert = convert_select_isa(isa_names[i], num_channels, BENCH_BIT_DEPTH);
+      if (convert == NULL) {
+        continue;
+      }
+
+      seconds = run_kernel(convert, ports, num_frames, num_channels, dest);
+      snprintf(name, sizeof(name), "%s, %zu ch%s", isa_names[i], num_channels,
+               strcmp(isa_names[i], selected) == 0 ? " (selected)" : "");
+      bench_report(name, seconds, num_frames, num_channels);
+    }
+    printf("\n");
+  }
+
+  for (c=0; c < MAX_CHANNELS; ++c) {
+    free(ports[c]);
+  }
+  free(dest);
+  free(signal);
+
+
+  return 0;
+}
@@ -0,0 +1,246 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "cache_line.h"
+
+
+#define BENCH_SECONDS 2
+#define BENCH_PERIOD 256
+#define MAX_CONSUMERS 32
+
+
+
+/* Contention between the JACK thread and the consumer threads on the shared
+state, laid out packed and padded the way flacjacket_globals.h, ring_buffer.h
+and media.h pad it. One producer publishes a ring head and its counters as
+fast as it can, far more often than once per period, while 8 to 32 consumers
+read the configuration and the head and each write the send state of its own
+session. Reports the rate of each side, so the packed and padded layouts can
+be compared for every consumer count. Needs at least as many cores as
+threads to show anything. */
+
+
+
+/* Shared state with every field next to the previous one. */
+struct packed_session_t {
+  uint64_t frame_num;
+  size_t out_len;
+};
+
+struct packed_state_t {
+  unsigned sample_rate;
+  size_t blocksize;
+
+  uint64_t head;
+  uint64_t num_overruns;
+
+  struct packed_session_t sessions[MAX_CONSUMERS];
+};
+
+
+/* Same state with the producer side and each session on its own cache
+lines. */
+struct padded_session_t {
+  CACHE_ALIGNED uint64_t frame_num;
+  size_t out_len;
+};
+
+struct padded_state_t {
+  unsigned sample_rate;
+  size_t blocksize;
+
+  CACHE_ALIGNED uint64_t head;
+  uint64_t num_overruns;
+
+  struct padded_session_t sessions[MAX_CONSUMERS];
+};
+
+
+/* Fields of either layout one thread works on. */
+struct thread_args_t {
+  const unsigned *sample_rate;
+  const size_t *blocksize;
+  uint64_t *head;
+  uint64_t *num_overruns;
+  uint64_t *frame_num;
+  size_t *out_len;
+
+  pthread_t thread_id;
+  uint64_t num_iterations;
+};
+
+
+static volatile bool g_stop;
+static volatile bool g_start;
+
+
+
+
+static void * run_producer(void *arg) {
+
+  struct thread_args_t *args = (struct thread_args_t*) arg;
+  uint64_t head = 0, n = 0;
+
+  while (!g_start);
+
+  while (!g_stop) {
+    head += BENCH_PERIOD;
+    __atomic_store_n(args->head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(args->num_overruns, n & 1, __ATOMIC_RELAXED);
+    ++n;
+  }
+
+  args->num_iterations = n;
+  return NULL;
+}
+
+
+static void * run_consumer(void *arg) {
+
+  struct thread_args_t *args = (struct thread_args_t*) arg;
+  uint64_t head, n = 0;
+
+  while (!g_start);
+
+  while (!g_stop) {
+    head = __atomic_load_n(args->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(args->frame_num,
+                     head / (__atomic_load_n(args->blocksize, __ATOMIC_RELAXED)
+                             + __atomic_load_n(args->sample_rate, __ATOMIC_RELAXED)),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(args->out_len, (size_t) n, __ATOMIC_RELAXED);
+    ++n;
+  }
+
+  args->num_iterations = n;
+  return NULL;
+}
+
+
+
+
+/* Runs the producer and consumers on the fields of one layout for the bench
+duration, and reports the producer's periods and the consumers' iterations per
+second. */
+static void run_layout(const char *name, struct thread_args_t *args,
+                       const size_t num_consumers) {
+
+  struct timespec duration = {BENCH_SECONDS, 0};
+  uint64_t num_consumed = 0;
+  double start, seconds;
+  size_t i;
+
+
+  g_stop = false;
+  g_start = false;
+
+  for (i=0; i <= num_consumers; ++i) {
+    if (pthread_create(&(args[i].thread_id), NULL, i == 0 ? run_producer : run_consumer,
+                       &(args[i])) != 0) {
+      fprintf(stderr, "Cannot start the threads.\n");
+      exit(1);
+    }
+  }
+
+  start = bench_now();
+  g_start = true;
+  nanosleep(&duration, NULL);
+  g_stop = true;
+
+  for (i=0; i <= num_consumers; ++i) {
+    pthread_join(args[i].thread_id, NULL);
+  }
+  seconds = bench_now() - start;
+
+  for (i=1; i <= num_consumers; ++i) {
+    num_consumed += args[i].num_iterations;
+  }
+
+  printf("%-16s %2zu consumers %9.2f M producer periods/s %9.2f M consumer reads/s\n",
+         name, num_consumers, args[0].num_iterations / seconds * 1e-6,
+         num_consumed / seconds * 1e-6);
+}
+
+
+
+
+int main() {
+
+  static const size_t consumer_counts[] = {8, 16, 32};
+  struct packed_state_t *packed;
+  struct padded_state_t *padded;
+  struct thread_args_t args[MAX_CONSUMERS + 1];
+  size_t i, j, num_consumers;
+
+
+  if (posix_memalign((void**) &packed, CACHE_LINE_SIZE, sizeof(struct packed_state_t)) != 0
+      || posix_memalign((void**) &padded, CACHE_LINE_SIZE,
+                        sizeof(struct padded_state_t)) != 0) {
+    fprintf(stderr, "Cannot allocate the shared state.\n");
+    return 1;
+  }
+
+  packed->sample_rate = padded->sample_rate = BENCH_SAMPLE_RATE;
+  packed->blocksize = padded->blocksize = 4096;
+
+
+  printf("%ld cores, %d s per run.\n\n", sysconf(_SC_NPROCESSORS_ONLN), BENCH_SECONDS);
+
+  for (i=0; i < sizeof(consumer_counts) / sizeof(consumer_counts[0]); ++i) {
+    num_consumers = consumer_counts[i];
+
+    for (j=0; j <= num_consumers; ++j) {
+      args[j].sample_rate = &(packed->sample_rate);
+      args[j].blocksize = &(packed->blocksize);
+      args[j].head = &(packed->head);
+      args[j].num_overruns = &(packed->num_overruns);
+      args[j].frame_num = j > 0 ? &(packed->sessions[j-1].frame_num) : NULL;
+      args[j].out_len = j > 0 ? &(packed->sessions[j-1].out_len) : NULL;
+    }
+    run_layout("packed", args, num_consumers);
+
+    for (j=0; j <= num_consumers; ++j) {
+      args[j].sample_rate = &(padded->sample_rate);
+      args[j].blocksize = &(padded->blocksize);
+      args[j].head = &(padded->head);
+      args[j].num_overruns = &(padded->num_overruns);
+      args[j].frame_num = j > 0 ? &(padded->sessions[j-1].frame_num) : NULL;
+      args[j].out_len = j > 0 ? &(padded->sessions[j-1].out_len) : NULL;
+    }
+    run_layout("padded", args, num_consumers);
+
+    printf("\n");
+  }
+
+  free(packed);
+  free(padded);
+
+
+  return 0;
+}
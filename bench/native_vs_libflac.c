@@ -0,0 +1,174 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <FLAC/stream_encoder.h>
+
+#include "bench.h"
+#include "flac_native.h"
+
+
+#define BENCH_SECONDS 30
+#define BENCH_BLOCKSIZE 4096
+
+
+
+/* Throughput of the native engine against libFLAC at level 0, the cheapest
+libFLAC setting and the one the native engine replaces, on the same signal
+with the same blocksize. Also prints the compressed size of each. */
+
+
+
+static FLAC__StreamEncoderWriteStatus count_bytes(const FLAC__StreamEncoder *flac,
+                                                  const FLAC__byte buffer[], size_t bytes,
+                                                  unsigned samples, unsigned current_frame,
+                                                  void *client_data) {
+
+  (void) flac; (void) buffer; (void) samples; (void) current_frame;
+
+  *((size_t*) client_data) += bytes;
+  return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+
+/* Encodes the signal with libFLAC at level 0 and returns the elapsed time,
+setting the number of bytes written. */
+static double run_libflac(const int32_t *samples, const size_t num_frames,
+                          const unsigned num_channels, const unsigned bit_depth,
+                          size_t *num_bytes) {
+
+  FLAC__StreamEncoder *flac = FLAC__stream_encoder_new();
+  double start, end;
+  size_t f;
+
+  *num_bytes = 0;
+
+  FLAC__stream_encoder_set_channels(flac, num_channels);
+  FLAC__stream_encoder_set_bits_per_sample(flac, bit_depth);
+  FLAC__stream_encoder_set_sample_rate(flac, BENCH_SAMPLE_RATE);
+  FLAC__stream_encoder_set_compression_level(flac, 0);
+  FLAC__stream_encoder_set_blocksize(flac, BENCH_BLOCKSIZE);
+  FLAC__stream_encoder_set_do_md5(flac, false);
+
+  if (FLAC__stream_encoder_init_stream(flac, count_bytes, NULL, NULL, NULL, num_bytes)
+      != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+    fprintf(stderr, "Cannot initialize libFLAC.\n");
+    exit(1);
+  }
+
+  start = bench_now();
+  for (f=0; f < num_frames; f += BENCH_BLOCKSIZE) {
+    FLAC__stream_encoder_process_interleaved(flac, &(samples[f * num_channels]),
+                                             BENCH_BLOCKSIZE);
+  }
+  FLAC__stream_encoder_finish(flac);
+  end = bench_now();
+
+  FLAC__stream_encoder_delete(flac);
+  return end - start;
+}
+
+
+/* Encodes the signal with the native engine and returns the elapsed time,
+setting the number of bytes written. */
+static double run_native(const int32_t *samples, const size_t num_frames,
+                         const unsigned num_channels, const unsigned bit_depth,
+                         size_t *num_bytes) {
+
+  struct fj_native_encoder_t encoder;
+  double start, end;
+  size_t f, len;
+
+  if (!native_encoder_init(&encoder, num_channels, bit_depth, BENCH_SAMPLE_RATE,
+                           BENCH_BLOCKSIZE)) {
+    fprintf(stderr, "Cannot initialize the native encoder.\n");
+    exit(1);
+  }
+
+  *num_bytes = NATIVE_HEADER_LEN;
+
+  start = bench_now();
+  for (f=0; f < num_frames; f += BENCH_BLOCKSIZE) {
+    native_encoder_add(&encoder, &(samples[f * num_channels]), 1, num_channels,
+                       BENCH_BLOCKSIZE);
+    native_encoder_encode(&encoder, f / BENCH_BLOCKSIZE, &len);
+    *num_bytes += len;
+  }
+  end = bench_now();
+
+  native_encoder_free(&encoder);
+  return end - start;
+}
+
+
+
+
+int main() {
+
+  static const unsigned channel_counts[] = {2, 8};
+  static const unsigned bit_depths[] = {16, 24};
+  const size_t num_frames = (size_t) BENCH_SECONDS * BENCH_SAMPLE_RATE
+                            / BENCH_BLOCKSIZE * BENCH_BLOCKSIZE;
+  int32_t *samples;
+  char name[64];
+  size_t i, j, libflac_bytes, native_bytes;
+  double seconds;
+
+
+  printf("%zu s of signal at %d Hz, blocksize %d.\n\n", num_frames / BENCH_SAMPLE_RATE,
+         BENCH_SAMPLE_RATE, BENCH_BLOCKSIZE);
+
+  for (i=0; i < sizeof(channel_counts) / sizeof(channel_counts[0]); ++i) {
+    for (j=0; j < sizeof(bit_depths) / sizeof(bit_depths[0]); ++j) {
+
+      samples = (int32_t*) malloc(sizeof(int32_t) * num_frames * channel_counts[i]);
+      if (samples == NULL) {
+        fprintf(stderr, "Cannot allocate the signal.\n");
+        return 1;
+      }
+      bench_fill_signal(samples, num_frames, channel_counts[i], bit_depths[j], 1);
+
+      seconds = run_libflac(samples, num_frames, channel_counts[i], bit_depths[j],
+                            &libflac_bytes);
+      snprintf(name, sizeof(name), "libFLAC level 0, %u ch, %u bits", channel_counts[i],
+               bit_depths[j]);
+      bench_report(name, seconds, num_frames, channel_counts[i]);
+
+      seconds = run_native(samples, num_frames, channel_counts[i], bit_depths[j],
+                           &native_bytes);
+      snprintf(name, sizeof(name), "native, %u ch, %u bits", channel_counts[i],
+               bit_depths[j]);
+      bench_report(name, seconds, num_frames, channel_counts[i]);
+
+      printf("%-44s %9.1f%% libFLAC %.1f%% native\n\n", "  size of PCM",
+             100.0 * libflac_bytes / (num_frames * channel_counts[i] * bit_depths[j] / 8),
+             100.0 * native_bytes / (num_frames * channel_counts[i] * bit_depths[j] / 8));
+
+      free(samples);
+    }
+  }
+
+
+  return 0;
+}
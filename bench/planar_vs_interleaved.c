@@ -0,0 +1,216 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <FLAC/stream_encoder.h>
+
+#include "bench.h"
+#include "convert.h"
+
+
+#define BENCH_SECONDS 30
+#define BENCH_PERIOD 256
+#define BENCH_BLOCKSIZE 4096
+#define BENCH_COMPRESSION_LEVEL 4
+
+
+
+/* Cost of the two sample layouts at both ends of a block's life: the JACK
+callback converting each period of float port buffers into the capture rings,
+and an encoder handing a block to libFLAC at the server's default level. The
+interleaved layout pays for the interleave in the callback and libFLAC undoes
+it; the planar layout converts each port on its own and hands libFLAC one
+pointer per channel. */
+
+
+
+static FLAC__StreamEncoderWriteStatus discard(const FLAC__StreamEncoder *flac,
+                                              const FLAC__byte buffer[], size_t bytes,
+                                              unsigned samples, unsigned current_frame,
+                                              void *client_data) {
+
+  (void) flac; (void) buffer; (void) bytes; (void) samples; (void) current_frame;
+  (void) client_data;
+
+  return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+
+/* Converts every period of the port buffers the way the JACK callback does
+and returns the elapsed time. The destination holds the whole signal in the
+specified layout, as the mirrored rings would. */
+static double run_convert(float * const *ports, const size_t num_frames,
+                          const unsigned num_channels, const unsigned bit_depth,
+                          const bool planar, int32_t *dest) {
+
+  const float scale = (float) ((1 << (bit_depth - 1)) - 1);
+  const float *buffers[8];
+  fj_convert_func_t convert;
+  const char *isa_name;
+  double start, end;
+  size_t f, c;
+
+  convert = convert_select(planar ? 1 : num_channels, bit_depth, &isa_name);
+  if (convert == NULL) {
+    fprintf(stderr, "No conversion kernel for %u channels at %u bits.\n", num_channels,
+            bit_depth);
+    exit(1);
+  }
+
+  start = bench_now();
+  for (f=0; f < num_frames; f += BENCH_PERIOD) {
+    for (c=0; c < num_channels; ++c) {
+      buffers[c] = &(ports[c][f]);
+    }
+    if (planar) {
+      for (c=0; c < num_channels; ++c) {
+        convert(&(buffers[c]), 1, BENCH_PERIOD, scale, &(dest[c * num_frames + f]));
+      }
+    }
+    else {
+      convert(buffers, num_channels, BENCH_PERIOD, scale, &(dest[f * num_channels]));
+    }
+  }
+  end = bench_now();
+
+  return end - start;
+}
+
+
+/* Feeds the converted signal to libFLAC one block at a time the way an
+encoder thread does and returns the elapsed time. */
+static double run_encode(const int32_t *samples, const size_t num_frames,
+                         const unsigned num_channels, const unsigned bit_depth,
+                         const bool planar) {
+
+  FLAC__StreamEncoder *flac = FLAC__stream_encoder_new();
+  const FLAC__int32 *channels[8];
+  double start, end;
+  size_t f, c;
+
+  FLAC__stream_encoder_set_channels(flac, num_channels);
+  FLAC__stream_encoder_set_bits_per_sample(flac, bit_depth);
+  FLAC__stream_encoder_set_sample_rate(flac, BENCH_SAMPLE_RATE);
+  FLAC__stream_encoder_set_compression_level(flac, BENCH_COMPRESSION_LEVEL);
+  FLAC__stream_encoder_set_blocksize(flac, BENCH_BLOCKSIZE);
+  FLAC__stream_encoder_set_do_md5(flac, false);
+
+  if (FLAC__stream_encoder_init_stream(flac, discard, NULL, NULL, NULL, NULL)
+      != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+    fprintf(stderr, "Cannot initialize libFLAC.\n");
+    exit(1);
+  }
+
+  start = bench_now();
+  for (f=0; f < num_frames; f += BENCH_BLOCKSIZE) {
+    if (planar) {
+      for (c=0; c < num_channels; ++c) {
+        channels[c] = &(samples[c * num_frames + f]);
+      }
+      FLAC__stream_encoder_process(flac, channels, BENCH_BLOCKSIZE);
+    }
+    else {
+      FLAC__stream_encoder_process_interleaved(flac, &(samples[f * num_channels]),
+                                               BENCH_BLOCKSIZE);
+    }
+  }
+  FLAC__stream_encoder_finish(flac);
+  end = bench_now();
+
+  FLAC__stream_encoder_delete(flac);
+  return end - start;
+}
+
+
+
+
+int main() {
+
+  static const unsigned channel_counts[] = {2, 8};
+  static const unsigned bit_depths[] = {16, 24};
+  const size_t num_frames = (size_t) BENCH_SECONDS * BENCH_SAMPLE_RATE
+                            / BENCH_BLOCKSIZE * BENCH_BLOCKSIZE;
+  float *ports[8];
+  int32_t *signal, *samples;
+  char name[64];
+  size_t i, j, c, f, layout;
+  double seconds;
+
+
+  printf("%zu s of signal at %d Hz, period %d, blocksize %d, level %d.\n\n",
+         num_frames / BENCH_SAMPLE_RATE, BENCH_SAMPLE_RATE, BENCH_PERIOD,
+         BENCH_BLOCKSIZE, BENCH_COMPRESSION_LEVEL);
+
+  for (i=0; i < sizeof(channel_counts) / sizeof(channel_counts[0]); ++i) {
+
+    /* JACK hands the callback one float buffer per port. */
+    signal = (int32_t*) malloc(sizeof(int32_t) * num_frames * channel_counts[i]);
+    samples = (int32_t*) malloc(sizeof(int32_t) * num_frames * channel_counts[i]);
+    if (signal == NULL || samples == NULL) {
+      fprintf(stderr, "Cannot allocate the signal.\n");
+      return 1;
+    }
+    bench_fill_signal(signal, num_frames, channel_counts[i], 24, 1);
+    memset(samples, 0, sizeof(int32_t) * num_frames * channel_counts[i]);
+
+    for (c=0; c < channel_counts[i]; ++c) {
+      ports[c] = (float*) malloc(sizeof(float) * num_frames);
+      if (ports[c] == NULL) {
+        fprintf(stderr, "Cannot allocate the port buffers.\n");
+        return 1;
+      }
+      for (f=0; f < num_frames; ++f) {
+        ports[c][f] = (float) signal[f * channel_counts[i] + c] / (1 << 23);
+      }
+    }
+
+    for (j=0; j < sizeof(bit_depths) / sizeof(bit_depths[0]); ++j) {
+      for (layout=0; layout < 2; ++layout) {
+
+        seconds = run_convert(ports, num_frames, channel_counts[i], bit_depths[j],
+                              layout == 1, samples);
+        snprintf(name, sizeof(name), "convert %s, %u ch, %u bits",
+                 layout == 1 ? "planar" : "interleaved", channel_counts[i], bit_depths[j]);
+        bench_report(name, seconds, num_frames, channel_counts[i]);
+
+        seconds = run_encode(samples, num_frames, channel_counts[i], bit_depths[j],
+                             layout == 1);
+        snprintf(name, sizeof(name), "encode %s, %u ch, %u bits",
+                 layout == 1 ? "planar" : "interleaved", channel_counts[i], bit_depths[j]);
+        bench_report(name, seconds, num_frames, channel_counts[i]);
+      }
+      printf("\n");
+    }
+
+    for (c=0; c < channel_counts[i]; ++c) {
+      free(ports[c]);
+    }
+    free(samples);
+    free(signal);
+  }
+
+
+  return 0;
+}
@@ -0,0 +1,171 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "audio_memory.h"
+#include "logging.h"
+
+
+
+
+size_t audio_mem_hugepage_size() {
+
+  FILE *meminfo;
+  char line[128];
+  size_t size_kb = 0;
+
+  meminfo = fopen("/proc/meminfo", "r");
+  if (meminfo == NULL) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), meminfo) != NULL) {
+    if (sscanf(line, "Hugepagesize: %zu kB", &size_kb) == 1) break;
+  }
+
+  fclose(meminfo);
+
+  return size_kb * 1024;
+}
+
+
+
+
+size_t audio_mem_transparent_hugepage_size() {
+
+  FILE *pmd_size;
+  size_t size = 0;
+
+  pmd_size = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+  if (pmd_size == NULL) {
+    return 0;
+  }
+
+  if (fscanf(pmd_size, "%zu", &size) != 1) {
+    size = 0;
+  }
+
+  fclose(pmd_size);
+
+  return size;
+}
+
+
+
+
+/* Returns the number of bytes of the mapping the kernel backs with
+transparent hugepages, read from /proc/self/smaps, or zero if it cannot tell. */
+static size_t mapped_hugepage_bytes(const void *addr, size_t num_bytes) {
+
+  FILE *smaps;
+  char line[256];
+  uintptr_t start, end;
+  const uintptr_t first = (uintptr_t) addr, last = (uintptr_t) addr + num_bytes;
+  bool in_range = false;
+  size_t size_kb, total_kb = 0;
+
+  smaps = fopen("/proc/self/smaps", "r");
+  if (smaps == NULL) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), smaps) != NULL) {
+    /* Each mapping starts with its address range, followed by its fields. */
+    if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2) {
+      in_range = start < last && end > first;
+    }
+    else if (in_range
+             && (sscanf(line, "ShmemPmdMapped: %zu kB", &size_kb) == 1
+                 || sscanf(line, "AnonHugePages: %zu kB", &size_kb) == 1)) {
+      total_kb += size_kb;
+    }
+  }
+
+  fclose(smaps);
+
+  return total_kb * 1024;
+}
+
+
+
+
+bool audio_mem_prepare(const struct fj_audio_mem_t *mem, void *addr, size_t num_bytes) {
+
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  volatile uint8_t *bytes = (volatile uint8_t*) addr;
+  struct rlimit limit;
+  bool ok = true;
+  size_t i, num_hugepage_bytes;
+
+
+  /* The advice only affects pages faulted in afterwards. */
+  if (mem->hugepages == HUGEPAGES_TRANSPARENT
+      && madvise(addr, num_bytes, MADV_HUGEPAGE) != 0) {
+    error_log("Cannot use transparent hugepages for audio buffers: %s",
+              strerror(errno));
+    ok = false;
+  }
+
+
+  for (i=0; i < num_bytes; i += page_size) {
+    bytes[i] = bytes[i];
+  }
+
+
+  /* Shared memory only takes the advice if shmem_enabled allows it, which it
+  does not by default. */
+  if (mem->hugepages == HUGEPAGES_TRANSPARENT && ok) {
+    num_hugepage_bytes = mapped_hugepage_bytes(addr, num_bytes);
+    if (num_hugepage_bytes > 0) {
+      info_log("Audio buffers use transparent hugepages for %zu of %zu bytes.",
+               num_hugepage_bytes, num_bytes);
+    }
+    else {
+      info_log("The kernel did not back the audio buffers with transparent "
+               "hugepages. Set /sys/kernel/mm/transparent_hugepage/shmem_enabled "
+               "to advise, or use explicit hugepages.");
+    }
+  }
+
+
+  if (mem->lock && mlock(addr, num_bytes) != 0) {
+    if ((errno == ENOMEM || errno == EPERM) && getrlimit(RLIMIT_MEMLOCK, &limit) == 0) {
+      error_log("Cannot lock %zu bytes of audio buffers, RLIMIT_MEMLOCK is %llu "
+                "bytes. They may be paged out.", num_bytes,
+                (unsigned long long) limit.rlim_cur);
+    }
+    else {
+      error_log("Cannot lock audio buffers in memory: %s", strerror(errno));
+    }
+    ok = false;
+  }
+
+
+  return ok;
+}
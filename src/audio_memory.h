@@ -0,0 +1,67 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef AUDIO_MEMORY_H
+#define AUDIO_MEMORY_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+
+/* Page size used to back the buffers touched by the JACK thread. */
+enum fj_hugepage_mode_t {
+  HUGEPAGES_NONE,
+  HUGEPAGES_TRANSPARENT,   /* Advise transparent hugepages, best-effort: the memfd
+                              rings only get them if the kernel enables them for
+                              shared memory. */
+  HUGEPAGES_EXPLICIT       /* Take pages from the reserved hugetlb pool. */
+};
+
+
+/* How buffers on the realtime audio path are allocated. */
+struct fj_audio_mem_t {
+  bool lock;               /* Lock the buffers in RAM so they are never paged out. */
+  enum fj_hugepage_mode_t hugepages;
+};
+
+
+
+/* Returns the size of the explicit hugepages the kernel allocates by default,
+or zero if it does not support them. */
+size_t audio_mem_hugepage_size();
+
+
+/* Returns the size of the transparent hugepages the kernel maps, or zero if it
+does not support them. */
+size_t audio_mem_transparent_hugepage_size();
+
+
+/* Prepares a mapping of audio memory for the realtime thread. Advises
+transparent hugepages if requested, touches every page so that the first
+accesses from the JACK thread never fault, and locks the mapping in RAM if
+requested. The advice is only a hint, so whether the kernel followed it is
+logged. Failures are reported but not fatal, since the buffers remain usable.
+Returns false if any step failed. */
+bool audio_mem_prepare(const struct fj_audio_mem_t *mem, void *addr, size_t num_bytes);
+
+
+
+#endif /* AUDIO_MEMORY_H */
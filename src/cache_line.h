@@ -0,0 +1,33 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef CACHE_LINE_H
+#define CACHE_LINE_H
+
+
+#define CACHE_LINE_SIZE 64
+
+
+/* Starts a member or type on its own cache line, so that data written by
+different threads never shares a line and bounces between cores. */
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
+
+
+#endif /* CACHE_LINE_H */
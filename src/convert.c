@@ -0,0 +1,453 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define HAVE_X86_KERNELS 1
+  #include <immintrin.h>
+#endif
+
+#include "convert.h"
+
+
+
+#define MAX_CHANNELS 8
+
+
+
+
+/* Scales and saturates one sample. NaN saturates to the positive limit, which
+matches the min/max ordering used by the vector kernels. */
+static inline int32_t convert_sample(float sample, float scale) {
+
+  float scaled = sample * scale;
+
+  if (!(scaled <= scale)) {
+    scaled = scale;
+  }
+  else if (scaled < -scale - 1.0f) {
+    scaled = -scale - 1.0f;
+  }
+
+  return (int32_t) scaled;
+}
+
+
+
+/* Kernel bodies are always inlined into wrappers that pass a constant channel
+count and scale, so each specialization unrolls its channel loop and folds the
+saturation limits into constants. */
+#define KERNEL_BODY static inline __attribute__((always_inline))
+
+
+
+KERNEL_BODY void convert_scalar_body(const float * const *channels, size_t num_channels,
+                                     size_t num_frames, float scale, int32_t *dest) {
+
+  size_t i, j;
+
+  for (i=0; i < num_frames; ++i) {
+    for (j=0; j < num_channels; ++j) {
+      *(dest++) = convert_sample(channels[j][i], scale);
+    }
+  }
+}
+
+
+
+void convert_scalar(const float * const *channels, size_t num_channels,
+                    size_t num_frames, float scale, int32_t *dest) {
+  convert_scalar_body(channels, num_channels, num_frames, scale, dest);
+}
+
+
+
+/* Converts the frames from the specified offset to the end with the scalar
+kernel. Used for the tails the vector kernels cannot cover. */
+KERNEL_BODY void convert_tail(const float * const *channels, size_t num_channels,
+                              size_t offset, size_t num_frames, float scale,
+                              int32_t *dest) {
+
+  const float *tail[MAX_CHANNELS];
+  size_t j;
+
+  if (offset >= num_frames) return;
+
+  for (j=0; j < num_channels; ++j) {
+    tail[j] = &(channels[j][offset]);
+  }
+
+  convert_scalar_body(tail, num_channels, num_frames - offset, scale, dest);
+}
+
+
+
+
+#ifdef HAVE_X86_KERNELS
+
+
+__attribute__((target("sse2")))
+KERNEL_BODY void convert_sse2_body(const float * const *channels, size_t num_channels,
+                                   size_t num_frames, float scale, int32_t *dest) {
+
+  const __m128 vscale = _mm_set1_ps(scale);
+  const __m128 vlow = _mm_set1_ps(-scale - 1.0f);
+  __m128i conv[MAX_CHANNELS];
+  __m128i t0, t1, t2, t3;
+  int32_t tmp[MAX_CHANNELS][4];
+  size_t i, j, k;
+
+
+  for (i=0; i + 4 <= num_frames; i += 4) {
+
+    for (j=0; j < num_channels; ++j) {
+      __m128 x = _mm_mul_ps(_mm_loadu_ps(&(channels[j][i])), vscale);
+      x = _mm_max_ps(_mm_min_ps(x, vscale), vlow);
+      conv[j] = _mm_cvttps_epi32(x);
+    }
+
+
+    switch (num_channels) {
+
+      case (1):
+        _mm_storeu_si128((__m128i*) dest, conv[0]);
+        break;
+
+      case (2):
+        _mm_storeu_si128((__m128i*) dest, _mm_unpacklo_epi32(conv[0], conv[1]));
+        _mm_storeu_si128((__m128i*) (dest + 4), _mm_unpackhi_epi32(conv[0], conv[1]));
+        break;
+
+      case (4):
+      case (8):
+        /* Transpose each group of four channels into four frames. */
+        for (k=0; k < num_channels; k += 4) {
+          t0 = _mm_unpacklo_epi32(conv[k], conv[k+1]);
+          t1 = _mm_unpacklo_epi32(conv[k+2], conv[k+3]);
+          t2 = _mm_unpackhi_epi32(conv[k], conv[k+1]);
+          t3 = _mm_unpackhi_epi32(conv[k+2], conv[k+3]);
+
+          _mm_storeu_si128((__m128i*) (dest + k), _mm_unpacklo_epi64(t0, t1));
+          _mm_storeu_si128((__m128i*) (dest + k + num_channels),
+                           _mm_unpackhi_epi64(t0, t1));
+          _mm_storeu_si128((__m128i*) (dest + k + 2*num_channels),
+                           _mm_unpacklo_epi64(t2, t3));
+          _mm_storeu_si128((__m128i*) (dest + k + 3*num_channels),
+                           _mm_unpackhi_epi64(t2, t3));
+        }
+        break;
+
+      default:
+        for (j=0; j < num_channels; ++j) {
+          _mm_storeu_si128((__m128i*) tmp[j], conv[j]);
+        }
+        for (k=0; k < 4; ++k) {
+          for (j=0; j < num_channels; ++j) {
+            dest[k*num_channels + j] = tmp[j][k];
+          }
+        }
+        break;
+    }
+
+    dest += 4 * num_channels;
+  }
+
+
+  convert_tail(channels, num_channels, i, num_frames, scale, dest);
+}
+
+
+
+
+__attribute__((target("avx2")))
+KERNEL_BODY void convert_avx2_body(const float * const *channels, size_t num_channels,
+                                   size_t num_frames, float scale, int32_t *dest) {
+
+  const __m256 vscale = _mm256_set1_ps(scale);
+  const __m256 vlow = _mm256_set1_ps(-scale - 1.0f);
+  __m256i conv[MAX_CHANNELS];
+  __m256i t[MAX_CHANNELS], u[MAX_CHANNELS];
+  int32_t tmp[MAX_CHANNELS][8];
+  size_t i, j, k;
+
+
+  for (i=0; i + 8 <= num_frames; i += 8) {
+
+    for (j=0; j < num_channels; ++j) {
+      __m256 x = _mm256_mul_ps(_mm256_loadu_ps(&(channels[j][i])), vscale);
+      x = _mm256_max_ps(_mm256_min_ps(x, vscale), vlow);
+      conv[j] = _mm256_cvttps_epi32(x);
+    }
+
+
+    switch (num_channels) {
+
+      case (1):
+        _mm256_storeu_si256((__m256i*) dest, conv[0]);
+        break;
+
+      case (2):
+        t[0] = _mm256_unpacklo_epi32(conv[0], conv[1]);
+        t[1] = _mm256_unpackhi_epi32(conv[0], conv[1]);
+        _mm256_storeu_si256((__m256i*) dest, _mm256_permute2x128_si256(t[0], t[1], 0x20));
+        _mm256_storeu_si256((__m256i*) (dest + 8),
+                            _mm256_permute2x128_si256(t[0], t[1], 0x31));
+        break;
+
+      case (4):
+        /* 4x8 transpose: each 128-bit lane of u holds one frame, frames 0-3 in
+        the low lanes and 4-7 in the high ones. */
+        t[0] = _mm256_unpacklo_epi32(conv[0], conv[1]);
+        t[1] = _mm256_unpackhi_epi32(conv[0], conv[1]);
+        t[2] = _mm256_unpacklo_epi32(conv[2], conv[3]);
+        t[3] = _mm256_unpackhi_epi32(conv[2], conv[3]);
+
+        u[0] = _mm256_unpacklo_epi64(t[0], t[2]);
+        u[1] = _mm256_unpackhi_epi64(t[0], t[2]);
+        u[2] = _mm256_unpacklo_epi64(t[1], t[3]);
+        u[3] = _mm256_unpackhi_epi64(t[1], t[3]);
+
+        _mm256_storeu_si256((__m256i*) dest, _mm256_permute2x128_si256(u[0], u[1], 0x20));
+        _mm256_storeu_si256((__m256i*) (dest + 8),
+                            _mm256_permute2x128_si256(u[2], u[3], 0x20));
+        _mm256_storeu_si256((__m256i*) (dest + 16),
+                            _mm256_permute2x128_si256(u[0], u[1], 0x31));
+        _mm256_storeu_si256((__m256i*) (dest + 24),
+                            _mm256_permute2x128_si256(u[2], u[3], 0x31));
+        break;
+
+      case (8):
+        /* 8x8 transpose: interleave pairs, then quads within each 128-bit lane,
+        then swap lanes to put frames 0-3 and 4-7 together. */
+        for (k=0; k < 8; k += 4) {
+          t[k]   = _mm256_unpacklo_epi32(conv[k], conv[k+1]);
+          t[k+1] = _mm256_unpackhi_epi32(conv[k], conv[k+1]);
+          t[k+2] = _mm256_unpacklo_epi32(conv[k+2], conv[k+3]);
+          t[k+3] = _mm256_unpackhi_epi32(conv[k+2], conv[k+3]);
+
+          u[k]   = _mm256_unpacklo_epi64(t[k], t[k+2]);
+          u[k+1] = _mm256_unpackhi_epi64(t[k], t[k+2]);
+          u[k+2] = _mm256_unpacklo_epi64(t[k+1], t[k+3]);
+          u[k+3] = _mm256_unpackhi_epi64(t[k+1], t[k+3]);
+        }
+        for (k=0; k < 4; ++k) {
+          _mm256_storeu_si256((__m256i*) (dest + 8*k),
+                              _mm256_permute2x128_si256(u[k], u[k+4], 0x20));
+          _mm256_storeu_si256((__m256i*) (dest + 8*(k+4)),
+                              _mm256_permute2x128_si256(u[k], u[k+4], 0x31));
+        }
+        break;
+
+      default:
+        for (j=0; j < num_channels; ++j) {
+          _mm256_storeu_si256((__m256i*) tmp[j], conv[j]);
+        }
+        for (k=0; k < 8; ++k) {
+          for (j=0; j < num_channels; ++j) {
+            dest[k*num_channels + j] = tmp[j][k];
+          }
+        }
+        break;
+    }
+
+    dest += 8 * num_channels;
+  }
+
+
+  convert_tail(channels, num_channels, i, num_frames, scale, dest);
+}
+
+
+
+
+__attribute__((target("avx512f")))
+KERNEL_BODY void convert_avx512_body(const float * const *channels, size_t num_channels,
+                                     size_t num_frames, float scale, int32_t *dest) {
+
+  const __m512 vscale = _mm512_set1_ps(scale);
+  const __m512 vlow = _mm512_set1_ps(-scale - 1.0f);
+  const __m512i vindex = _mm512_mullo_epi32(
+      _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0),
+      _mm512_set1_epi32((int) num_channels));
+  __mmask16 mask;
+  size_t i, j;
+
+
+  /* Scatter stores interleave any channel count, and masked loads and stores
+  cover the tail without a scalar loop. */
+  for (i=0; i < num_frames; i += 16) {
+
+    mask = num_frames - i >= 16 ? 0xFFFF
+                                : (__mmask16) ((1u << (num_frames - i)) - 1);
+
+    for (j=0; j < num_channels; ++j) {
+      __m512 x = _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, &(channels[j][i])), vscale);
+      x = _mm512_max_ps(_mm512_min_ps(x, vscale), vlow);
+      _mm512_mask_i32scatter_epi32(dest + j, mask, vindex, _mm512_cvttps_epi32(x), 4);
+    }
+
+    dest += 16 * num_channels;
+  }
+}
+
+
+#endif /* HAVE_X86_KERNELS */
+
+
+
+
+
+/* Specializations of each kernel body for every supported channel count and
+bit depth. The channel count and scale arguments are ignored in favor of the
+constants the kernel was compiled for. */
+
+#define TARGET_scalar
+#define TARGET_sse2 __attribute__((target("sse2")))
+#define TARGET_avx2 __attribute__((target("avx2")))
+#define TARGET_avx512 __attribute__((target("avx512f")))
+
+#define MAX_MAGNITUDE(depth) ((float) ((1 << ((depth) - 1)) - 1))
+
+#define DEFINE_KERNEL(isa, nc, depth) \
+  TARGET_##isa static void convert_##isa##_##nc##_##depth( \
+      const float * const *channels, size_t num_channels, size_t num_frames, \
+      float scale, int32_t *dest) { \
+    (void) num_channels; \
+    (void) scale; \
+    convert_##isa##_body(channels, nc, num_frames, MAX_MAGNITUDE(depth), dest); \
+  }
+
+#define KERNEL_ENTRY(isa, nc, depth) convert_##isa##_##nc##_##depth,
+
+#define FOR_EACH_DEPTH(F, isa, nc) \
+  F(isa, nc, 8) F(isa, nc, 12) F(isa, nc, 16) F(isa, nc, 20) F(isa, nc, 24)
+
+#define FOR_EACH_CHANNEL_COUNT(G, isa) \
+  G(isa, 1) G(isa, 2) G(isa, 3) G(isa, 4) G(isa, 5) G(isa, 6) G(isa, 7) G(isa, 8)
+
+#define DEFINE_KERNEL_ROW(isa, nc) FOR_EACH_DEPTH(DEFINE_KERNEL, isa, nc)
+#define KERNEL_ROW(isa, nc) { FOR_EACH_DEPTH(KERNEL_ENTRY, isa, nc) },
+
+#define NUM_DEPTHS 5
+
+#define DEFINE_KERNEL_TABLE(isa) \
+  FOR_EACH_CHANNEL_COUNT(DEFINE_KERNEL_ROW, isa) \
+  static const fj_convert_func_t kernels_##isa[MAX_CHANNELS][NUM_DEPTHS] = { \
+    FOR_EACH_CHANNEL_COUNT(KERNEL_ROW, isa) \
+  };
+
+
+DEFINE_KERNEL_TABLE(scalar)
+
+#ifdef HAVE_X86_KERNELS
+DEFINE_KERNEL_TABLE(sse2)
+DEFINE_KERNEL_TABLE(avx2)
+DEFINE_KERNEL_TABLE(avx512)
+#endif
+
+
+
+
+
+/* Channel counts the AVX-512 kernel is selected for. Its scatter stores
+interleave any count, but bench/convert_kernels measured them slower than the
+AVX2 transposes for 1, 2, 4 and 8 channels, and faster than the AVX2 kernel's
+scalar interleave for the other counts. */
+static const bool avx512_preferred[MAX_CHANNELS] = {
+  false, false, true, false, true, true, true, false
+};
+
+
+
+
+fj_convert_func_t convert_select_isa(const char *isa_name, size_t num_channels,
+                                     size_t bit_depth) {
+
+  size_t depth_ind;
+
+  switch (bit_depth) {
+    case (8):  depth_ind = 0; break;
+    case (12): depth_ind = 1; break;
+    case (16): depth_ind = 2; break;
+    case (20): depth_ind = 3; break;
+    case (24): depth_ind = 4; break;
+    default:
+      return NULL;
+  }
+
+  if (num_channels < 1 || num_channels > MAX_CHANNELS) {
+    return NULL;
+  }
+
+
+  if (strcmp(isa_name, "scalar") == 0) {
+    return kernels_scalar[num_channels - 1][depth_ind];
+  }
+
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+
+  if (strcmp(isa_name, "AVX-512") == 0 && __builtin_cpu_supports("avx512f")) {
+    return kernels_avx512[num_channels - 1][depth_ind];
+  }
+
+  if (strcmp(isa_name, "AVX2") == 0 && __builtin_cpu_supports("avx2")) {
+    return kernels_avx2[num_channels - 1][depth_ind];
+  }
+
+  if (strcmp(isa_name, "SSE2") == 0 && __builtin_cpu_supports("sse2")) {
+    return kernels_sse2[num_channels - 1][depth_ind];
+  }
+#endif
+
+  return NULL;
+}
+
+
+
+
+fj_convert_func_t convert_select(size_t num_channels, size_t bit_depth,
+                                 const char **isa_name) {
+
+  static const char * const isa_names[] = {"AVX-512", "AVX2", "SSE2", "scalar"};
+  fj_convert_func_t kernel;
+  size_t i;
+
+  if (num_channels < 1 || num_channels > MAX_CHANNELS) {
+    return NULL;
+  }
+
+  for (i=0; i < sizeof(isa_names) / sizeof(isa_names[0]); ++i) {
+    if (i == 0 && !avx512_preferred[num_channels - 1]) {
+      continue;
+    }
+
+    kernel = convert_select_isa(isa_names[i], num_channels, bit_depth);
+    if (kernel != NULL) {
+      *isa_name = isa_names[i];
+      return kernel;
+    }
+  }
+
+  return NULL;
+}
@@ -0,0 +1,60 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/* Scales planar float samples by the specified magnitude, saturates them to
+the range of the output bit depth, converts them to integers and interleaves
+them into the destination. */
+typedef void (*fj_convert_func_t)(const float * const *channels, size_t num_channels,
+                                  size_t num_frames, float scale, int32_t *dest);
+
+
+
+/* Returns the fastest conversion kernel supported by the running CPU that is
+specialized for the specified channel count and bit depth, and sets the name
+of the instruction set it uses. AVX-512 is only chosen for the channel counts
+bench/convert_kernels measured it faster at. The returned kernel ignores its
+channel count and scale arguments. Returns NULL if the layout is not
+supported. */
+fj_convert_func_t convert_select(size_t num_channels, size_t bit_depth,
+                                 const char **isa_name);
+
+
+/* Returns the kernel of the named instruction set, as set by convert_select(),
+for the specified channel count and bit depth, or NULL if the running CPU or
+the layout does not support it. Lets the kernels be compared directly. */
+fj_convert_func_t convert_select_isa(const char *isa_name, size_t num_channels,
+                                     size_t bit_depth);
+
+
+/* Portable conversion kernel used when no vector instructions are available. */
+void convert_scalar(const float * const *channels, size_t num_channels,
+                    size_t num_frames, float scale, int32_t *dest);
+
+
+
+#endif /* CONVERT_H */
@@ -0,0 +1,335 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Defining DITHER_PORTABLE builds the portable lane loop on x86 as well, so
+the two can be compared. */
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(DITHER_PORTABLE)
+  #define HAVE_X86_KERNELS 1
+  #include <immintrin.h>
+#endif
+
+#include "dither.h"
+
+
+
+#define LANES 4
+#define MAX_ERROR 2.0f      /* LSBs of feedback, only reached while clipping. */
+#define TPDF_SCALE (1.0f / 65536.0f)
+
+
+/* First-order highpass shaping. */
+static const float shaped_taps[] = {1.0f};
+
+/* Lipshitz, Vanderkooy and Wannamaker's modified E-weighted filter. */
+static const float lipshitz_taps[] = {2.033f, -2.165f, 1.959f, -1.590f, 0.6149f};
+
+
+
+
+/* Returns whether every sample of the channel is zero. */
+static bool channel_silent(const int32_t *samples, const size_t num_frames,
+                           const size_t stride) {
+
+  size_t i;
+
+  for (i=0; i < num_frames; ++i) {
+    if (samples[i * stride] != 0) return false;
+  }
+
+  return true;
+}
+
+
+/* Rounds every sample to the nearest output step without dither. Each sample
+is treated alike, so the layout does not matter. */
+static void round_block(const struct fj_dither_t *dither, const int32_t *in,
+                        const size_t len, int32_t *out) {
+
+  const int32_t half = (int32_t) 1 << (dither->shift - 1);
+  int32_t q;
+  size_t i;
+
+  for (i=0; i < len; ++i) {
+    q = (in[i] + half) >> dither->shift;
+    if (q > dither->max) q = dither->max;
+    if (q < -dither->max - 1) q = -dither->max - 1;
+    out[i] = q;
+  }
+}
+
+
+
+
+#ifdef HAVE_X86_KERNELS
+
+
+/* Dithers the channels of one group of four lanes. In interleaved blocks the
+four channels of a full group are adjacent in every frame, so each frame is
+one load and one store. Otherwise silent and missing lanes read from a zero
+sample that does not advance. */
+static void dither_group(struct fj_dither_t *dither, const size_t group,
+                         const int32_t *in, const size_t num_frames, const bool planar,
+                         int32_t *out) {
+
+  static const int32_t zero = 0;
+  const size_t num_channels = dither->num_channels;
+  const size_t num_lanes = num_channels - group < LANES ? num_channels - group : LANES;
+  const size_t stride = planar ? 1 : num_channels;
+  const bool contiguous = !planar && num_lanes == LANES;
+  const int32_t *src[LANES];
+  int32_t *dest[LANES];
+  size_t step[LANES], base;
+  int32_t live[LANES] = {0, 0, 0, 0};
+  int32_t lanes[LANES];
+  __m128 taps[DITHER_MAX_TAPS], errors[DITHER_MAX_TAPS];
+  __m128 v, y, err, live_mask;
+  __m128i x, rng, start_rng, q;
+  const __m128 step_size = _mm_set1_ps(dither->step);
+  const __m128 high = _mm_set1_ps((float) dither->max);
+  const __m128 low = _mm_set1_ps((float) -dither->max - 1.0f);
+  const __m128 max_error = _mm_set1_ps(MAX_ERROR);
+  const __m128 tpdf_scale = _mm_set1_ps(TPDF_SCALE);
+  const __m128i low_half = _mm_set1_epi32(0xFFFF);
+  size_t i, k, l;
+
+
+  for (l=0; l < LANES; ++l) {
+    src[l] = &zero;
+    dest[l] = NULL;
+    step[l] = 0;
+    if (l < num_lanes) {
+      base = planar ? (group + l) * num_frames : group + l;
+      dest[l] = &(out[base]);
+      if (!channel_silent(&(in[base]), num_frames, stride)) {
+        src[l] = &(in[base]);
+        step[l] = stride;
+        live[l] = -1;
+      }
+    }
+  }
+  live_mask = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) live));
+
+  /* Silent lanes leave the block with no shaping history and their noise
+  generator untouched, as in the portable loop. */
+  for (k=0; k < dither->num_taps; ++k) {
+    taps[k] = _mm_set1_ps(dither->taps[k]);
+    errors[k] = _mm_and_ps(_mm_loadu_ps(&(dither->errors[k][group])), live_mask);
+  }
+  rng = _mm_loadu_si128((const __m128i*) &(dither->rng[group]));
+  start_rng = rng;
+
+
+  for (i=0; i < num_frames; ++i) {
+
+    if (contiguous) {
+      x = _mm_loadu_si128((const __m128i*) &(in[i * num_channels + group]));
+    }
+    else {
+      x = _mm_set_epi32(src[3][i * step[3]], src[2][i * step[2]],
+                        src[1][i * step[1]], src[0][i * step[0]]);
+    }
+
+    v = _mm_mul_ps(_mm_cvtepi32_ps(x), step_size);
+    for (k=0; k < dither->num_taps; ++k) {
+      v = _mm_sub_ps(v, _mm_mul_ps(taps[k], errors[k]));
+    }
+
+    /* The difference of the two halves of a uniform word is triangular. */
+    rng = _mm_xor_si128(rng, _mm_slli_epi32(rng, 13));
+    rng = _mm_xor_si128(rng, _mm_srli_epi32(rng, 17));
+    rng = _mm_xor_si128(rng, _mm_slli_epi32(rng, 5));
+
+    y = _mm_add_ps(v, _mm_mul_ps(_mm_cvtepi32_ps(_mm_sub_epi32(_mm_and_si128(rng, low_half),
+                                                               _mm_srli_epi32(rng, 16))),
+                                 tpdf_scale));
+    y = _mm_max_ps(_mm_min_ps(y, high), low);
+    q = _mm_cvtps_epi32(y);
+
+    err = _mm_sub_ps(_mm_cvtepi32_ps(q), v);
+    err = _mm_max_ps(_mm_min_ps(err, max_error), _mm_sub_ps(_mm_setzero_ps(), max_error));
+    err = _mm_and_ps(err, live_mask);
+
+    for (k=dither->num_taps; k > 1; --k) {
+      errors[k-1] = errors[k-2];
+    }
+    if (dither->num_taps > 0) {
+      errors[0] = err;
+    }
+
+    q = _mm_and_si128(q, _mm_castps_si128(live_mask));
+    if (contiguous) {
+      _mm_storeu_si128((__m128i*) &(out[i * num_channels + group]), q);
+    }
+    else {
+      _mm_storeu_si128((__m128i*) lanes, q);
+      for (l=0; l < num_lanes; ++l) {
+        dest[l][i * stride] = lanes[l];
+      }
+    }
+  }
+
+
+  for (k=0; k < dither->num_taps; ++k) {
+    _mm_storeu_ps(&(dither->errors[k][group]), errors[k]);
+  }
+  rng = _mm_or_si128(_mm_and_si128(rng, _mm_castps_si128(live_mask)),
+                     _mm_andnot_si128(_mm_castps_si128(live_mask), start_rng));
+  _mm_storeu_si128((__m128i*) &(dither->rng[group]), rng);
+}
+
+
+#else
+
+
+/* Portable version of the lane loop, one channel at a time. */
+static void dither_group(struct fj_dither_t *dither, const size_t group,
+                         const int32_t *in, const size_t num_frames, const bool planar,
+                         int32_t *out) {
+
+  const size_t num_channels = dither->num_channels;
+  const size_t num_lanes = num_channels - group < LANES ? num_channels - group : LANES;
+  const size_t stride = planar ? 1 : num_channels;
+  const float high = (float) dither->max;
+  const float low = (float) -dither->max - 1.0f;
+  float v, y, err;
+  uint32_t rng;
+  int32_t q;
+  size_t i, k, l, c, base;
+
+
+  for (l=0; l < num_lanes; ++l) {
+    c = group + l;
+    base = planar ? c * num_frames : c;
+
+    if (channel_silent(&(in[base]), num_frames, stride)) {
+      for (i=0; i < num_frames; ++i) {
+        out[base + i * stride] = 0;
+      }
+      for (k=0; k < dither->num_taps; ++k) {
+        dither->errors[k][c] = 0.0f;
+      }
+      continue;
+    }
+
+    rng = dither->rng[c];
+
+    for (i=0; i < num_frames; ++i) {
+      v = (float) in[base + i * stride] * dither->step;
+      for (k=0; k < dither->num_taps; ++k) {
+        v -= dither->taps[k] * dither->errors[k][c];
+      }
+
+      rng ^= rng << 13;
+      rng ^= rng >> 17;
+      rng ^= rng << 5;
+
+      y = v + (float) ((int32_t) (rng & 0xFFFF) - (int32_t) (rng >> 16)) * TPDF_SCALE;
+      y = fmaxf(fminf(y, high), low);
+      q = (int32_t) lrintf(y);
+
+      err = fmaxf(fminf((float) q - v, MAX_ERROR), -MAX_ERROR);
+      for (k=dither->num_taps; k > 1; --k) {
+        dither->errors[k-1][c] = dither->errors[k-2][c];
+      }
+      if (dither->num_taps > 0) {
+        dither->errors[0][c] = err;
+      }
+
+      out[base + i * stride] = q;
+    }
+
+    dither->rng[c] = rng;
+  }
+}
+
+
+#endif /* HAVE_X86_KERNELS */
+
+
+
+
+
+
+bool dither_init(struct fj_dither_t *dither, const enum fj_dither_mode_t mode,
+                 const size_t num_channels, const unsigned in_bit_depth,
+                 const unsigned out_bit_depth) {
+
+  size_t i;
+
+
+  if (num_channels < 1 || num_channels > DITHER_MAX_CHANNELS
+      || out_bit_depth < 2 || out_bit_depth >= in_bit_depth) {
+    return false;
+  }
+
+  memset(dither, 0, sizeof(struct fj_dither_t));
+
+  dither->mode = mode;
+  dither->num_channels = num_channels;
+  dither->shift = in_bit_depth - out_bit_depth;
+  dither->step = 1.0f / (float) (1u << dither->shift);
+  dither->max = ((int32_t) 1 << (out_bit_depth - 1)) - 1;
+
+  switch (mode) {
+    case (DITHER_SHAPED):
+      dither->num_taps = sizeof(shaped_taps) / sizeof(float);
+      memcpy(dither->taps, shaped_taps, sizeof(shaped_taps));
+      break;
+
+    case (DITHER_LIPSHITZ):
+      dither->num_taps = sizeof(lipshitz_taps) / sizeof(float);
+      memcpy(dither->taps, lipshitz_taps, sizeof(lipshitz_taps));
+      break;
+
+    default:
+      break;
+  }
+
+  /* Distinct nonzero seeds keep the channels' noise uncorrelated. */
+  for (i=0; i < DITHER_MAX_CHANNELS; ++i) {
+    dither->rng[i] = 0x9E3779B9u * (uint32_t) (i + 1);
+  }
+
+
+  return true;
+}
+
+
+
+
+void dither_requantize(struct fj_dither_t *dither, const int32_t *in,
+                       const size_t num_frames, const bool planar, int32_t *out) {
+
+  size_t group;
+
+  if (dither->mode == DITHER_NONE) {
+    round_block(dither, in, num_frames * dither->num_channels, out);
+    return;
+  }
+
+  for (group=0; group < dither->num_channels; group += LANES) {
+    dither_group(dither, group, in, num_frames, planar, out);
+  }
+}
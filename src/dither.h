@@ -0,0 +1,82 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef DITHER_H
+#define DITHER_H
+
+
+#define DITHER_MAX_CHANNELS 8
+#define DITHER_MAX_TAPS 5
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/* Requantization applied when a stream's samples are reduced from the capture
+bit depth to the stream's output bit depth. */
+enum fj_dither_mode_t {
+  DITHER_NONE,          /* Round to the nearest output step. */
+  DITHER_TPDF,          /* Triangular dither of one LSB peak, spectrally flat. */
+  DITHER_SHAPED,        /* TPDF with first-order error feedback pushing noise up. */
+  DITHER_LIPSHITZ       /* TPDF with five-tap E-weighted shaping for 44.1-48 kHz. */
+};
+
+
+/* Requantizer state of one stream, carried between blocks and only used by
+the stream's encoder thread. Everything is allocated with the state, so
+requantizing never allocates. Channels are processed four at a time, one per
+vector lane, so the per-channel arrays are lane-major. */
+struct fj_dither_t {
+  enum fj_dither_mode_t mode;
+  size_t num_channels;
+  unsigned shift;               /* Input bits dropped by the requantization. */
+  float step;                   /* Size of one input LSB in output LSBs. */
+  int32_t max;                  /* Largest output magnitude. */
+
+  size_t num_taps;
+  float taps[DITHER_MAX_TAPS];  /* Error feedback coefficients, newest error first. */
+
+  uint32_t rng[DITHER_MAX_CHANNELS];                   /* Xorshift state of each channel. */
+  float errors[DITHER_MAX_TAPS][DITHER_MAX_CHANNELS];  /* Past requantization errors. */
+};
+
+
+
+/* Initializes the state requantizing the specified number of channels from
+the input to the output bit depth with the specified mode. Returns false if
+the channel count is not supported or the output is not narrower than the
+input. */
+bool dither_init(struct fj_dither_t *dither, const enum fj_dither_mode_t mode,
+                 const size_t num_channels, const unsigned in_bit_depth,
+                 const unsigned out_bit_depth);
+
+
+/* Requantizes a block of samples, interleaved or stored as one run per channel
+when planar, into the output in the same layout. The output may be the input.
+A channel that is digitally silent for the whole block is written as zeros and
+its shaping history is cleared, so silence stays exactly zero. */
+void dither_requantize(struct fj_dither_t *dither, const int32_t *in,
+                       const size_t num_frames, const bool planar, int32_t *out);
+
+
+
+#endif /* DITHER_H */
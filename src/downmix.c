@@ -0,0 +1,326 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define HAVE_X86_KERNELS 1
+  #include <immintrin.h>
+#endif
+
+#include "downmix.h"
+
+
+#define SURROUND_GAIN 0.70710678f   /* -3 dB, for centre and surround channels. */
+#define LANES 8
+
+
+
+
+/* Sets the offset of the first sample of every channel and returns the
+distance between frames for the layout. */
+static size_t channel_offsets(const size_t num_channels, const size_t num_frames,
+                              const bool planar, size_t *offsets) {
+
+  size_t i;
+
+  for (i=0; i < num_channels; ++i) {
+    offsets[i] = planar ? i * num_frames : i;
+  }
+
+  return planar ? 1 : num_channels;
+}
+
+
+/* Mixes frames first to last of one output channel. */
+static void mix_frames_scalar(const struct fj_downmix_t *downmix, const size_t out_channel,
+                              const int32_t *in, const size_t *in_offsets,
+                              const size_t in_step, int32_t *dest, const size_t out_step,
+                              const size_t first, const size_t last) {
+
+  const size_t num_taps = downmix->num_taps[out_channel];
+  const unsigned char *inputs = downmix->inputs[out_channel];
+  const float *gains = downmix->gains[out_channel];
+  size_t f, k;
+  float acc;
+
+  for (f=first; f < last; ++f) {
+    acc = 0.0f;
+    for (k=0; k < num_taps; ++k) {
+      acc += gains[k] * (float) in[in_offsets[inputs[k]] + f * in_step];
+    }
+    acc = fminf(fmaxf(acc, downmix->min_sample), downmix->max_sample);
+    dest[f * out_step] = (int32_t) lrintf(acc);
+  }
+}
+
+
+static void mix_scalar(const struct fj_downmix_t *downmix, const int32_t *in,
+                       const size_t num_frames, const bool planar, int32_t *out) {
+
+  size_t in_offsets[DOWNMIX_MAX_CHANNELS], out_offsets[DOWNMIX_MAX_CHANNELS];
+  size_t in_step, out_step, c;
+
+  in_step = channel_offsets(downmix->num_in_channels, num_frames, planar, in_offsets);
+  out_step = channel_offsets(downmix->num_out_channels, num_frames, planar, out_offsets);
+
+  for (c=0; c < downmix->num_out_channels; ++c) {
+    mix_frames_scalar(downmix, c, in, in_offsets, in_step, &(out[out_offsets[c]]), out_step,
+                      0, num_frames);
+  }
+}
+
+
+
+
+#ifdef HAVE_X86_KERNELS
+
+
+/* Eight frames at a time, gathering interleaved inputs. Multiplies and adds
+separately, in the scalar order, so the output is bit-exact with it. */
+__attribute__((target("avx2")))
+static void mix_avx2(const struct fj_downmix_t *downmix, const int32_t *in,
+                     const size_t num_frames, const bool planar, int32_t *out) {
+
+  size_t in_offsets[DOWNMIX_MAX_CHANNELS], out_offsets[DOWNMIX_MAX_CHANNELS];
+  const __m256 min_sample = _mm256_set1_ps(downmix->min_sample);
+  const __m256 max_sample = _mm256_set1_ps(downmix->max_sample);
+  int32_t lanes[LANES];
+  __m256i offsets, samples;
+  __m256 acc;
+  size_t in_step, out_step, c, f, k, j;
+
+  in_step = channel_offsets(downmix->num_in_channels, num_frames, planar, in_offsets);
+  out_step = channel_offsets(downmix->num_out_channels, num_frames, planar, out_offsets);
+  offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                               _mm256_set1_epi32((int) in_step));
+
+  for (c=0; c < downmix->num_out_channels; ++c) {
+    int32_t *dest = &(out[out_offsets[c]]);
+
+    for (f=0; f + LANES <= num_frames; f += LANES) {
+      acc = _mm256_setzero_ps();
+
+      for (k=0; k < downmix->num_taps[c]; ++k) {
+        const int32_t *src = &(in[in_offsets[downmix->inputs[c][k]] + f * in_step]);
+
+        samples = planar ? _mm256_loadu_si256((const __m256i*) src)
+                         : _mm256_i32gather_epi32((const int*) src, offsets, 4);
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(downmix->gains[c][k]),
+                                               _mm256_cvtepi32_ps(samples)));
+      }
+
+      acc = _mm256_min_ps(_mm256_max_ps(acc, min_sample), max_sample);
+      samples = _mm256_cvtps_epi32(acc);
+
+      if (planar) {
+        _mm256_storeu_si256((__m256i*) &(dest[f]), samples);
+      }
+      else {
+        _mm256_storeu_si256((__m256i*) lanes, samples);
+        for (j=0; j < LANES; ++j) {
+          dest[(f + j) * out_step] = lanes[j];
+        }
+      }
+    }
+
+    mix_frames_scalar(downmix, c, in, in_offsets, in_step, dest, out_step, f, num_frames);
+  }
+}
+
+
+#endif /* HAVE_X86_KERNELS */
+
+
+
+
+/* Returns the index of the first channel with one of the names, or -1. */
+static int find_channel(const char * const *channel_names, const size_t num_channels,
+                        const char *name, const char *alt_name) {
+
+  size_t i;
+
+  for (i=0; i < num_channels; ++i) {
+    if (strcmp(channel_names[i], name) == 0
+        || (alt_name != NULL && strcmp(channel_names[i], alt_name) == 0)) {
+      return (int) i;
+    }
+  }
+
+  return -1;
+}
+
+
+/* Fills the full stereo matrix from the channel names: fronts go to their
+side at unity, centres to both sides and surrounds to their side at -3 dB, and
+the LFE is dropped. */
+static void stereo_gains(const char * const *channel_names, const size_t num_channels,
+                         float gains[][DOWNMIX_MAX_CHANNELS]) {
+
+  const char *name;
+  size_t i;
+
+  for (i=0; i < num_channels; ++i) {
+    name = channel_names[i];
+
+    if (strcmp(name, "Mono") == 0) {
+      gains[0][i] = gains[1][i] = 1.0f;
+    }
+    else if (strcmp(name, "Left") == 0 || strcmp(name, "Front Left") == 0) {
+      gains[0][i] = 1.0f;
+    }
+    else if (strcmp(name, "Right") == 0 || strcmp(name, "Front Right") == 0) {
+      gains[1][i] = 1.0f;
+    }
+    else if (strstr(name, "Center") != NULL) {
+      gains[0][i] = gains[1][i] = SURROUND_GAIN;
+    }
+    else if (strstr(name, "Left") != NULL) {
+      gains[0][i] = SURROUND_GAIN;
+    }
+    else if (strstr(name, "Right") != NULL) {
+      gains[1][i] = SURROUND_GAIN;
+    }
+  }
+}
+
+
+
+
+bool downmix_init(struct fj_downmix_t *downmix, const struct fj_downmix_config_t *config,
+                  const char * const *channel_names, const size_t num_in_channels,
+                  const float max_magnitude) {
+
+  float gains[DOWNMIX_MAX_CHANNELS][DOWNMIX_MAX_CHANNELS] = {{0.0f}};
+  float sum, max_sum = 0.0f;
+  int left, right, lfe;
+  size_t c, i;
+
+
+  memset(downmix, 0, sizeof(struct fj_downmix_t));
+
+  if (num_in_channels < 1 || num_in_channels > DOWNMIX_MAX_CHANNELS) {
+    return false;
+  }
+
+  downmix->preset = config->preset;
+  downmix->num_in_channels = num_in_channels;
+
+  switch (config->preset) {
+    case (DOWNMIX_STEREO):
+      downmix->num_out_channels = 2;
+      stereo_gains(channel_names, num_in_channels, gains);
+      break;
+
+    case (DOWNMIX_FRONT_PAIR):
+      left = find_channel(channel_names, num_in_channels, "Front Left", "Left");
+      right = find_channel(channel_names, num_in_channels, "Front Right", "Right");
+      if (left < 0 || right < 0) {
+        return false;
+      }
+      downmix->num_out_channels = 2;
+      gains[0][left] = 1.0f;
+      gains[1][right] = 1.0f;
+      break;
+
+    case (DOWNMIX_LFE):
+      lfe = find_channel(channel_names, num_in_channels, "LFE", NULL);
+      if (lfe < 0) {
+        return false;
+      }
+      downmix->num_out_channels = 1;
+      gains[0][lfe] = 1.0f;
+      break;
+
+    case (DOWNMIX_CUSTOM):
+      if (config->num_out_channels < 1 || config->num_out_channels > DOWNMIX_MAX_CHANNELS) {
+        return false;
+      }
+      downmix->num_out_channels = config->num_out_channels;
+      memcpy(gains, config->gains, sizeof(gains));
+      break;
+
+    default:
+      return false;
+  }
+
+
+  /* Presets scale every output by the same factor, which keeps the balance
+  between them. */
+  for (c=0; c < downmix->num_out_channels; ++c) {
+    sum = 0.0f;
+    for (i=0; i < num_in_channels; ++i) {
+      sum += fabsf(gains[c][i]);
+    }
+    max_sum = fmaxf(max_sum, sum);
+  }
+
+  for (c=0; c < downmix->num_out_channels; ++c) {
+    for (i=0; i < num_in_channels; ++i) {
+      if (config->preset != DOWNMIX_CUSTOM && max_sum > 1.0f) {
+        gains[c][i] /= max_sum;
+      }
+      if (gains[c][i] != 0.0f) {
+        downmix->inputs[c][downmix->num_taps[c]] = (unsigned char) i;
+        downmix->gains[c][downmix->num_taps[c]] = gains[c][i];
+        ++downmix->num_taps[c];
+      }
+    }
+  }
+
+  downmix->min_sample = -max_magnitude - 1.0f;
+  downmix->max_sample = max_magnitude;
+
+
+  downmix->mix = mix_scalar;
+
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    downmix->mix = mix_avx2;
+  }
+#endif
+
+
+  return true;
+}
+
+
+
+
+const char * downmix_name(const enum fj_downmix_preset_t preset) {
+
+  switch (preset) {
+    case (DOWNMIX_STEREO):
+      return "stereo";
+    case (DOWNMIX_FRONT_PAIR):
+      return "front pair";
+    case (DOWNMIX_LFE):
+      return "LFE";
+    case (DOWNMIX_CUSTOM):
+      return "custom";
+    default:
+      return "none";
+  }
+}
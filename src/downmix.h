@@ -0,0 +1,94 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef DOWNMIX_H
+#define DOWNMIX_H
+
+
+#define DOWNMIX_MAX_CHANNELS 8
+#define MAX_NUM_DOWNMIXES 4
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/* Channel layouts derived from the JACK channels for clients that cannot use
+all of them. */
+enum fj_downmix_preset_t {
+  DOWNMIX_NONE,         /* Ends the list of configured downmixes. */
+  DOWNMIX_STEREO,       /* Fold every channel into 2.0 with ITU-R BS.775 gains. */
+  DOWNMIX_FRONT_PAIR,   /* Front left and right only. */
+  DOWNMIX_LFE,          /* LFE alone as mono, for a subwoofer amplifier. */
+  DOWNMIX_CUSTOM        /* Matrix given in the configuration. */
+};
+
+
+/* Configuration of one downmixed stream. */
+struct fj_downmix_config_t {
+  enum fj_downmix_preset_t preset;
+  unsigned char num_out_channels;     /* Custom matrix only. */
+  float gains[DOWNMIX_MAX_CHANNELS][DOWNMIX_MAX_CHANNELS];   /* Custom only, [out][in]. */
+};
+
+
+struct fj_downmix_t;
+
+/* Mixes a block of integer frames, interleaved or one run per channel when
+planar, into the output in the same layout. */
+typedef void (*fj_mix_func_t)(const struct fj_downmix_t *downmix, const int32_t *in,
+                              const size_t num_frames, const bool planar, int32_t *out);
+
+
+/* Downmix matrix, stored per output channel as the list of inputs with a
+nonzero gain so channel subsets cost a copy. Immutable once initialized and
+shared by every encoder of the layout. */
+struct fj_downmix_t {
+  enum fj_downmix_preset_t preset;
+  size_t num_in_channels;
+  size_t num_out_channels;
+
+  size_t num_taps[DOWNMIX_MAX_CHANNELS];
+  unsigned char inputs[DOWNMIX_MAX_CHANNELS][DOWNMIX_MAX_CHANNELS];
+  float gains[DOWNMIX_MAX_CHANNELS][DOWNMIX_MAX_CHANNELS];
+
+  float min_sample;         /* Saturation limits of the output bit depth. */
+  float max_sample;
+  fj_mix_func_t mix;
+};
+
+
+
+/* Builds the matrix for the configuration from the names of the input
+channels. Preset gains are scaled down where needed so no output can clip,
+custom gains are used as given and the output saturates. Returns false if the
+input layout lacks a channel the preset needs. */
+bool downmix_init(struct fj_downmix_t *downmix, const struct fj_downmix_config_t *config,
+                  const char * const *channel_names, const size_t num_in_channels,
+                  const float max_magnitude);
+
+
+/* Returns a short description of the preset for logging. */
+const char * downmix_name(const enum fj_downmix_preset_t preset);
+
+
+
+#endif /* DOWNMIX_H */
@@ -0,0 +1,512 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "flacjacket_globals.h"
+#include "encode_pool.h"
+#include "encoder.h"
+#include "events.h"
+#include "flac_frame.h"
+#include "flac_native.h"
+#include "logging.h"
+
+
+
+
+/* Prepares a free segment to be filled as the segment with the specified
+sequence number. */
+static void reset_segment(struct fj_segment_t *segment, const uint64_t seq) {
+  segment->seq = seq;
+  segment->num_filled = 0;
+  segment->done = false;
+  segment->failed = false;
+  segment->output_len = 0;
+  segment->num_frames = 0;
+}
+
+
+
+
+/* Encoder callback of the pool threads that appends each frame to the output
+of the segment being encoded, renumbered to its position in the stream.
+Metadata, the silent frames that realign a reused stream and anything
+flushed while no segment is being encoded are dropped. Clients receive the
+header of the encoder. */
+static FLAC__StreamEncoderWriteStatus segment_flac_callback(const FLAC__StreamEncoder *flac,
+                                                            const FLAC__byte *buffer,
+                                                            size_t bytes, unsigned samples,
+                                                            unsigned current_frame,
+                                                            void *client_data) {
+
+  struct fj_pool_thread_t *thread = (struct fj_pool_thread_t*) client_data;
+  struct fj_segment_t *segment = thread->segment;
+  uint64_t frame_num;
+  FLAC__byte *output;
+  size_t capacity, len;
+
+
+  if (samples == 0 || segment == NULL) {
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+  }
+
+  if (thread->num_fillers > 0) {
+    --thread->num_fillers;
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+  }
+
+  if (segment->num_frames == thread->pool->frames_per_segment) {
+    error_log("Too many frames in encoder segment.");
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+  }
+
+
+  if (segment->output_capacity < segment->output_len + bytes + MAX_FRAME_NUMBER_LEN) {
+    capacity = segment->output_len + bytes + MAX_FRAME_NUMBER_LEN;
+    output = (FLAC__byte*) realloc(segment->output, 2 * capacity);
+    if (output == NULL) {
+      error_log("Cannot allocate frame memory.");
+      return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    }
+    segment->output = output;
+    segment->output_capacity = 2 * capacity;
+  }
+
+  output = &(segment->output[segment->output_len]);
+  frame_num = segment->seq * thread->pool->frames_per_segment + segment->num_frames;
+
+  if (frame_num == current_frame) {
+    memcpy(output, buffer, bytes);
+    len = bytes;
+  }
+  else {
+    len = flac_frame_renumber(buffer, bytes, frame_num, output);
+    if (len == 0) {
+      error_log("Cannot renumber FLAC frame.");
+      return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    }
+  }
+
+  segment->frame_lens[segment->num_frames] = len;
+  segment->frame_samples[segment->num_frames] = samples;
+  ++segment->num_frames;
+  segment->output_len += len;
+
+
+  return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+
+
+
+/* Feeds frames to the thread's stream, interleaved or, when planar, stored as
+one run of the specified length per channel. */
+static bool feed_flac(struct fj_pool_thread_t *thread, const int32_t *samples,
+                      const size_t run_len, const size_t num_frames) {
+
+  const FLAC__int32 *channels[8];
+  size_t i;
+
+  if (g_shared.planar) {
+    for (i=0; i < thread->pool->encoder->profile.num_channels; ++i) {
+      channels[i] = &(samples[i * run_len]);
+    }
+    return FLAC__stream_encoder_process(thread->flac, channels, num_frames);
+  }
+
+  return FLAC__stream_encoder_process_interleaved(thread->flac, samples, num_frames);
+}
+
+
+/* Encodes a whole segment on the thread's libFLAC stream, which is opened for
+the first segment and then reused. libFLAC only encodes a frame once the
+sample after it arrives, so one zero sample follows each segment to push out
+its last frame. The stream then holds that zero, which the next segment tops
+up with silence to a whole frame and drops, so its own frames start on the
+stream's frame boundaries. The silent frame costs a constant subframe per
+channel, far less than initializing a stream. Returns false if the segment
+could not be encoded, in which case the stream is closed. */
+static bool encode_segment(struct fj_pool_thread_t *thread, struct fj_segment_t *segment) {
+
+  struct fj_encode_pool_t *pool = thread->pool;
+  struct fj_encoder_t *encoder = pool->encoder;
+  bool ok;
+
+
+  thread->segment = segment;
+
+  if (thread->primed) {
+    thread->num_fillers = 1;
+    ok = feed_flac(thread, pool->zeros, encoder->blocksize, encoder->blocksize - 1);
+  }
+  else {
+    thread->num_fillers = 0;
+    ok = encoder_init_flac(encoder, thread->flac, encoder->level,
+                           segment_flac_callback, thread);
+  }
+  thread->primed = ok;
+
+  ok = ok && feed_flac(thread, segment->samples, pool->segment_len, pool->segment_len)
+       && feed_flac(thread, pool->zeros, encoder->blocksize, 1)
+       && segment->num_frames == pool->frames_per_segment;
+
+
+  /* Start the next segment on a fresh stream, discarding what is flushed. */
+  if (!ok) {
+    thread->segment = NULL;
+    FLAC__stream_encoder_finish(thread->flac);
+    thread->primed = false;
+  }
+
+  return ok;
+}
+
+
+
+
+/* Encodes a segment on the encoder thread with the native engine after its
+pool thread failed. Both engines write frames of the same blocksize, so the
+frames fit the stream of the encoder's header. Returns false if the native
+engine cannot be started either. */
+static bool encode_segment_native(struct fj_encode_pool_t *pool,
+                                  struct fj_segment_t *segment) {
+
+  struct fj_encoder_t *encoder = pool->encoder;
+  const size_t num_channels = encoder->profile.num_channels;
+  struct fj_native_encoder_t native;
+  const FLAC__byte *frame;
+  FLAC__byte *output;
+  size_t i, len;
+
+
+  if (!native_encoder_init(&native, num_channels, encoder->profile.bit_depth,
+                           encoder->profile.sample_rate, encoder->blocksize)) {
+    return false;
+  }
+
+  segment->output_len = 0;
+  segment->num_frames = 0;
+
+  for (i=0; i < pool->frames_per_segment; ++i) {
+    if (g_shared.planar) {
+      native_encoder_add(&native, &(segment->samples[i * encoder->blocksize]),
+                         pool->segment_len, 1, encoder->blocksize);
+    }
+    else {
+      native_encoder_add(&native, &(segment->samples[i * encoder->blocksize * num_channels]),
+                         1, num_channels, encoder->blocksize);
+    }
+    frame = native_encoder_encode(&native, segment->seq * pool->frames_per_segment + i,
+                                  &len);
+
+    if (segment->output_capacity < segment->output_len + len) {
+      output = (FLAC__byte*) realloc(segment->output, 2 * (segment->output_len + len));
+      if (output == NULL) {
+        native_encoder_free(&native);
+        return false;
+      }
+      segment->output = output;
+      segment->output_capacity = 2 * (segment->output_len + len);
+    }
+
+    memcpy(&(segment->output[segment->output_len]), frame, len);
+    segment->frame_lens[i] = len;
+    segment->frame_samples[i] = encoder->blocksize;
+    segment->output_len += len;
+    ++segment->num_frames;
+  }
+
+  native_encoder_free(&native);
+  return true;
+}
+
+
+
+
+void * run_encode_pool_thread(void *args) {
+
+  struct fj_pool_thread_t *thread = (struct fj_pool_thread_t*) args;
+  struct fj_encode_pool_t *pool = thread->pool;
+  struct fj_segment_t *segment;
+
+
+  while (event_wait(&(pool->work_event), 1)) {
+
+    pthread_mutex_lock(&(pool->lock));
+
+    if (pool->stopping) {
+      pthread_mutex_unlock(&(pool->lock));
+      break;
+    }
+
+    if (pool->num_taken == pool->num_dispatched) {
+      event_clear(pool->work_event);
+      pthread_mutex_unlock(&(pool->lock));
+      continue;
+    }
+
+    segment = &(pool->segments[pool->num_taken++ % pool->num_segments]);
+
+    pthread_mutex_unlock(&(pool->lock));
+
+
+    if (!encode_segment(thread, segment)) {
+      segment->failed = true;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    segment->done = true;
+    pthread_mutex_unlock(&(pool->lock));
+
+    /* Wake the encoder thread to publish the frames. */
+    event_signal(pool->encoder->block_event);
+  }
+
+
+  return NULL;
+}
+
+
+
+
+
+
+bool encode_pool_init(struct fj_encode_pool_t *pool, struct fj_encoder_t *encoder,
+                      size_t num_threads) {
+
+  struct fj_segment_t *segment;
+  size_t i;
+
+
+  memset(pool, 0, sizeof(struct fj_encode_pool_t));
+
+  pool->encoder = encoder;
+  pool->num_threads = num_threads < MAX_ENCODE_THREADS ? num_threads : MAX_ENCODE_THREADS;
+
+  /* A segment is a whole number of frames and at least one block long, so a
+  block never spans more than two segments. */
+  pool->frames_per_segment = (encoder->max_block_frames + encoder->blocksize - 1)
+                             / encoder->blocksize;
+  if (pool->frames_per_segment < SEGMENT_MIN_FRAMES) {
+    pool->frames_per_segment = SEGMENT_MIN_FRAMES;
+  }
+  pool->segment_len = pool->frames_per_segment * encoder->blocksize;
+
+  /* One segment per thread, plus the one filling and a spare. */
+  pool->num_segments = pool->num_threads + 2;
+
+  pthread_mutex_init(&(pool->lock), NULL);
+  pool->work_event = event_create();
+
+  pool->segments = (struct fj_segment_t*) calloc(pool->num_segments,
+                                                 sizeof(struct fj_segment_t));
+  pool->zeros = (int32_t*) calloc(encoder->blocksize * encoder->profile.num_channels,
+                                  sizeof(int32_t));
+  if (pool->work_event < 0 || pool->segments == NULL || pool->zeros == NULL) {
+    return false;
+  }
+
+  for (i=0; i < pool->num_segments; ++i) {
+    segment = &(pool->segments[i]);
+    segment->samples = (int32_t*) malloc(sizeof(int32_t) * pool->segment_len
+                                         * encoder->profile.num_channels);
+    segment->frame_lens = (size_t*) malloc(sizeof(size_t) * pool->frames_per_segment);
+    segment->frame_samples = (unsigned*) malloc(sizeof(unsigned) * pool->frames_per_segment);
+    if (segment->samples == NULL || segment->frame_lens == NULL
+        || segment->frame_samples == NULL) {
+      return false;
+    }
+  }
+
+  reset_segment(&(pool->segments[0]), 0);
+
+
+  for (i=0; i < pool->num_threads; ++i) {
+    pool->threads[i].pool = pool;
+    pool->threads[i].flac = FLAC__stream_encoder_new();
+    if (pool->threads[i].flac == NULL) {
+      return false;
+    }
+    if (pthread_create(&(pool->threads[i].thread_id), NULL, run_encode_pool_thread,
+                       &(pool->threads[i])) != 0) {
+      FLAC__stream_encoder_delete(pool->threads[i].flac);
+      pool->threads[i].flac = NULL;
+      return false;
+    }
+    ++pool->num_started;
+  }
+
+  /* Frames are only published once their whole segment is encoded. */
+  info_log("Started %zu encoder pool threads with %zu frames per segment, adding up to "
+           "%.1f ms of latency.", pool->num_threads, pool->frames_per_segment,
+           1000.0 * pool->segment_len / encoder->profile.sample_rate);
+
+
+  return true;
+}
+
+
+
+
+void encode_pool_destroy(struct fj_encode_pool_t *pool) {
+
+  size_t i;
+
+
+  pthread_mutex_lock(&(pool->lock));
+  pool->stopping = true;
+  pthread_mutex_unlock(&(pool->lock));
+
+  if (pool->work_event >= 0) {
+    event_signal(pool->work_event);
+  }
+
+  for (i=0; i < pool->num_started; ++i) {
+    pthread_join(pool->threads[i].thread_id, NULL);
+  }
+
+  for (i=0; i < pool->num_threads; ++i) {
+    if (pool->threads[i].flac != NULL) {
+      pool->threads[i].segment = NULL;
+      FLAC__stream_encoder_delete(pool->threads[i].flac);
+    }
+  }
+  free(pool->zeros);
+
+
+  if (pool->segments != NULL) {
+    for (i=0; i < pool->num_segments; ++i) {
+      free(pool->segments[i].samples);
+      free(pool->segments[i].output);
+      free(pool->segments[i].frame_lens);
+      free(pool->segments[i].frame_samples);
+    }
+    free(pool->segments);
+  }
+
+  if (pool->work_event >= 0) {
+    close(pool->work_event);
+  }
+
+  pthread_mutex_destroy(&(pool->lock));
+}
+
+
+
+
+bool encode_pool_can_feed(struct fj_encode_pool_t *pool) {
+
+  bool can_feed;
+
+  pthread_mutex_lock(&(pool->lock));
+  can_feed = pool->num_dispatched - pool->num_published + 2 <= pool->num_segments;
+  pthread_mutex_unlock(&(pool->lock));
+
+  return can_feed;
+}
+
+
+
+
+void encode_pool_feed(struct fj_encode_pool_t *pool, const struct fj_block_t *block) {
+
+  struct fj_segment_t *segment;
+  size_t num_channels = pool->encoder->profile.num_channels;
+  size_t block_len = block->len / num_channels;
+  size_t offset = 0, num_copied, i;
+
+
+  while (offset < block_len) {
+
+    segment = &(pool->segments[pool->num_dispatched % pool->num_segments]);
+
+    num_copied = pool->segment_len - segment->num_filled;
+    if (num_copied > block_len - offset) num_copied = block_len - offset;
+
+    if (g_shared.planar) {
+      for (i=0; i < num_channels; ++i) {
+        memcpy(&(segment->samples[i * pool->segment_len + segment->num_filled]),
+               &(block->samples[i * block_len + offset]),
+               sizeof(int32_t) * num_copied);
+      }
+    }
+    else {
+      memcpy(&(segment->samples[segment->num_filled * num_channels]),
+             &(block->samples[offset * num_channels]),
+             sizeof(int32_t) * num_copied * num_channels);
+    }
+
+    segment->num_filled += num_copied;
+    offset += num_copied;
+
+
+    /* Hand the full segment to the pool and start filling the next one,
+    which encode_pool_can_feed() has checked is free. */
+    if (segment->num_filled == pool->segment_len) {
+      pthread_mutex_lock(&(pool->lock));
+      ++pool->num_dispatched;
+      pthread_mutex_unlock(&(pool->lock));
+
+      reset_segment(&(pool->segments[pool->num_dispatched % pool->num_segments]),
+                    pool->num_dispatched);
+
+      event_signal(pool->work_event);
+    }
+  }
+}
+
+
+
+
+size_t encode_pool_publish(struct fj_encode_pool_t *pool) {
+
+  struct fj_segment_t *segment;
+  size_t num_published = 0, offset, i;
+  bool done;
+
+
+  while (1) {
+
+    pthread_mutex_lock(&(pool->lock));
+    segment = &(pool->segments[pool->num_published % pool->num_segments]);
+    done = pool->num_published < pool->num_dispatched && segment->done;
+    pthread_mutex_unlock(&(pool->lock));
+
+    if (!done) break;
+
+    if (segment->failed && !encode_segment_native(pool, segment)) {
+      error_log("Cannot encode segment %" PRIu64 ", skipping %zu frames.", segment->seq,
+                pool->frames_per_segment);
+      segment->num_frames = 0;
+    }
+
+    offset = 0;
+    for (i=0; i < segment->num_frames; ++i) {
+      encoder_publish_frame(pool->encoder, &(segment->output[offset]),
+                            segment->frame_lens[i], segment->frame_samples[i]);
+      offset += segment->frame_lens[i];
+    }
+    num_published += segment->num_frames;
+
+    pthread_mutex_lock(&(pool->lock));
+    ++pool->num_published;
+    pthread_mutex_unlock(&(pool->lock));
+  }
+
+
+  return num_published;
+}
@@ -0,0 +1,127 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef ENCODE_POOL_H
+#define ENCODE_POOL_H
+
+
+#define MAX_ENCODE_THREADS 32
+#define SEGMENT_MIN_FRAMES 2
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include <FLAC/stream_encoder.h>
+
+#include "sample_block.h"
+
+
+struct fj_encoder_t;
+
+
+
+/* Run of consecutive FLAC frames encoded independently by one pool thread.
+Segment n holds frames n * frames_per_segment onwards. */
+struct fj_segment_t {
+  uint64_t seq;
+  int32_t *samples;         /* Interleaved, or one run per channel when planar. */
+  size_t num_filled;        /* Samples per channel copied in so far. */
+  bool done;                /* Encoded and waiting to be published, guarded by the pool lock. */
+  bool failed;              /* The pool thread could not encode it, set before done. */
+
+  FLAC__byte *output;       /* Encoded frames back to back. */
+  size_t output_len;
+  size_t output_capacity;
+  size_t *frame_lens;
+  unsigned *frame_samples;
+  size_t num_frames;
+};
+
+
+/* Thread of the pool with its own libFLAC stream, kept open from one segment
+to the next. */
+struct fj_pool_thread_t {
+  struct fj_encode_pool_t *pool;
+  pthread_t thread_id;
+  FLAC__StreamEncoder *flac;
+  bool primed;                    /* The stream is open and holds one zero sample. */
+  size_t num_fillers;             /* Silent frames to drop before the segment's own. */
+  struct fj_segment_t *segment;   /* Segment being encoded, or NULL to drop frames. */
+};
+
+
+/* Pool encoding consecutive segments of one encoder's stream on several
+cores. The encoder thread fills segments from sample blocks and publishes
+the encoded frames in order; the pool threads encode whole segments. */
+struct fj_encode_pool_t {
+  struct fj_encoder_t *encoder;
+
+  struct fj_pool_thread_t threads[MAX_ENCODE_THREADS];
+  size_t num_threads;
+  size_t num_started;
+
+  struct fj_segment_t *segments;   /* Segment n is stored at segments[n % num_segments]. */
+  size_t num_segments;
+  size_t segment_len;              /* Samples per channel in each segment. */
+  size_t frames_per_segment;
+  int32_t *zeros;                  /* One frame of silence, interleaved or planar. */
+
+  pthread_mutex_t lock;            /* Guards the counters below and the done flags. */
+  int work_event;                  /* Signaled when segments are dispatched. */
+  uint64_t num_dispatched;         /* Segments handed to the pool, also the one filling. */
+  uint64_t num_taken;              /* Segments taken by pool threads. */
+  uint64_t num_published;          /* Segments published by the encoder thread. */
+  bool stopping;
+};
+
+
+
+/* Allocates the segments and starts the pool threads for the encoder.
+Returns false if they cannot be created. */
+bool encode_pool_init(struct fj_encode_pool_t *pool, struct fj_encoder_t *encoder,
+                      size_t num_threads);
+
+/* Joins the pool threads and frees the segments. */
+void encode_pool_destroy(struct fj_encode_pool_t *pool);
+
+
+/* Returns whether the pool can take a whole block: the segment being filled
+plus a free one in case the block crosses into the next segment. */
+bool encode_pool_can_feed(struct fj_encode_pool_t *pool);
+
+/* Copies a block into the segments being filled and dispatches each segment
+that becomes full. */
+void encode_pool_feed(struct fj_encode_pool_t *pool, const struct fj_block_t *block);
+
+/* Publishes the frames of every encoded segment that is next in order. A
+segment the pool failed to encode is encoded again by the native engine, so
+the stream has no gap. Returns the number of frames published. */
+size_t encode_pool_publish(struct fj_encode_pool_t *pool);
+
+
+/* Runs a pool thread encoding dispatched segments. */
+void * run_encode_pool_thread(void *args);
+
+
+
+#endif /* ENCODE_POOL_H */
@@ -0,0 +1,1461 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "flacjacket_globals.h"
+#include "downmix.h"
+#include "encoder.h"
+#include "encode_pool.h"
+#include "events.h"
+#include "flac_frame.h"
+#include "flac_native.h"
+#include "http_sends.h"
+#include "logging.h"
+#include "lpcm.h"
+#include "ogg_flac.h"
+#include "resampler.h"
+
+
+
+
+bool encoder_publish_frame(struct fj_encoder_t *encoder, const FLAC__byte *buffer,
+                           size_t bytes, unsigned samples) {
+
+  struct fj_frame_t *frame;
+  FLAC__byte *data;
+  char chunk_header[CHUNK_HEADER_SIZE];
+  size_t chunk_header_len, len;
+
+
+  ++encoder->num_flac_frames;
+
+  if (encoder->ogg != NULL) {
+    if (!ogg_muxer_add_frame(encoder->ogg, buffer, bytes, samples)) {
+      error_log("Cannot allocate Ogg page memory.");
+      return false;
+    }
+    if (encoder->ogg->output_len == 0) {
+      return true;
+    }
+    buffer = encoder->ogg->output;
+    bytes = encoder->ogg->output_len;
+    samples = encoder->ogg->output_samples;
+  }
+
+
+  pthread_mutex_lock(&(encoder->lock));
+
+  frame = &(encoder->frames[encoder->num_frames % encoder->queue_len]);
+
+  chunk_header_len = format_chunk_header(bytes, chunk_header, CHUNK_HEADER_SIZE);
+  len = chunk_header_len + bytes + 2;
+
+  if (frame->capacity < len) {
+    data = (FLAC__byte*) realloc(frame->data, len);
+    if (data == NULL) {
+      pthread_mutex_unlock(&(encoder->lock));
+      error_log("Cannot allocate frame memory.");
+      return false;
+    }
+    frame->data = data;
+    frame->capacity = len;
+  }
+
+  memcpy(frame->data, chunk_header, chunk_header_len);
+  memcpy(&(frame->data[chunk_header_len]), buffer, bytes);
+  memcpy(&(frame->data[chunk_header_len + bytes]), "\r\n", 2);
+  frame->len = len;
+  frame->num_samples = samples;
+  frame->sample_num = encoder->num_samples;
+  encoder->num_samples += samples;
+  ++encoder->num_frames;
+
+  pthread_mutex_unlock(&(encoder->lock));
+
+
+  return true;
+}
+
+
+
+
+/* Encoder callback that stores metadata in the stream header and publishes
+each audio frame to the frame queue. Frames from a libFLAC encoder that
+replaced an earlier one are renumbered to continue the stream. */
+static FLAC__StreamEncoderWriteStatus queue_flac_callback(const FLAC__StreamEncoder *flac,
+                                                          const FLAC__byte *buffer,
+                                                          size_t bytes, unsigned samples,
+                                                          unsigned current_frame,
+                                                          void *client_data) {
+
+  struct fj_encoder_t *encoder = (struct fj_encoder_t*) client_data;
+  FLAC__byte *data;
+
+
+  /* Metadata is written with zero samples before the first frame. Clients
+  only ever see the header of the first libFLAC encoder. */
+  if (samples == 0) {
+    if (encoder->header_done) {
+      return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+    }
+
+    pthread_mutex_lock(&(encoder->lock));
+
+    if (encoder->header_len + bytes > MAX_HEADER_LEN) {
+      pthread_mutex_unlock(&(encoder->lock));
+      error_log("FLAC stream header too large.");
+      return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    }
+    memcpy(&(encoder->header[encoder->header_len]), buffer, bytes);
+    encoder->header_len += bytes;
+
+    pthread_mutex_unlock(&(encoder->lock));
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+  }
+
+
+  if (encoder->frame_offset > 0) {
+    if (encoder->renumber_capacity < bytes + MAX_FRAME_NUMBER_LEN) {
+      data = (FLAC__byte*) realloc(encoder->renumber_buffer, bytes + MAX_FRAME_NUMBER_LEN);
+      if (data == NULL) {
+        error_log("Cannot allocate frame memory.");
+        return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+      }
+      encoder->renumber_buffer = data;
+      encoder->renumber_capacity = bytes + MAX_FRAME_NUMBER_LEN;
+    }
+
+    data = encoder->renumber_buffer;
+    bytes = flac_frame_renumber(buffer, bytes, encoder->frame_offset + current_frame, data);
+    if (bytes == 0) {
+      error_log("Cannot renumber FLAC frame.");
+      return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+    }
+    buffer = data;
+  }
+
+
+  if (!encoder_publish_frame(encoder, buffer, bytes, samples)) {
+    return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+  }
+
+  return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+
+
+
+/* Frees the encoder and its frame queue. */
+static void free_encoder(struct fj_encoder_t *encoder) {
+
+  size_t i;
+
+  if (encoder->pool != NULL) {
+    encode_pool_destroy(encoder->pool);
+    free(encoder->pool);
+  }
+
+  if (encoder->native != NULL) {
+    native_encoder_free(encoder->native);
+    free(encoder->native);
+  }
+
+  if (encoder->ogg != NULL) {
+    ogg_muxer_free(encoder->ogg);
+    free(encoder->ogg);
+  }
+
+  if (encoder->flac != NULL) {
+    FLAC__stream_encoder_finish(encoder->flac);
+    FLAC__stream_encoder_delete(encoder->flac);
+  }
+
+  if (encoder->frames != NULL) {
+    for (i=0; i < encoder->queue_len; ++i) {
+      free(encoder->frames[i].data);
+    }
+    free(encoder->frames);
+  }
+
+  if (encoder->block != NULL) {
+    block_unref(encoder->block);
+  }
+
+  if (encoder->zero_block != NULL) {
+    block_unref(encoder->zero_block);
+  }
+
+  if (encoder->resampler != NULL) {
+    resampler_free(encoder->resampler);
+    free(encoder->resampler);
+  }
+
+  free(encoder->dither);
+
+  if (encoder->staged != NULL) {
+    block_unref(encoder->staged);
+  }
+
+  if (encoder->mixed != NULL) {
+    block_unref(encoder->mixed);
+  }
+
+  if (encoder->block_event >= 0) {
+    close(encoder->block_event);
+  }
+  free(encoder->subscribers);
+  free(encoder->renumber_buffer);
+  free(encoder->pcm_buffer);
+
+  pthread_mutex_destroy(&(encoder->lock));
+  free(encoder);
+}
+
+
+
+
+bool encoder_init_flac(struct fj_encoder_t *encoder, FLAC__StreamEncoder *flac,
+                       const unsigned level, FLAC__StreamEncoderWriteCallback callback,
+                       void *client_data) {
+
+  FLAC__bool ok = true;
+  FLAC__StreamEncoderInitStatus init_status;
+
+
+  ok &= FLAC__stream_encoder_set_compression_level(flac, level);
+  ok &= FLAC__stream_encoder_set_channels(flac, encoder->profile.num_channels);
+  ok &= FLAC__stream_encoder_set_bits_per_sample(flac, encoder->profile.bit_depth);
+  ok &= FLAC__stream_encoder_set_sample_rate(flac, encoder->profile.sample_rate);
+
+  /* A live stream is never rewound to store the checksum in the header. */
+  ok &= FLAC__stream_encoder_set_do_md5(flac, false);
+
+  /* Overrides the blocksize picked by the compression level. */
+  if (g_shared.flac_blocksize > 0) {
+    ok &= FLAC__stream_encoder_set_blocksize(flac, g_shared.flac_blocksize);
+  }
+
+  if (ok) {
+    init_status = FLAC__stream_encoder_init_stream(flac, callback, NULL, NULL, NULL,
+                                                   client_data);
+    if (init_status != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+      error_log("Failed to initialize encoder: %s",
+                FLAC__StreamEncoderInitStatusString[init_status]);
+      ok = false;
+    }
+  }
+
+
+  return ok;
+}
+
+
+
+
+/* Creates a libFLAC encoder for the encoder's profile at the specified
+compression level and initializes its stream. Returns NULL on failure. */
+static FLAC__StreamEncoder * init_flac(struct fj_encoder_t *encoder, const unsigned level) {
+
+  FLAC__StreamEncoder *flac;
+
+  flac = FLAC__stream_encoder_new();
+
+  if (flac == NULL) {
+    return NULL;
+  }
+
+  if (!encoder_init_flac(encoder, flac, level, queue_flac_callback, encoder)) {
+    FLAC__stream_encoder_delete(flac);
+    return NULL;
+  }
+
+  return flac;
+}
+
+
+
+
+/* Encodes one frame of digital silence with the native encoder, which is
+valid in streams of either engine since it matches the stream's blocksize and
+format. Frame numbers are rewritten whenever the frame is published. */
+static bool create_silent_frame(struct fj_encoder_t *encoder) {
+
+  struct fj_native_encoder_t native;
+  const FLAC__byte *frame;
+  size_t len;
+
+
+  if (!native_encoder_init(&native, encoder->profile.num_channels,
+                           encoder->profile.bit_depth, encoder->profile.sample_rate,
+                           encoder->blocksize)) {
+    return false;
+  }
+
+  while (native.num_filled < native.blocksize) {
+    native_encoder_add(&native, encoder->zero_block->samples, 1,
+                       encoder->profile.num_channels, g_shared.num_samples_threshold);
+  }
+
+  frame = native_encoder_encode(&native, 0, &len);
+
+  if (len <= MAX_SILENT_FRAME_LEN) {
+    memcpy(encoder->silent_frame, frame, len);
+    encoder->silent_frame_len = len;
+  }
+
+  native_encoder_free(&native);
+
+
+  return encoder->silent_frame_len > 0;
+}
+
+
+
+
+/* Creates an encoder for the specified profile and initializes the FLAC stream,
+which writes the stream header. Returns NULL on failure. */
+static struct fj_encoder_t * create_encoder(const struct fj_profile_t *profile) {
+
+  struct fj_encoder_t *encoder;
+
+
+  encoder = (struct fj_encoder_t*) calloc(1, sizeof(struct fj_encoder_t));
+  if (encoder == NULL) {
+    return NULL;
+  }
+
+  encoder->profile = *profile;
+  pthread_mutex_init(&(encoder->lock), NULL);
+
+  encoder->block_event = event_create();
+  encoder->subscribers = (struct fj_subscriber_t*) malloc(sizeof(struct fj_subscriber_t)
+                                                          * g_shared.max_num_sessions);
+
+  if (encoder->block_event < 0 || encoder->subscribers == NULL) {
+    free_encoder(encoder);
+    return NULL;
+  }
+
+
+  /* Streams with another layout or rate are downmixed and resampled by the
+  encoder, so every client of the profile shares the work. */
+  encoder->max_block_frames = g_shared.num_samples_threshold;
+
+  if (profile->layout > 0) {
+    encoder->downmix = &(g_shared.downmixes[profile->layout - 1]);
+  }
+
+  if (profile->sample_rate != g_shared.sample_rate) {
+    encoder->resampler = (struct fj_resampler_t*) malloc(sizeof(struct fj_resampler_t));
+    if (encoder->resampler == NULL
+        || !resampler_init(encoder->resampler, g_shared.sample_rate, profile->sample_rate,
+                           profile->num_channels, g_shared.num_samples_threshold,
+                           g_shared.out_sample_max)) {
+      free(encoder->resampler);
+      encoder->resampler = NULL;
+      error_log("Cannot resample from %u Hz to %u Hz.", g_shared.sample_rate,
+                profile->sample_rate);
+      free_encoder(encoder);
+      return NULL;
+    }
+
+    encoder->max_block_frames = resampler_max_output(encoder->resampler,
+                                                     g_shared.num_samples_threshold);
+  }
+
+  if (encoder->downmix != NULL && encoder->resampler != NULL) {
+    encoder->mixed = block_new(g_shared.num_samples_threshold * profile->num_channels);
+    if (encoder->mixed == NULL) {
+      free_encoder(encoder);
+      return NULL;
+    }
+  }
+
+  /* Capture is wider than the profile when some stream dithers. */
+  if (profile->bit_depth < g_shared.capture_bit_depth) {
+    encoder->dither = (struct fj_dither_t*) malloc(sizeof(struct fj_dither_t));
+    if (encoder->dither == NULL
+        || !dither_init(encoder->dither, profile->dither, profile->num_channels,
+                        g_shared.capture_bit_depth, profile->bit_depth)) {
+      free_encoder(encoder);
+      return NULL;
+    }
+  }
+
+  if (encoder->downmix != NULL || encoder->resampler != NULL || encoder->dither != NULL) {
+    encoder->staged = block_new(encoder->max_block_frames * profile->num_channels);
+    if (encoder->staged == NULL) {
+      free_encoder(encoder);
+      return NULL;
+    }
+  }
+
+  encoder->num_preroll_samples = (size_t) ((uint64_t) g_shared.num_preroll_samples
+                                           * profile->sample_rate / g_shared.sample_rate);
+  encoder->max_lag_samples = (size_t) ((uint64_t) g_shared.max_lag_samples
+                                       * profile->sample_rate / g_shared.sample_rate);
+
+
+  encoder->level = profile->compression_level;
+  encoder->next_level = encoder->level;
+
+  /* Raw formats publish every staged block as one frame. */
+  if (profile->format == FORMAT_LPCM || profile->format == FORMAT_WAV) {
+    encoder->blocksize = encoder->max_block_frames;
+    encoder->pcm_buffer = (FLAC__byte*) malloc(encoder->max_block_frames * profile->num_channels
+                                               * lpcm_sample_bytes(profile->bit_depth));
+    if (encoder->pcm_buffer == NULL) {
+      free_encoder(encoder);
+      return NULL;
+    }
+    if (profile->format == FORMAT_WAV) {
+      encoder->header_len = lpcm_write_wav_header(profile->num_channels, profile->bit_depth,
+                                                  profile->sample_rate, encoder->header);
+    }
+  }
+  else if (g_shared.engine == ENGINE_NATIVE) {
+    encoder->blocksize = g_shared.flac_blocksize > 0 ? g_shared.flac_blocksize
+                                                     : NATIVE_BLOCKSIZE;
+    encoder->native = (struct fj_native_encoder_t*) malloc(sizeof(struct fj_native_encoder_t));
+    if (encoder->native == NULL
+        || !native_encoder_init(encoder->native, profile->num_channels, profile->bit_depth,
+                                profile->sample_rate, encoder->blocksize)) {
+      free(encoder->native);
+      encoder->native = NULL;
+      error_log("Failed to initialize native encoder.");
+      free_encoder(encoder);
+      return NULL;
+    }
+    encoder->header_len = native_encoder_write_header(encoder->native, encoder->header);
+  }
+  else {
+    encoder->flac = init_flac(encoder, encoder->level);
+    if (encoder->flac == NULL) {
+      free_encoder(encoder);
+      return NULL;
+    }
+    encoder->blocksize = FLAC__stream_encoder_get_blocksize(encoder->flac);
+  }
+
+  encoder->header_done = true;
+
+
+  /* Ogg streams replace the native header with the mapping's header pages.
+  Pages carry one serial number for the life of the encoder, and clients
+  joining later skip the page sequence numbers before their preroll, as with
+  any live Ogg stream. */
+  if (profile->format == FORMAT_OGG_FLAC) {
+    FLAC__byte flac_header[MAX_HEADER_LEN];
+    size_t flac_header_len = encoder->header_len;
+
+    encoder->ogg = (struct fj_ogg_muxer_t*) malloc(sizeof(struct fj_ogg_muxer_t));
+    if (encoder->ogg == NULL
+        || !ogg_muxer_init(encoder->ogg, (uint32_t) time(NULL) ^ (uint32_t) random(),
+                           g_shared.ogg_frames_per_page)) {
+      free(encoder->ogg);
+      encoder->ogg = NULL;
+      free_encoder(encoder);
+      return NULL;
+    }
+
+    memcpy(flac_header, encoder->header, flac_header_len);
+    encoder->header_len = ogg_muxer_write_headers(encoder->ogg, flac_header, flac_header_len,
+                                                  encoder->header, MAX_HEADER_LEN);
+    if (encoder->header_len == 0) {
+      error_log("Cannot write Ogg FLAC header pages.");
+      free_encoder(encoder);
+      return NULL;
+    }
+  }
+
+
+  /* Keep enough frames for the preroll of new clients and the lag allowed
+  for slow ones. An Ogg page holds at least one frame, so counting frames
+  errs on the side of a longer queue. */
+  encoder->queue_len = (encoder->num_preroll_samples + encoder->max_lag_samples
+                        + encoder->blocksize - 1) / encoder->blocksize + 1;
+  if (encoder->queue_len < MIN_FRAME_QUEUE_LEN) {
+    encoder->queue_len = MIN_FRAME_QUEUE_LEN;
+  }
+
+  encoder->frames = (struct fj_frame_t*) calloc(encoder->queue_len,
+                                                sizeof(struct fj_frame_t));
+  if (encoder->frames == NULL) {
+    free_encoder(encoder);
+    return NULL;
+  }
+
+
+  /* Serial FLAC encoders suspend during long silences. */
+  if (g_shared.idle_blocks > 0 && g_shared.num_encode_threads <= 1
+      && encoder->pcm_buffer == NULL) {
+    encoder->zero_block = block_new(g_shared.num_samples_threshold * profile->num_channels);
+    if (encoder->zero_block == NULL) {
+      free_encoder(encoder);
+      return NULL;
+    }
+    memset(encoder->zero_block->samples, 0, sizeof(int32_t) * encoder->zero_block->len);
+
+    if (!create_silent_frame(encoder)) {
+      error_log("Failed to encode silent frame.");
+      free_encoder(encoder);
+      return NULL;
+    }
+  }
+
+
+  /* Frames from the pool threads replace those of the encoder's own libFLAC
+  stream, which is kept only for the header. */
+  if (g_shared.num_encode_threads > 1 && encoder->pcm_buffer == NULL) {
+    encoder->pool = (struct fj_encode_pool_t*) malloc(sizeof(struct fj_encode_pool_t));
+    if (encoder->pool == NULL) {
+      free_encoder(encoder);
+      return NULL;
+    }
+    if (!encode_pool_init(encoder->pool, encoder, g_shared.num_encode_threads)) {
+      error_log("Failed to start encoder pool threads.");
+      free_encoder(encoder);
+      return NULL;
+    }
+  }
+
+
+  return encoder;
+}
+
+
+
+
+
+/* Returns the running encoder for the specified profile, creating and starting
+it if needed. Must be called with the encoders lock held. Returns NULL if the
+encoder cannot be created. */
+static struct fj_encoder_t * get_encoder(const struct fj_profile_t *profile) {
+
+  struct fj_encoder_t *encoder = NULL;
+  size_t i;
+
+
+  for (i=0; i < g_shared.num_encoders; ++i) {
+    if (g_shared.encoders[i]->profile.compression_level == profile->compression_level
+        && g_shared.encoders[i]->profile.bit_depth == profile->bit_depth
+        && g_shared.encoders[i]->profile.num_channels == profile->num_channels
+        && g_shared.encoders[i]->profile.sample_rate == profile->sample_rate
+        && g_shared.encoders[i]->profile.layout == profile->layout
+        && g_shared.encoders[i]->profile.format == profile->format
+        && g_shared.encoders[i]->profile.dither == profile->dither) {
+      return g_shared.encoders[i];
+    }
+  }
+
+
+  if (g_shared.num_encoders < MAX_NUM_ENCODERS) {
+
+    encoder = create_encoder(profile);
+
+    if (encoder != NULL) {
+      if (pthread_create(&(encoder->thread_id), NULL, run_encoder_thread, encoder) != 0) {
+        error_log("Cannot start encoder thread.");
+        free_encoder(encoder);
+        encoder = NULL;
+      }
+      else {
+        g_shared.encoders[g_shared.num_encoders++] = encoder;
+        debug_log("Started encoder for level %d, %d bits, %d channels, %u Hz, %s downmix.",
+                  profile->compression_level, profile->bit_depth,
+                  profile->num_channels, profile->sample_rate,
+                  downmix_name(encoder->downmix != NULL ? encoder->downmix->preset
+                                                        : DOWNMIX_NONE));
+      }
+    }
+  }
+
+
+  return encoder;
+}
+
+
+
+
+
+bool encoder_keep_warm(const struct fj_profile_t *profile) {
+
+  struct fj_encoder_t *encoder;
+
+  pthread_mutex_lock(&(g_shared.encoders_lock));
+
+  encoder = get_encoder(profile);
+  if (encoder != NULL) {
+    pthread_mutex_lock(&(encoder->lock));
+    encoder->warm = true;
+    pthread_mutex_unlock(&(encoder->lock));
+  }
+
+  pthread_mutex_unlock(&(g_shared.encoders_lock));
+
+  return encoder != NULL;
+}
+
+
+
+
+struct fj_encoder_t * encoder_subscribe(const struct fj_profile_t *profile,
+                                        const int event_fd) {
+
+  struct fj_encoder_t *encoder;
+  size_t i;
+
+
+  pthread_mutex_lock(&(g_shared.encoders_lock));
+
+  encoder = get_encoder(profile);
+
+  if (encoder != NULL) {
+    pthread_mutex_lock(&(encoder->lock));
+
+    for (i=0; i < encoder->num_subscriber_events; ++i) {
+      if (encoder->subscribers[i].event_fd == event_fd) break;
+    }
+    if (i == encoder->num_subscriber_events) {
+      encoder->subscribers[i].event_fd = event_fd;
+      encoder->subscribers[i].count = 0;
+      ++encoder->num_subscriber_events;
+    }
+    ++encoder->subscribers[i].count;
+    ++encoder->num_subscribers;
+
+    pthread_mutex_unlock(&(encoder->lock));
+  }
+
+  pthread_mutex_unlock(&(g_shared.encoders_lock));
+
+
+  return encoder;
+}
+
+
+
+
+void encoder_unsubscribe(struct fj_encoder_t *encoder, const int event_fd) {
+
+  size_t i;
+
+  pthread_mutex_lock(&(encoder->lock));
+
+  for (i=0; i < encoder->num_subscriber_events; ++i) {
+    if (encoder->subscribers[i].event_fd == event_fd) {
+      --encoder->num_subscribers;
+      if (--encoder->subscribers[i].count == 0) {
+        encoder->subscribers[i] = encoder->subscribers[--encoder->num_subscriber_events];
+      }
+      break;
+    }
+  }
+
+  pthread_mutex_unlock(&(encoder->lock));
+}
+
+
+
+
+size_t encoder_copy_header(struct fj_encoder_t *encoder, FLAC__byte *buffer,
+                           size_t buffer_len) {
+
+  size_t len;
+
+  pthread_mutex_lock(&(encoder->lock));
+  len = encoder->header_len < buffer_len ? encoder->header_len : buffer_len;
+  memcpy(buffer, encoder->header, len);
+  pthread_mutex_unlock(&(encoder->lock));
+
+  return len;
+}
+
+
+
+
+size_t encoder_copy_frames(struct fj_encoder_t *encoder, uint64_t *frame_num,
+                           FLAC__byte **buffer, size_t *buffer_capacity,
+                           size_t *len) {
+
+  struct fj_frame_t *frame;
+  FLAC__byte *data;
+  size_t num_copied, batch_len, capacity;
+  uint64_t n;
+
+
+  pthread_mutex_lock(&(encoder->lock));
+
+  if (encoder->num_frames - *frame_num > encoder->queue_len) {
+    *frame_num = encoder->num_frames - encoder->queue_len;
+  }
+
+  if (*frame_num >= encoder->num_frames) {
+    pthread_mutex_unlock(&(encoder->lock));
+    return 0;
+  }
+
+
+  /* Size the buffer once for the whole batch. */
+  batch_len = *len;
+  for (n=*frame_num; n < encoder->num_frames; ++n) {
+    batch_len += encoder->frames[n % encoder->queue_len].len;
+  }
+
+  if (*buffer_capacity < batch_len) {
+    capacity = *buffer_capacity > 0 ? *buffer_capacity : batch_len;
+    while (capacity < batch_len) capacity *= 2;
+
+    data = (FLAC__byte*) realloc(*buffer, capacity);
+    if (data == NULL) {
+      pthread_mutex_unlock(&(encoder->lock));
+      return 0;
+    }
+    *buffer = data;
+    *buffer_capacity = capacity;
+  }
+
+
+  num_copied = 0;
+  for (; *frame_num < encoder->num_frames; ++*frame_num) {
+    frame = &(encoder->frames[*frame_num % encoder->queue_len]);
+    memcpy(&((*buffer)[*len]), frame->data, frame->len);
+    *len += frame->len;
+    ++num_copied;
+  }
+
+  pthread_mutex_unlock(&(encoder->lock));
+
+
+  return num_copied;
+}
+
+
+
+
+uint64_t encoder_preroll_frame(struct fj_encoder_t *encoder, const size_t num_samples) {
+
+  uint64_t frame_num, oldest;
+  size_t num_covered = 0;
+
+  pthread_mutex_lock(&(encoder->lock));
+
+  frame_num = encoder->num_frames;
+  oldest = encoder->num_frames > encoder->queue_len
+           ? encoder->num_frames - encoder->queue_len : 0;
+
+  while (num_covered < num_samples && frame_num > oldest) {
+    --frame_num;
+    num_covered += encoder->frames[frame_num % encoder->queue_len].num_samples;
+  }
+
+  pthread_mutex_unlock(&(encoder->lock));
+
+  return frame_num;
+}
+
+
+
+
+
+
+uint64_t encoder_lag_frame(struct fj_encoder_t *encoder, const size_t max_lag_samples) {
+
+  uint64_t frame_num, oldest;
+  size_t num_covered = 0;
+
+  pthread_mutex_lock(&(encoder->lock));
+
+  frame_num = encoder->num_frames;
+  oldest = encoder->num_frames > encoder->queue_len
+           ? encoder->num_frames - encoder->queue_len : 0;
+
+  while (frame_num > oldest
+         && num_covered + encoder->frames[(frame_num - 1) % encoder->queue_len].num_samples
+            <= max_lag_samples) {
+    --frame_num;
+    num_covered += encoder->frames[frame_num % encoder->queue_len].num_samples;
+  }
+
+  pthread_mutex_unlock(&(encoder->lock));
+
+  return frame_num;
+}
+
+
+
+
+
+
+size_t encoder_lag_samples(struct fj_encoder_t *encoder, const uint64_t frame_num) {
+
+  struct fj_frame_t *oldest;
+  uint64_t oldest_num, lag;
+
+  pthread_mutex_lock(&(encoder->lock));
+
+  if (frame_num >= encoder->num_frames) {
+    lag = 0;
+  }
+  else {
+    oldest_num = encoder->num_frames > encoder->queue_len
+                 ? encoder->num_frames - encoder->queue_len : 0;
+
+    if (frame_num >= oldest_num) {
+      lag = encoder->num_samples - encoder->frames[frame_num % encoder->queue_len].sample_num;
+    }
+    else {
+      oldest = &(encoder->frames[oldest_num % encoder->queue_len]);
+      lag = encoder->num_samples - oldest->sample_num
+            + (oldest_num - frame_num) * oldest->num_samples;
+    }
+  }
+
+  pthread_mutex_unlock(&(encoder->lock));
+
+  return (size_t) lag;
+}
+
+
+
+
+
+
+/* Returns the number of frames in a block of the encoder's profile, which is
+also the length of each channel's run in a planar block. */
+static size_t block_frames(const struct fj_encoder_t *encoder, const struct fj_block_t *block) {
+  return block->len / encoder->profile.num_channels;
+}
+
+
+
+
+/* Stages the specified range of frames of a block in the native encoder and
+publishes each FLAC frame as soon as it is complete. */
+static void process_native(struct fj_encoder_t *encoder, const struct fj_block_t *block,
+                           const size_t offset, const size_t num_frames) {
+
+  const size_t num_channels = encoder->profile.num_channels;
+  const FLAC__byte *frame;
+  size_t done = 0, len;
+
+  while (done < num_frames) {
+    if (g_shared.planar) {
+      done += native_encoder_add(encoder->native, &(block->samples[offset + done]),
+                                 block_frames(encoder, block), 1, num_frames - done);
+    }
+    else {
+      done += native_encoder_add(encoder->native,
+                                 &(block->samples[(offset + done) * num_channels]),
+                                 1, num_channels, num_frames - done);
+    }
+
+    if (encoder->native->num_filled == encoder->blocksize) {
+      frame = native_encoder_encode(encoder->native, encoder->num_flac_frames, &len);
+      encoder_publish_frame(encoder, frame, len, encoder->blocksize);
+    }
+  }
+}
+
+
+
+
+/* Packs a whole block of a raw format and publishes it as one frame. */
+static void process_pcm(struct fj_encoder_t *encoder, const struct fj_block_t *block) {
+
+  const size_t num_frames = block_frames(encoder, block);
+  size_t len;
+
+  len = lpcm_pack(block->samples, num_frames, encoder->profile.num_channels,
+                  g_shared.planar, encoder->profile.bit_depth,
+                  encoder->profile.format == FORMAT_LPCM, encoder->pcm_buffer);
+  encoder_publish_frame(encoder, encoder->pcm_buffer, len, num_frames);
+}
+
+
+
+
+/* Feeds the specified range of frames of a block to the running libFLAC
+encoder. */
+static void process_samples(struct fj_encoder_t *encoder, const struct fj_block_t *block,
+                            const size_t offset, const size_t num_frames) {
+
+  const FLAC__int32 *channels[8];
+  size_t i;
+
+  if (num_frames == 0) return;
+
+  if (encoder->native != NULL) {
+    process_native(encoder, block, offset, num_frames);
+  }
+  else if (g_shared.planar) {
+    for (i=0; i < encoder->profile.num_channels; ++i) {
+      channels[i] = &(block->samples[i * block_frames(encoder, block) + offset]);
+    }
+    FLAC__stream_encoder_process(encoder->flac, channels, num_frames);
+  }
+  else {
+    FLAC__stream_encoder_process_interleaved(
+      encoder->flac, &(block->samples[offset * encoder->profile.num_channels]), num_frames);
+  }
+
+  encoder->num_samples_encoded += num_frames;
+}
+
+
+
+
+/* Replaces the running libFLAC encoder with one at the next level. Must be
+called on a frame boundary, where the old encoder holds back exactly one
+complete frame for lookahead, so finishing it publishes that frame and no
+partial one. Frames of the new encoder continue the numbering. */
+static void switch_level(struct fj_encoder_t *encoder) {
+
+  FLAC__StreamEncoder *flac;
+
+  flac = init_flac(encoder, encoder->next_level);
+
+  if (flac == NULL) {
+    error_log("Cannot switch encoder to compression level %u.", encoder->next_level);
+    encoder->next_level = encoder->level;
+    return;
+  }
+
+  FLAC__stream_encoder_finish(encoder->flac);
+  FLAC__stream_encoder_delete(encoder->flac);
+
+  pthread_mutex_lock(&(encoder->lock));
+  encoder->frame_offset = encoder->num_flac_frames;
+  pthread_mutex_unlock(&(encoder->lock));
+
+  encoder->flac = flac;
+  if (encoder->next_level < encoder->level) {
+    ++encoder->num_level_downs;
+  }
+  else {
+    ++encoder->num_level_ups;
+  }
+  encoder->level = encoder->next_level;
+  encoder->num_blocks_held = 0;
+
+  info_log("Encoder switched to compression level %u with %.0f%% CPU headroom.",
+           encoder->level, 100.0 * (1.0 - encoder->load));
+}
+
+
+
+
+/* Updates the smoothed load from the encode time of the last block against
+its real-time budget, and picks the next level once the current one has been
+held long enough: one lower when encoding approaches the deadline and one
+higher when there is headroom. */
+static void adapt_level(struct fj_encoder_t *encoder, const double encode_seconds) {
+
+  double budget = (double) g_shared.num_samples_threshold / g_shared.sample_rate;
+
+  encoder->load += ADAPT_SMOOTHING * (encode_seconds / budget - encoder->load);
+
+  if (++encoder->num_blocks_held < g_shared.adapt_hold_blocks) {
+    return;
+  }
+
+  if (encoder->load > ADAPT_MAX_LOAD && encoder->level > g_shared.min_compression_level) {
+    encoder->next_level = encoder->level - 1;
+  }
+  else if (encoder->load < ADAPT_MIN_LOAD && encoder->level < g_shared.max_compression_level) {
+    encoder->next_level = encoder->level + 1;
+  }
+  else {
+    encoder->num_blocks_held = 0;
+    debug_log("Encoder at compression level %u with %.0f%% CPU headroom.",
+              encoder->level, 100.0 * (1.0 - encoder->load));
+  }
+}
+
+
+
+
+/* Accounts for the specified number of silent samples while idle and publishes
+a copy of the cached silent frame for every frame they complete. */
+static void encode_silence(struct fj_encoder_t *encoder, const size_t num_samples) {
+
+  FLAC__byte frame[MAX_SILENT_FRAME_LEN + MAX_FRAME_NUMBER_LEN];
+  uint64_t num_frames;
+  size_t len;
+
+
+  num_frames = (encoder->num_samples_encoded + num_samples) / encoder->blocksize
+               - encoder->num_samples_encoded / encoder->blocksize;
+  encoder->num_samples_encoded += num_samples;
+
+  for (; num_frames > 0; --num_frames) {
+    len = flac_frame_renumber(encoder->silent_frame, encoder->silent_frame_len,
+                              encoder->num_flac_frames, frame);
+    encoder_publish_frame(encoder, frame, len, encoder->blocksize);
+  }
+}
+
+
+
+
+/* Stops the engine once the silence has lasted the idle period. Must be
+called on a frame boundary, where finishing libFLAC publishes the frame it
+holds back and no partial one. */
+static void suspend_encoding(struct fj_encoder_t *encoder) {
+
+  if (encoder->flac != NULL) {
+    FLAC__stream_encoder_finish(encoder->flac);
+    FLAC__stream_encoder_delete(encoder->flac);
+    encoder->flac = NULL;
+  }
+
+  encoder->idle = true;
+
+  info_log("Encoder idle after %.1f s of silence.",
+           (double) encoder->num_silent_blocks * g_shared.num_samples_threshold
+           / g_shared.sample_rate);
+}
+
+
+
+
+/* Restarts the engine when signal returns. The silent start of the current
+frame is fed again, so the frame boundaries and numbering carry on. Returns
+false if the engine cannot be restarted, in which case the encoder stays
+idle. */
+static bool resume_encoding(struct fj_encoder_t *encoder) {
+
+  size_t num_silent = encoder->num_samples_encoded % encoder->blocksize;
+  size_t num_fed;
+
+
+  if (encoder->native == NULL) {
+    encoder->flac = init_flac(encoder, encoder->level);
+    if (encoder->flac == NULL) {
+      error_log("Cannot resume encoder.");
+      return false;
+    }
+
+    pthread_mutex_lock(&(encoder->lock));
+    encoder->frame_offset = encoder->num_flac_frames;
+    pthread_mutex_unlock(&(encoder->lock));
+  }
+
+  encoder->idle = false;
+  encoder->num_blocks_held = 0;
+
+  encoder->num_samples_encoded -= num_silent;
+  for (; num_silent > 0; num_silent -= num_fed) {
+    num_fed = num_silent < block_frames(encoder, encoder->zero_block)
+              ? num_silent : block_frames(encoder, encoder->zero_block);
+    process_samples(encoder, encoder->zero_block, 0, num_fed);
+  }
+
+  info_log("Encoder resumed.");
+
+
+  return true;
+}
+
+
+
+
+/* Tracks silence and suspends or resumes the engine. Returns true if the
+block was fully handled, either as silence while idle or by the switch to
+idle at a frame boundary inside it. */
+static bool encode_idle(struct fj_encoder_t *encoder, const struct fj_block_t *block) {
+
+  size_t num_frames = block_frames(encoder, block);
+  size_t offset;
+
+
+  if (!block->silent) {
+    encoder->num_silent_blocks = 0;
+    if (!encoder->idle || resume_encoding(encoder)) {
+      return false;
+    }
+    /* Keep the stream going until the engine can be restarted. */
+    encode_silence(encoder, num_frames);
+    return true;
+  }
+
+  if (encoder->num_silent_blocks < g_shared.idle_blocks) {
+    ++encoder->num_silent_blocks;
+  }
+
+  if (encoder->idle) {
+    encode_silence(encoder, num_frames);
+    return true;
+  }
+
+  if (encoder->num_silent_blocks < g_shared.idle_blocks) {
+    return false;
+  }
+
+  offset = (encoder->blocksize - encoder->num_samples_encoded % encoder->blocksize)
+           % encoder->blocksize;
+  if (offset > num_frames) {
+    return false;
+  }
+
+  process_samples(encoder, block, 0, offset);
+  suspend_encoding(encoder);
+  encode_silence(encoder, num_frames - offset);
+
+
+  return true;
+}
+
+
+
+
+/* Encodes one block, switching to the next level at the first frame boundary
+inside the block if a change is pending. */
+static void encode_block(struct fj_encoder_t *encoder, const struct fj_block_t *block) {
+
+  size_t num_frames = block_frames(encoder, block);
+  size_t offset = 0;
+  struct timespec start, end;
+  bool switched = false;
+
+
+  if (encoder->pcm_buffer != NULL) {
+    process_pcm(encoder, block);
+    return;
+  }
+
+  if (encoder->zero_block != NULL && encode_idle(encoder, block)) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (encoder->next_level != encoder->level) {
+    offset = (encoder->blocksize - encoder->num_samples_encoded % encoder->blocksize)
+             % encoder->blocksize;
+
+    if (offset <= num_frames) {
+      process_samples(encoder, block, 0, offset);
+      switch_level(encoder);
+      switched = true;
+    }
+    else {
+      offset = 0;
+    }
+  }
+
+  process_samples(encoder, block, offset, num_frames - offset);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+
+  /* The block that switched also paid for creating an encoder. */
+  if (g_shared.adaptive_compression && !switched) {
+    adapt_level(encoder, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+  }
+}
+
+
+
+
+
+
+/* Runs a shared block through the encoder's stage and returns the block to
+encode, which is the shared block itself when the stage has nothing to do.
+The returned block is valid until the next call. */
+static const struct fj_block_t * stage_block(struct fj_encoder_t *encoder,
+                                             const struct fj_block_t *block) {
+
+  struct fj_block_t *staged = encoder->staged;
+  struct fj_block_t *mixed;
+  size_t num_frames;
+
+
+  if (encoder->downmix != NULL) {
+    mixed = encoder->resampler != NULL ? encoder->mixed : staged;
+
+    encoder->downmix->mix(encoder->downmix, block->samples, g_shared.num_samples_threshold,
+                          g_shared.planar, mixed->samples);
+    mixed->len = g_shared.num_samples_threshold * encoder->profile.num_channels;
+
+    /* A subset of the channels can be silent while the others are not. */
+    mixed->silent = block->silent
+                    || (g_shared.idle_blocks > 0 && block_detect_silence(mixed));
+    block = mixed;
+  }
+
+  if (encoder->resampler != NULL) {
+    num_frames = resampler_process(encoder->resampler, block->samples,
+                                   g_shared.num_samples_threshold, g_shared.planar,
+                                   staged->samples);
+    staged->len = num_frames * encoder->profile.num_channels;
+
+    /* The filter rings out for a while after the input falls silent. */
+    staged->silent = block->silent && block_detect_silence(staged);
+    block = staged;
+  }
+
+  /* Requantizing comes last, so the dither is not rounded away by the stages
+  before it. Silent channels stay exactly zero. */
+  if (encoder->dither != NULL) {
+    dither_requantize(encoder->dither, block->samples,
+                      block->len / encoder->profile.num_channels, g_shared.planar,
+                      staged->samples);
+    staged->len = block->len;
+    staged->silent = block->silent;
+    block = staged;
+  }
+
+
+  return block;
+}
+
+
+
+
+
+
+void * run_encoder_thread(void *args) {
+
+  struct fj_encoder_t *encoder = (struct fj_encoder_t*) args;
+  struct fj_block_t *next;
+  uint64_t num_published;
+  size_t num_subscribers, i;
+  bool encoded;
+
+
+  debug_log("Encoder thread started.");
+
+
+  /* Sleep until the capture thread publishes a block. */
+  while (event_wait(&(encoder->block_event), 1)) {
+
+    event_clear(encoder->block_event);
+
+    /* Publish the segments the pool has finished since the last wakeup. */
+    encoded = encoder->pool != NULL && encode_pool_publish(encoder->pool) > 0;
+
+    pthread_mutex_lock(&(encoder->lock));
+    num_subscribers = encoder->warm ? 1 : encoder->num_subscribers;
+    pthread_mutex_unlock(&(encoder->lock));
+
+
+    /* Jump to the newest block when nobody is listening to an encoder that is
+    not kept warm, or when it has fallen too far behind, which also lets the
+    skipped blocks be freed. */
+    num_published = block_chain_num_published(&(g_shared.blocks));
+
+    if (encoder->block == NULL || num_subscribers == 0
+        || num_published - encoder->block->seq > g_shared.max_block_lag) {
+      next = block_chain_latest(&(g_shared.blocks));
+      if (encoder->block != NULL && next != NULL && next != encoder->block) {
+        block_unref(encoder->block);
+        encoder->block = NULL;
+      }
+      if (encoder->block == NULL) {
+        encoder->block = next;
+      }
+      else if (next != NULL) {
+        block_unref(next);
+      }
+    }
+
+    /* Encode every block published since the last wakeup once for all
+    subscribers. The blocks are immutable, so no lock is held while encoding.
+    With a pool, the blocks are handed over as long as it has free segments;
+    the rest are fed when a pool thread finishes and wakes the encoder. */
+    else {
+      while ((next = block_next(encoder->block)) != NULL) {
+
+        if (encoder->pool == NULL) {
+          encode_block(encoder, stage_block(encoder, next));
+          encoded = true;
+        }
+        else if (encode_pool_can_feed(encoder->pool)) {
+          encode_pool_feed(encoder->pool, stage_block(encoder, next));
+        }
+        else {
+          block_unref(next);
+          break;
+        }
+
+        block_unref(encoder->block);
+        encoder->block = next;
+      }
+    }
+
+
+    if (encoded) {
+      pthread_mutex_lock(&(encoder->lock));
+      for (i=0; i < encoder->num_subscriber_events; ++i) {
+        event_signal(encoder->subscribers[i].event_fd);
+      }
+      pthread_mutex_unlock(&(encoder->lock));
+    }
+  }
+
+
+  debug_log("Exiting encoder thread.");
+
+  return NULL;
+}
+
+
+
+
+/* Wakes every running encoder after a block is published. */
+static void notify_encoders() {
+
+  size_t i;
+
+  pthread_mutex_lock(&(g_shared.encoders_lock));
+  for (i=0; i < g_shared.num_encoders; ++i) {
+    event_signal(g_shared.encoders[i]->block_event);
+  }
+  pthread_mutex_unlock(&(g_shared.encoders_lock));
+}
+
+
+
+
+/* Moves the specified number of frames from the capture rings into the block
+after the frames it already holds. Planar blocks store each channel as one
+contiguous run of the block's frames. */
+static void read_frames(struct fj_block_t *block, const size_t frame_offset,
+                        const size_t num_frames) {
+
+  size_t i;
+
+  if (g_shared.planar) {
+    for (i=0; i < g_shared.num_capture_rings; ++i) {
+      ring_read(&(g_shared.capture_rings[i]),
+                &(block->samples[i * g_shared.num_samples_threshold + frame_offset]),
+                num_frames);
+    }
+  }
+  else {
+    ring_read(&(g_shared.capture_rings[0]),
+              &(block->samples[frame_offset * g_shared.num_channels]),
+              num_frames * g_shared.num_channels);
+  }
+}
+
+
+
+
+void * run_capture_thread() {
+
+  struct fj_ring_t *ring = &(g_shared.capture_rings[0]);
+  struct fj_block_t *block = NULL;
+  size_t num_block_frames = 0;
+  uint64_t num_overruns, last_num_overruns = 0;
+  size_t num_available, num_read;
+  bool published;
+
+
+  debug_log("Capture thread started.");
+
+
+  /* Sleep until the JACK callback commits samples to the rings. */
+  while (event_wait(&(g_shared.capture_event), 1)) {
+
+    event_clear(g_shared.capture_event);
+
+    num_overruns = ring_num_overruns(ring);
+    if (num_overruns != last_num_overruns) {
+      error_log("Capture ring full, dropped %" PRIu64 " JACK periods.",
+                num_overruns - last_num_overruns);
+      last_num_overruns = num_overruns;
+    }
+
+
+    /* Fill blocks from the rings and publish each one as soon as it is full.
+    The first ring is committed last, so its fill level holds for all. */
+    num_available = ring_read_available(ring);
+    if (!g_shared.planar) num_available /= g_shared.num_channels;
+    published = false;
+
+    while (num_available > 0) {
+
+      if (block == NULL) {
+        block = block_new(g_shared.encoder_buffer_len_threshold);
+        num_block_frames = 0;
+        if (block == NULL) {
+          error_log("Cannot allocate sample block.");
+          request_exit();
+          break;
+        }
+      }
+
+      num_read = g_shared.num_samples_threshold - num_block_frames;
+      if (num_read > num_available) num_read = num_available;
+
+      read_frames(block, num_block_frames, num_read);
+      num_block_frames += num_read;
+      num_available -= num_read;
+
+      if (num_block_frames == g_shared.num_samples_threshold) {
+        if (g_shared.idle_blocks > 0) {
+          block_detect_silence(block);
+        }
+        block_chain_publish(&(g_shared.blocks), block);
+        block = NULL;
+        published = true;
+      }
+    }
+
+    if (published) notify_encoders();
+  }
+
+
+  if (block != NULL) {
+    block_unref(block);
+  }
+
+  debug_log("Exiting capture thread.");
+
+  return NULL;
+}
+
+
+
+
+void destroy_encoders() {
+
+  struct fj_encoder_t *encoder;
+  size_t i;
+
+  pthread_mutex_lock(&(g_shared.encoders_lock));
+
+  for (i=0; i < g_shared.num_encoders; ++i) {
+    encoder = g_shared.encoders[i];
+    pthread_join(encoder->thread_id, NULL);
+
+    if (g_shared.adaptive_compression) {
+      info_log("Encoder %zu adaptive compression: level %u with %.0f%% CPU headroom, %"
+               PRIu64 " steps down, %" PRIu64 " steps up.", i, encoder->level,
+               100.0 * (1.0 - encoder->load), encoder->num_level_downs,
+               encoder->num_level_ups);
+    }
+
+    free_encoder(encoder);
+  }
+  g_shared.num_encoders = 0;
+
+  pthread_mutex_unlock(&(g_shared.encoders_lock));
+}
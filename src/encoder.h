@@ -0,0 +1,256 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+
+#define MAX_NUM_ENCODERS 8
+#define MIN_FRAME_QUEUE_LEN 64
+#define MAX_HEADER_LEN 4096
+#define MAX_ENCODER_LAG_MS 240
+
+#define ADAPT_BLOCKSIZE 4096      /* Fixed so the level can change mid-stream. */
+#define ADAPT_HOLD_MS 3000        /* Minimum time between level changes. */
+#define ADAPT_MAX_LOAD 0.7        /* Step down above this share of the budget. */
+#define ADAPT_MIN_LOAD 0.3        /* Step up below this share of the budget. */
+#define ADAPT_SMOOTHING 0.1
+
+#define MAX_SILENT_FRAME_LEN 64   /* Header, one constant subframe per channel and footer. */
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include <FLAC/stream_encoder.h>
+
+#include "dither.h"
+#include "sample_block.h"
+
+
+struct fj_downmix_t;
+struct fj_encode_pool_t;
+struct fj_native_encoder_t;
+struct fj_ogg_muxer_t;
+struct fj_resampler_t;
+
+
+/* Implementation writing the FLAC frames of every encoder. */
+enum fj_engine_t {
+  ENGINE_LIBFLAC,       /* libFLAC at the profile's compression level. */
+  ENGINE_NATIVE         /* Built-in fixed predictor encoder, for the lowest CPU cost. */
+};
+
+
+/* Container of a stream. Raw formats send the staged samples as they are and
+never run an engine. */
+enum fj_format_t {
+  FORMAT_FLAC,          /* Native FLAC framing, audio/flac. */
+  FORMAT_LPCM,          /* Headerless big-endian samples, audio/L16 or audio/L24. */
+  FORMAT_WAV,           /* Little-endian samples after a WAV header, audio/wav. */
+  FORMAT_OGG_FLAC       /* FLAC frames in Ogg pages, audio/ogg. */
+};
+
+
+/* Output format of an encoded stream. Every client requesting the same profile
+is served from one shared encoder. */
+struct fj_profile_t {
+  unsigned char compression_level;
+  unsigned char bit_depth;
+  unsigned char num_channels;
+  unsigned sample_rate;     /* Resampled from the JACK rate when different. */
+  unsigned char layout;     /* Zero for the JACK channels, else one plus the downmix index. */
+  enum fj_format_t format;
+  enum fj_dither_mode_t dither;   /* Requantization from the capture bit depth. */
+};
+
+
+/* One encoded FLAC frame held in an encoder's frame queue, stored as a
+complete HTTP chunk. */
+struct fj_frame_t {
+  FLAC__byte *data;
+  size_t len;
+  size_t capacity;
+  unsigned num_samples;     /* Samples per channel encoded in the frame. */
+  uint64_t sample_num;      /* Position of the frame's first sample in the stream. */
+};
+
+
+/* Event signaled for every subscriber registered with it. Sessions served by
+the same media worker share one event. */
+struct fj_subscriber_t {
+  int event_fd;
+  size_t count;
+};
+
+
+/* Encoder stage that reads each published sample block once, produces FLAC
+frames, and publishes them to every subscribed media thread. */
+struct fj_encoder_t {
+  struct fj_profile_t profile;
+
+  FLAC__StreamEncoder *flac;
+  pthread_t thread_id;
+  pthread_mutex_t lock;     /* Guards the header, frame queue and subscribers. */
+
+  FLAC__byte header[MAX_HEADER_LEN];   /* fLaC marker and metadata blocks. */
+  size_t header_len;
+
+  struct fj_frame_t *frames;   /* Sized to hold the preroll and the maximum client lag. */
+  size_t queue_len;
+  uint64_t num_frames;      /* Frame n is stored at frames[n % queue_len]. */
+  uint64_t num_samples;     /* Samples per channel in all published frames. */
+  uint64_t num_flac_frames; /* FLAC frames encoded, which differs from num_frames when
+                               Ogg pages batch several of them. Encoder thread only. */
+
+  int block_event;           /* Signaled when a sample block is published. */
+  struct fj_subscriber_t *subscribers;   /* Signaled when new frames are published. */
+  size_t num_subscriber_events;
+  size_t num_subscribers;
+  bool warm;                /* Keeps encoding without subscribers. */
+  struct fj_block_t *block;   /* Last block encoded, or NULL before the first. */
+
+  /* Compression level control, only used by the encoder thread. */
+  unsigned level;               /* Level of the running libFLAC encoder. */
+  unsigned next_level;          /* Level to switch to at the next frame boundary. */
+  unsigned blocksize;
+  uint64_t frame_offset;        /* Frames published by the libFLAC encoders replaced. */
+  uint64_t num_samples_encoded; /* Samples per channel fed to libFLAC. */
+  double load;                  /* Smoothed encode time over the real-time budget. */
+  size_t num_blocks_held;       /* Blocks encoded since the last level change. */
+  bool header_done;             /* Later libFLAC encoders do not replace the header. */
+  FLAC__byte *renumber_buffer;
+  size_t renumber_capacity;
+
+  /* Number of times the level stepped each way, reported with the level and
+  headroom when the encoder stops. */
+  uint64_t num_level_downs;
+  uint64_t num_level_ups;
+
+  struct fj_encode_pool_t *pool;   /* Parallel encoding threads, or NULL. */
+  struct fj_native_encoder_t *native;   /* Replaces libFLAC when not NULL. */
+  FLAC__byte *pcm_buffer;       /* Packed samples of raw formats, which replace both. */
+  struct fj_ogg_muxer_t *ogg;   /* Wraps published frames in Ogg pages, or NULL. */
+
+  /* Stage between the shared sample blocks and the engine. */
+  const struct fj_downmix_t *downmix;  /* Shared matrix of the layout, or NULL. */
+  struct fj_block_t *mixed;      /* Downmix output when it is resampled next. */
+  struct fj_resampler_t *resampler;    /* Converts from the JACK rate, or NULL. */
+  struct fj_dither_t *dither;    /* Requantizes to the profile's bit depth, or NULL. */
+  struct fj_block_t *staged;     /* Output of the stage, reused for every block. */
+  size_t max_block_frames;       /* Frames per channel in the largest block encoded. */
+
+  /* Client limits converted to samples at the profile's rate. */
+  size_t num_preroll_samples;
+  size_t max_lag_samples;
+
+  /* Idle suspension, only used by the encoder thread. While idle, no engine
+  runs and every frame of silence is a copy of the cached silent frame. */
+  bool idle;
+  size_t num_silent_blocks;     /* Consecutive silent blocks, up to the idle threshold. */
+  struct fj_block_t *zero_block;   /* Block of zeros to restart the engine mid-frame. */
+  FLAC__byte silent_frame[MAX_SILENT_FRAME_LEN];
+  size_t silent_frame_len;
+};
+
+
+
+/* Returns the running encoder for the specified profile, creating and starting
+it if needed, and registers the caller's event to be signaled whenever new
+frames are published. Returns NULL if the encoder cannot be created. */
+struct fj_encoder_t * encoder_subscribe(const struct fj_profile_t *profile,
+                                        const int event_fd);
+
+/* Starts the encoder for the specified profile if needed and keeps it
+encoding while nobody is subscribed, so clients joining later are served
+immediately from its frame queue. Returns false if it cannot be created. */
+bool encoder_keep_warm(const struct fj_profile_t *profile);
+
+/* Removes one subscriber registered with the specified event from the
+encoder. */
+void encoder_unsubscribe(struct fj_encoder_t *encoder, const int event_fd);
+
+
+/* Copies the stream header of the encoder into the buffer and returns its
+length. Every new client receives the header before any frames. */
+size_t encoder_copy_header(struct fj_encoder_t *encoder, FLAC__byte *buffer,
+                           size_t buffer_len);
+
+/* Appends every chunk-framed frame from the specified number up to the live
+edge to the buffer at the specified length, growing it as needed, and advances
+the frame number and length past them. Returns the number of frames copied. If
+the first frame has already been dropped from the queue, the frame number
+skips ahead to the oldest frame still available. */
+size_t encoder_copy_frames(struct fj_encoder_t *encoder, uint64_t *frame_num,
+                           FLAC__byte **buffer, size_t *buffer_capacity,
+                           size_t *len);
+
+/* Returns the number of the frame a new client should start from so that the
+frames up to the live edge cover at least the specified number of samples per
+channel, limited to the frames still held in the queue. Returns the next frame
+to be published if the number of samples is zero. */
+uint64_t encoder_preroll_frame(struct fj_encoder_t *encoder, const size_t num_samples);
+
+
+/* Returns the number of the oldest frame still held whose lag behind the live
+edge is at most the specified number of samples per channel, which is where a
+lagging client resumes after dropping its oldest frames. Returns the next frame
+to be published if even the newest frame lags more. */
+uint64_t encoder_lag_frame(struct fj_encoder_t *encoder, const size_t max_lag_samples);
+
+
+/* Returns the number of samples per channel published after the start of the
+specified frame, which is how far a client about to send that frame lags
+behind the live edge. Frames already dropped from the queue are assumed to be
+as long as the oldest frame still held. */
+size_t encoder_lag_samples(struct fj_encoder_t *encoder, const uint64_t frame_num);
+
+
+/* Appends one encoded frame to the frame queue as a complete HTTP chunk,
+overwriting the oldest frame once the queue is full. Ogg streams queue the
+pages closed by the frame instead, if any. Returns false if the frame cannot
+be stored. */
+bool encoder_publish_frame(struct fj_encoder_t *encoder, const FLAC__byte *buffer,
+                           size_t bytes, unsigned samples);
+
+/* Applies the settings of the encoder's profile and the specified level to a
+libFLAC encoder and starts a stream writing to the specified callback.
+Returns false if the stream cannot be started. */
+bool encoder_init_flac(struct fj_encoder_t *encoder, FLAC__StreamEncoder *flac,
+                       const unsigned level, FLAC__StreamEncoderWriteCallback callback,
+                       void *client_data);
+
+
+/* Runs the thread moving samples from the capture ring written by the JACK
+callback into immutable sample blocks shared by all encoders. */
+void * run_capture_thread();
+
+/* Runs the thread for encoding the published sample blocks for one profile. */
+void * run_encoder_thread(void *args);
+
+/* Joins all encoder threads and frees their resources. */
+void destroy_encoders();
+
+
+
+
+#endif /* ENCODER_H */
@@ -0,0 +1,97 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "flacjacket_globals.h"
+#include "events.h"
+#include "logging.h"
+
+
+
+
+int event_create() {
+  return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+
+
+void event_signal(const int event_fd) {
+
+  uint64_t one = 1;
+
+  /* Only fails if the counter would overflow, in which case the event is
+  already pending. */
+  if (write(event_fd, &one, sizeof(one)) < 0) {
+    return;
+  }
+}
+
+
+
+void event_clear(const int event_fd) {
+
+  uint64_t count;
+
+  if (read(event_fd, &count, sizeof(count)) < 0) {
+    return;
+  }
+}
+
+
+
+
+bool event_wait(const int *fds, size_t num_fds) {
+
+  struct pollfd pfds[MAX_WAIT_FDS + 1];
+  size_t i;
+
+
+  if (num_fds > MAX_WAIT_FDS) num_fds = MAX_WAIT_FDS;
+
+  /* The exit event is never cleared, so once requested every wait returns. */
+  pfds[0].fd = g_shared.exit_event;
+  pfds[0].events = POLLIN;
+
+  for (i=0; i < num_fds; ++i) {
+    pfds[i+1].fd = fds[i];
+    pfds[i+1].events = POLLIN;
+  }
+
+
+  while (poll(pfds, num_fds + 1, -1) < 0) {
+    if (errno != EINTR) {
+      error_log(strerror(errno));
+      return false;
+    }
+    if (g_exited) return false;
+  }
+
+
+  return !g_exited && !(pfds[0].revents & POLLIN);
+}
+
+
+
+
+void request_exit() {
+  g_exited = true;
+  event_signal(g_shared.exit_event);
+}
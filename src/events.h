@@ -0,0 +1,54 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+
+#define MAX_WAIT_FDS 8
+
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+
+/* Creates a non-blocking eventfd used to wake a waiting thread. Returns -1 on
+failure. */
+int event_create();
+
+/* Wakes the thread waiting on the event. Safe to call from the JACK process
+callback and from signal handlers. */
+void event_signal(const int event_fd);
+
+/* Resets the event so the next wait blocks until it is signaled again. */
+void event_clear(const int event_fd);
+
+
+/* Blocks until any of the specified descriptors becomes readable or exit is
+requested. Returns false if the caller should exit. */
+bool event_wait(const int *fds, size_t num_fds);
+
+
+/* Sets the global exit flag and wakes every thread blocked in event_wait. */
+void request_exit();
+
+
+
+#endif /* EVENTS_H */
@@ -0,0 +1,186 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "flac_frame.h"
+
+
+
+/* Size of the sync code, blocking strategy, blocksize, sample rate, channel
+and sample size fields that precede the frame number. */
+#define FRAME_HEADER_PREFIX_LEN 4
+
+
+
+
+uint8_t flac_crc8(const FLAC__byte *data, size_t len) {
+
+  uint8_t crc = 0;
+  size_t i;
+  int j;
+
+  for (i=0; i < len; ++i) {
+    crc ^= data[i];
+    for (j=0; j < 8; ++j) {
+      crc = (crc & 0x80) ? (uint8_t) ((crc << 1) ^ 0x07) : (uint8_t) (crc << 1);
+    }
+  }
+
+  return crc;
+}
+
+
+
+static uint16_t crc16_table[256];
+static pthread_once_t crc16_table_once = PTHREAD_ONCE_INIT;
+
+
+/* Builds the table of the frame CRC, run once by whichever thread needs it
+first. */
+static void build_crc16_table(void) {
+
+  uint16_t c;
+  size_t i;
+  int j;
+
+  for (i=0; i < 256; ++i) {
+    c = (uint16_t) (i << 8);
+    for (j=0; j < 8; ++j) {
+      c = (c & 0x8000) ? (uint16_t) ((c << 1) ^ 0x8005) : (uint16_t) (c << 1);
+    }
+    crc16_table[i] = c;
+  }
+}
+
+
+uint16_t flac_crc16(const FLAC__byte *data, size_t len) {
+
+  uint16_t crc = 0;
+  size_t i;
+
+  pthread_once(&crc16_table_once, build_crc16_table);
+
+  for (i=0; i < len; ++i) {
+    crc = (uint16_t) ((crc << 8) ^ crc16_table[(crc >> 8) ^ data[i]]);
+  }
+
+  return crc;
+}
+
+
+
+
+size_t flac_write_frame_number(uint64_t frame_num, FLAC__byte *buffer) {
+
+  static const FLAC__byte prefixes[MAX_FRAME_NUMBER_LEN + 1] = {
+    0, 0x00, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE
+  };
+  size_t len, i;
+
+  if (frame_num < 0x80) len = 1;
+  else if (frame_num < 0x800) len = 2;
+  else if (frame_num < 0x10000) len = 3;
+  else if (frame_num < 0x200000) len = 4;
+  else if (frame_num < 0x4000000) len = 5;
+  else if (frame_num < 0x80000000) len = 6;
+  else len = 7;
+
+  for (i=len-1; i > 0; --i) {
+    buffer[i] = (FLAC__byte) (0x80 | (frame_num & 0x3F));
+    frame_num >>= 6;
+  }
+  buffer[0] = (FLAC__byte) (prefixes[len] | frame_num);
+
+  return len;
+}
+
+
+
+
+/* Returns the length of the coded frame number starting with the specified
+byte, or zero if the byte cannot start one. */
+static size_t frame_number_len(FLAC__byte first) {
+
+  size_t len;
+
+  if ((first & 0x80) == 0) return 1;
+  if (first == 0xFF || (first & 0xC0) == 0x80) return 0;
+
+  for (len=0; first & 0x80; first <<= 1) ++len;
+
+  return len;
+}
+
+
+
+
+size_t flac_frame_renumber(const FLAC__byte *frame, size_t len, uint64_t frame_num,
+                           FLAC__byte *dest) {
+
+  size_t old_num_len, new_num_len, extra_len, header_len, new_len;
+  unsigned blocksize_code, sample_rate_code;
+  uint16_t crc;
+
+
+  if (len < FRAME_HEADER_PREFIX_LEN + 1) return 0;
+
+  old_num_len = frame_number_len(frame[FRAME_HEADER_PREFIX_LEN]);
+  if (old_num_len == 0) return 0;
+
+
+  /* Optional blocksize and sample rate fields follow the frame number. */
+  blocksize_code = frame[2] >> 4;
+  sample_rate_code = frame[2] & 0x0F;
+
+  extra_len = 0;
+  if (blocksize_code == 6) extra_len += 1;
+  else if (blocksize_code == 7) extra_len += 2;
+  if (sample_rate_code == 12) extra_len += 1;
+  else if (sample_rate_code == 13 || sample_rate_code == 14) extra_len += 2;
+
+  /* The header is followed by its CRC-8 and the frame ends with a CRC-16. */
+  if (len < FRAME_HEADER_PREFIX_LEN + old_num_len + extra_len + 1 + 2) return 0;
+
+
+  memcpy(dest, frame, FRAME_HEADER_PREFIX_LEN);
+  new_num_len = flac_write_frame_number(frame_num, &(dest[FRAME_HEADER_PREFIX_LEN]));
+  header_len = FRAME_HEADER_PREFIX_LEN + new_num_len + extra_len;
+
+  memcpy(&(dest[FRAME_HEADER_PREFIX_LEN + new_num_len]),
+         &(frame[FRAME_HEADER_PREFIX_LEN + old_num_len]), extra_len);
+  dest[header_len] = flac_crc8(dest, header_len);
+
+  new_len = len - old_num_len + new_num_len;
+  memcpy(&(dest[header_len + 1]),
+         &(frame[FRAME_HEADER_PREFIX_LEN + old_num_len + extra_len + 1]),
+         new_len - header_len - 1 - 2);
+
+  crc = flac_crc16(dest, new_len - 2);
+  dest[new_len - 2] = (FLAC__byte) (crc >> 8);
+  dest[new_len - 1] = (FLAC__byte) (crc & 0xFF);
+
+
+  return new_len;
+}
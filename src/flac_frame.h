@@ -0,0 +1,56 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef FLAC_FRAME_H
+#define FLAC_FRAME_H
+
+
+#define MAX_FRAME_NUMBER_LEN 7
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <FLAC/stream_encoder.h>
+
+
+
+/* Returns the CRC-8 of the data, as used to protect FLAC frame headers. */
+uint8_t flac_crc8(const FLAC__byte *data, size_t len);
+
+/* Returns the CRC-16 of the data, as used to protect whole FLAC frames. */
+uint16_t flac_crc16(const FLAC__byte *data, size_t len);
+
+
+/* Writes the frame number in the UTF-8 like coding of FLAC frame headers to
+the buffer, which must hold MAX_FRAME_NUMBER_LEN bytes, and returns its
+length. */
+size_t flac_write_frame_number(uint64_t frame_num, FLAC__byte *buffer);
+
+
+/* Copies a fixed-blocksize FLAC frame to the destination with its frame number
+replaced and both checksums updated. The destination must hold the frame
+plus MAX_FRAME_NUMBER_LEN bytes. Returns the length of the new frame, or zero
+if the frame header cannot be parsed. */
+size_t flac_frame_renumber(const FLAC__byte *frame, size_t len, uint64_t frame_num,
+                           FLAC__byte *dest);
+
+
+
+#endif /* FLAC_FRAME_H */
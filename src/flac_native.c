@@ -0,0 +1,786 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define HAVE_X86_KERNELS 1
+  #include <immintrin.h>
+#endif
+
+#include "flac_frame.h"
+#include "flac_native.h"
+
+
+
+#define STREAMINFO_LEN 34
+#define MAX_RICE_PARAM 14         /* Four bit parameters, fifteen is the escape code. */
+#define MAX_WIDE_RICE_PARAM 30    /* Five bit parameters, 31 is the escape code. */
+
+#define CHANNELS_LEFT_SIDE 8
+#define CHANNELS_SIDE_RIGHT 9
+#define CHANNELS_MID_SIDE 10
+
+
+
+
+/* Big-endian bit writer collecting up to 32 bits before storing them, so most
+writes only shift and or. */
+struct bit_writer_t {
+  FLAC__byte *buffer;
+  size_t pos;
+  uint64_t acc;
+  unsigned num_bits;        /* Bits in the accumulator not yet stored. */
+};
+
+
+/* Appends the low bits of the value, which must not have higher bits set. */
+static inline void put_bits(struct bit_writer_t *writer, const uint32_t value,
+                            const unsigned num_bits) {
+
+  uint32_t word;
+
+  writer->acc = (writer->acc << num_bits) | value;
+  writer->num_bits += num_bits;
+
+  if (writer->num_bits >= 32) {
+    writer->num_bits -= 32;
+    word = __builtin_bswap32((uint32_t) (writer->acc >> writer->num_bits));
+    memcpy(&(writer->buffer[writer->pos]), &word, 4);
+    writer->pos += 4;
+  }
+}
+
+
+/* Appends the low bits of a signed value. */
+static inline void put_signed(struct bit_writer_t *writer, const int32_t value,
+                              const unsigned num_bits) {
+  put_bits(writer, (uint32_t) value & (UINT32_MAX >> (32 - num_bits)), num_bits);
+}
+
+
+/* Appends a Rice code: the quotient in unary as zeros closed by a one, then
+the remainder. */
+static inline void put_rice(struct bit_writer_t *writer, const uint32_t value,
+                            const unsigned param) {
+
+  uint32_t quotient = value >> param;
+  uint32_t tail = (1u << param) | (value & ((1u << param) - 1));
+
+  if (quotient + param < 32) {
+    put_bits(writer, tail, quotient + param + 1);
+    return;
+  }
+
+  for (; quotient >= 32; quotient -= 32) {
+    put_bits(writer, 0, 32);
+  }
+  put_bits(writer, 0, quotient);
+  put_bits(writer, tail, param + 1);
+}
+
+
+/* Pads the output with zeros to a byte boundary and stores every pending
+byte. */
+static void flush_bits(struct bit_writer_t *writer) {
+
+  if (writer->num_bits % 8 != 0) {
+    put_bits(writer, 0, 8 - writer->num_bits % 8);
+  }
+
+  while (writer->num_bits > 0) {
+    writer->num_bits -= 8;
+    writer->buffer[writer->pos++] = (FLAC__byte) (writer->acc >> writer->num_bits);
+  }
+}
+
+
+
+
+/* Fixed predictor residuals. Every order is measured from the fifth sample on,
+so the sums of different orders are comparable. */
+
+static inline uint32_t magnitude(const int32_t value) {
+  return value < 0 ? -(uint32_t) value : (uint32_t) value;
+}
+
+
+static void fixed_sums_scalar(const int32_t *x, size_t len,
+                              uint64_t sums[NATIVE_MAX_FIXED_ORDER + 1]) {
+
+  size_t i;
+
+  memset(sums, 0, sizeof(uint64_t) * (NATIVE_MAX_FIXED_ORDER + 1));
+
+  for (i=NATIVE_MAX_FIXED_ORDER; i < len; ++i) {
+    sums[0] += magnitude(x[i]);
+    sums[1] += magnitude(x[i] - x[i-1]);
+    sums[2] += magnitude(x[i] - 2*x[i-1] + x[i-2]);
+    sums[3] += magnitude(x[i] - 3*x[i-1] + 3*x[i-2] - x[i-3]);
+    sums[4] += magnitude(x[i] - 4*x[i-1] + 6*x[i-2] - 4*x[i-3] + x[i-4]);
+  }
+}
+
+
+static inline int32_t fixed_residual_at(const int32_t *x, const size_t i,
+                                        const unsigned order) {
+  switch (order) {
+    case (0): return x[i];
+    case (1): return x[i] - x[i-1];
+    case (2): return x[i] - 2*x[i-1] + x[i-2];
+    case (3): return x[i] - 3*x[i-1] + 3*x[i-2] - x[i-3];
+    default:  return x[i] - 4*x[i-1] + 6*x[i-2] - 4*x[i-3] + x[i-4];
+  }
+}
+
+
+static void fixed_residual_scalar(const int32_t *x, size_t len, unsigned order,
+                                  int32_t *residual) {
+
+  size_t i;
+
+  for (i=order; i < len; ++i) {
+    residual[i - order] = fixed_residual_at(x, i, order);
+  }
+}
+
+
+
+
+#ifdef HAVE_X86_KERNELS
+
+
+/* Adds the magnitudes of eight residuals to four 64-bit lane sums. */
+__attribute__((target("avx2")))
+static inline __m256i add_magnitudes(__m256i sum, const __m256i residual) {
+
+  const __m256i mag = _mm256_abs_epi32(residual);
+
+  sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(mag)));
+  return _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(mag, 1)));
+}
+
+
+__attribute__((target("avx2")))
+static void fixed_sums_avx2(const int32_t *x, size_t len,
+                            uint64_t sums[NATIVE_MAX_FIXED_ORDER + 1]) {
+
+  const __m256i three = _mm256_set1_epi32(3);
+  const __m256i six = _mm256_set1_epi32(6);
+  __m256i acc[NATIVE_MAX_FIXED_ORDER + 1];
+  __m256i x0, x1, x2, x3, x4;
+  uint64_t lanes[4];
+  size_t i, j;
+
+
+  for (j=0; j <= NATIVE_MAX_FIXED_ORDER; ++j) {
+    acc[j] = _mm256_setzero_si256();
+  }
+
+  for (i=NATIVE_MAX_FIXED_ORDER; i + 8 <= len; i += 8) {
+    x0 = _mm256_loadu_si256((const __m256i*) &(x[i]));
+    x1 = _mm256_loadu_si256((const __m256i*) &(x[i-1]));
+    x2 = _mm256_loadu_si256((const __m256i*) &(x[i-2]));
+    x3 = _mm256_loadu_si256((const __m256i*) &(x[i-3]));
+    x4 = _mm256_loadu_si256((const __m256i*) &(x[i-4]));
+
+    acc[0] = add_magnitudes(acc[0], x0);
+    acc[1] = add_magnitudes(acc[1], _mm256_sub_epi32(x0, x1));
+    acc[2] = add_magnitudes(acc[2], _mm256_add_epi32(_mm256_sub_epi32(x0, _mm256_slli_epi32(x1, 1)),
+                                                     x2));
+    acc[3] = add_magnitudes(acc[3], _mm256_add_epi32(_mm256_sub_epi32(x0, x3),
+                                                     _mm256_mullo_epi32(three,
+                                                                        _mm256_sub_epi32(x2, x1))));
+    acc[4] = add_magnitudes(acc[4],
+                            _mm256_add_epi32(_mm256_sub_epi32(_mm256_add_epi32(x0, x4),
+                                                              _mm256_slli_epi32(_mm256_add_epi32(x1, x3), 2)),
+                                             _mm256_mullo_epi32(six, x2)));
+  }
+
+  for (j=0; j <= NATIVE_MAX_FIXED_ORDER; ++j) {
+    _mm256_storeu_si256((__m256i*) lanes, acc[j]);
+    sums[j] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+
+  for (; i < len; ++i) {
+    for (j=0; j <= NATIVE_MAX_FIXED_ORDER; ++j) {
+      sums[j] += magnitude(fixed_residual_at(x, i, j));
+    }
+  }
+}
+
+
+__attribute__((target("avx2")))
+static void fixed_residual_avx2(const int32_t *x, size_t len, unsigned order,
+                                int32_t *residual) {
+
+  const __m256i three = _mm256_set1_epi32(3);
+  const __m256i six = _mm256_set1_epi32(6);
+  __m256i x0, x1, x2, x3, x4, r;
+  size_t i;
+
+
+  for (i=order; i + 8 <= len; i += 8) {
+    x0 = _mm256_loadu_si256((const __m256i*) &(x[i]));
+
+    switch (order) {
+
+      case (0):
+        r = x0;
+        break;
+
+      case (1):
+        x1 = _mm256_loadu_si256((const __m256i*) &(x[i-1]));
+        r = _mm256_sub_epi32(x0, x1);
+        break;
+
+      case (2):
+        x1 = _mm256_loadu_si256((const __m256i*) &(x[i-1]));
+        x2 = _mm256_loadu_si256((const __m256i*) &(x[i-2]));
+        r = _mm256_add_epi32(_mm256_sub_epi32(x0, _mm256_slli_epi32(x1, 1)), x2);
+        break;
+
+      case (3):
+        x1 = _mm256_loadu_si256((const __m256i*) &(x[i-1]));
+        x2 = _mm256_loadu_si256((const __m256i*) &(x[i-2]));
+        x3 = _mm256_loadu_si256((const __m256i*) &(x[i-3]));
+        r = _mm256_add_epi32(_mm256_sub_epi32(x0, x3),
+                             _mm256_mullo_epi32(three, _mm256_sub_epi32(x2, x1)));
+        break;
+
+      default:
+        x1 = _mm256_loadu_si256((const __m256i*) &(x[i-1]));
+        x2 = _mm256_loadu_si256((const __m256i*) &(x[i-2]));
+        x3 = _mm256_loadu_si256((const __m256i*) &(x[i-3]));
+        x4 = _mm256_loadu_si256((const __m256i*) &(x[i-4]));
+        r = _mm256_add_epi32(_mm256_sub_epi32(_mm256_add_epi32(x0, x4),
+                                              _mm256_slli_epi32(_mm256_add_epi32(x1, x3), 2)),
+                             _mm256_mullo_epi32(six, x2));
+        break;
+    }
+
+    _mm256_storeu_si256((__m256i*) &(residual[i - order]), r);
+  }
+
+  for (; i < len; ++i) {
+    residual[i - order] = fixed_residual_at(x, i, order);
+  }
+}
+
+
+#endif /* HAVE_X86_KERNELS */
+
+
+
+
+/* Returns the Rice parameter coding the partition in the fewest bits, and sets
+that number. The cost n * (k + 1) + (sum >> k) is exact up to the remainders
+lost in the shift, so it never underestimates. */
+static unsigned rice_param(const uint64_t sum, const size_t num_samples,
+                           uint64_t *num_bits) {
+
+  uint64_t best = UINT64_MAX, bits;
+  unsigned guess = 0, param = 0, k;
+
+  if (num_samples > 0 && sum > num_samples) {
+    guess = 63 - __builtin_clzll(sum / num_samples);
+  }
+
+  for (k = guess > 0 ? guess - 1 : 0; k <= guess + 1 && k <= MAX_WIDE_RICE_PARAM; ++k) {
+    bits = (uint64_t) num_samples * (k + 1) + (sum >> k);
+    if (bits < best) {
+      best = bits;
+      param = k;
+    }
+  }
+
+  *num_bits = best;
+  return param;
+}
+
+
+/* Picks the partition order and Rice parameters for the residual of a fixed
+subframe of the specified blocksize, and returns the number of bits of the
+residual section. */
+static uint64_t plan_residual(const int32_t *residual, const size_t len,
+                              struct fj_subframe_plan_t *plan) {
+
+  uint64_t sums[1 << NATIVE_MAX_PARTITION_ORDER];
+  unsigned char params[1 << NATIVE_MAX_PARTITION_ORDER];
+  uint64_t best = UINT64_MAX, bits, partition_bits;
+  unsigned max_order = 0, order, max_param;
+  size_t num_partitions, partition_len, start, end, i, j;
+
+
+  /* Partitions must split the block evenly and each hold more samples than
+  the predictor order. */
+  while (max_order < NATIVE_MAX_PARTITION_ORDER && len % (2u << max_order) == 0
+         && (len >> (max_order + 1)) > plan->order) {
+    ++max_order;
+  }
+
+
+  num_partitions = (size_t) 1 << max_order;
+  partition_len = len >> max_order;
+
+  for (j=0; j < num_partitions; ++j) {
+    start = j == 0 ? 0 : j * partition_len - plan->order;
+    end = (j + 1) * partition_len - plan->order;
+    sums[j] = 0;
+    for (i=start; i < end; ++i) {
+      sums[j] += (uint32_t) (residual[i] << 1) ^ (uint32_t) (residual[i] >> 31);
+    }
+  }
+
+
+  /* Try each order from the finest, merging neighbouring partitions. */
+  for (order = max_order + 1; order-- > 0; ) {
+
+    num_partitions = (size_t) 1 << order;
+    partition_len = len >> order;
+    bits = 0;
+    max_param = 0;
+
+    for (j=0; j < num_partitions; ++j) {
+      params[j] = rice_param(sums[j], partition_len - (j == 0 ? plan->order : 0),
+                             &partition_bits);
+      if (params[j] > max_param) max_param = params[j];
+      bits += partition_bits;
+    }
+    bits += num_partitions * (max_param > MAX_RICE_PARAM ? 5 : 4);
+
+    if (bits < best) {
+      best = bits;
+      plan->partition_order = order;
+      plan->wide_params = max_param > MAX_RICE_PARAM;
+      memcpy(plan->params, params, num_partitions);
+    }
+
+    for (j=0; j < num_partitions / 2; ++j) {
+      sums[j] = sums[2*j] + sums[2*j + 1];
+    }
+  }
+
+
+  /* Coding method and partition order. */
+  return 2 + 4 + best;
+}
+
+
+/* Picks the cheapest subframe for one channel and leaves the residual of a
+fixed subframe in the buffer. */
+static void plan_subframe(struct fj_native_encoder_t *encoder, const int32_t *x,
+                          const unsigned bit_depth, int32_t *residual,
+                          struct fj_subframe_plan_t *plan) {
+
+  const size_t len = encoder->blocksize;
+  uint64_t sums[NATIVE_MAX_FIXED_ORDER + 1];
+  uint64_t fixed_bits;
+  unsigned order;
+  size_t i;
+
+
+  for (i=1; i < len && x[i] == x[0]; ++i);
+
+  if (i == len) {
+    plan->type = SUBFRAME_CONSTANT;
+    plan->num_bits = 8 + bit_depth;
+    return;
+  }
+
+  plan->type = SUBFRAME_VERBATIM;
+  plan->num_bits = 8 + (uint64_t) len * bit_depth;
+
+
+  encoder->fixed_sums(x, len, sums);
+
+  plan->order = 0;
+  for (order=1; order <= NATIVE_MAX_FIXED_ORDER; ++order) {
+    if (sums[order] < sums[plan->order]) plan->order = order;
+  }
+
+  encoder->fixed_residual(x, len, plan->order, residual);
+
+  fixed_bits = 8 + plan->order * bit_depth + plan_residual(residual, len, plan);
+  if (fixed_bits < plan->num_bits) {
+    plan->type = SUBFRAME_FIXED;
+    plan->num_bits = fixed_bits;
+  }
+}
+
+
+static void write_subframe(struct bit_writer_t *writer, const int32_t *x,
+                           const size_t len, const unsigned bit_depth,
+                           const int32_t *residual, const struct fj_subframe_plan_t *plan) {
+
+  size_t num_partitions, partition_len, start, end, i, j;
+  unsigned param_bits;
+
+
+  switch (plan->type) {
+
+    case (SUBFRAME_CONSTANT):
+      put_bits(writer, 0x00, 8);
+      put_signed(writer, x[0], bit_depth);
+      break;
+
+    case (SUBFRAME_VERBATIM):
+      put_bits(writer, 0x02, 8);
+      for (i=0; i < len; ++i) {
+        put_signed(writer, x[i], bit_depth);
+      }
+      break;
+
+    case (SUBFRAME_FIXED):
+      put_bits(writer, 0x10 | (plan->order << 1), 8);
+      for (i=0; i < plan->order; ++i) {
+        put_signed(writer, x[i], bit_depth);
+      }
+
+      param_bits = plan->wide_params ? 5 : 4;
+      put_bits(writer, plan->wide_params ? 1 : 0, 2);
+      put_bits(writer, plan->partition_order, 4);
+
+      num_partitions = (size_t) 1 << plan->partition_order;
+      partition_len = len >> plan->partition_order;
+
+      for (j=0; j < num_partitions; ++j) {
+        put_bits(writer, plan->params[j], param_bits);
+        start = j == 0 ? 0 : j * partition_len - plan->order;
+        end = (j + 1) * partition_len - plan->order;
+        for (i=start; i < end; ++i) {
+          put_rice(writer, (uint32_t) (residual[i] << 1) ^ (uint32_t) (residual[i] >> 31),
+                   plan->params[j]);
+        }
+      }
+      break;
+  }
+}
+
+
+
+
+static unsigned blocksize_code(const unsigned blocksize) {
+
+  unsigned code;
+
+  if (blocksize == 192) return 1;
+
+  for (code=2; code <= 5; ++code) {
+    if (blocksize == 576u << (code - 2)) return code;
+  }
+  for (code=8; code <= 15; ++code) {
+    if (blocksize == 256u << (code - 8)) return code;
+  }
+
+  /* Stored after the frame number in eight or sixteen bits. */
+  return blocksize <= 256 ? 6 : 7;
+}
+
+
+static unsigned sample_rate_code(const unsigned sample_rate) {
+
+  switch (sample_rate) {
+    case (88200):  return 1;
+    case (176400): return 2;
+    case (192000): return 3;
+    case (8000):   return 4;
+    case (16000):  return 5;
+    case (22050):  return 6;
+    case (24000):  return 7;
+    case (32000):  return 8;
+    case (44100):  return 9;
+    case (48000):  return 10;
+    case (96000):  return 11;
+    default:       return 0;    /* Taken from STREAMINFO. */
+  }
+}
+
+
+static unsigned sample_size_code(const unsigned bit_depth) {
+
+  switch (bit_depth) {
+    case (8):  return 1;
+    case (12): return 2;
+    case (16): return 4;
+    case (20): return 5;
+    default:   return 6;
+  }
+}
+
+
+
+
+
+
+bool native_encoder_init(struct fj_native_encoder_t *encoder, const unsigned num_channels,
+                         const unsigned bit_depth, const unsigned sample_rate,
+                         const unsigned blocksize) {
+
+  size_t num_candidates = num_channels == 2 ? 4 : num_channels;
+
+
+  memset(encoder, 0, sizeof(struct fj_native_encoder_t));
+
+  if (num_channels < 1 || num_channels > NATIVE_MAX_CHANNELS
+      || bit_depth < 8 || bit_depth > 24 || bit_depth % 4 != 0
+      || blocksize < 16 || blocksize > 65535) {
+    return false;
+  }
+
+  encoder->num_channels = num_channels;
+  encoder->bit_depth = bit_depth;
+  encoder->sample_rate = sample_rate;
+  encoder->blocksize = blocksize;
+
+  /* A frame never grows past verbatim subframes, including the wider side
+  channel, plus the frame header and footer. */
+  encoder->output_capacity = 64 + num_candidates * (8 + (size_t) blocksize * 4);
+
+  encoder->signal = (int32_t*) malloc(sizeof(int32_t) * blocksize * (num_channels + 2));
+  encoder->residual = (int32_t*) malloc(sizeof(int32_t) * blocksize * num_candidates);
+  encoder->output = (FLAC__byte*) malloc(encoder->output_capacity);
+
+  if (encoder->signal == NULL || encoder->residual == NULL || encoder->output == NULL) {
+    native_encoder_free(encoder);
+    return false;
+  }
+
+
+  encoder->fixed_sums = fixed_sums_scalar;
+  encoder->fixed_residual = fixed_residual_scalar;
+
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    encoder->fixed_sums = fixed_sums_avx2;
+    encoder->fixed_residual = fixed_residual_avx2;
+  }
+#endif
+
+
+  return true;
+}
+
+
+
+
+void native_encoder_free(struct fj_native_encoder_t *encoder) {
+
+  free(encoder->signal);
+  free(encoder->residual);
+  free(encoder->output);
+
+  encoder->signal = NULL;
+  encoder->residual = NULL;
+  encoder->output = NULL;
+}
+
+
+
+
+size_t native_encoder_write_header(const struct fj_native_encoder_t *encoder,
+                                   FLAC__byte *buffer) {
+
+  struct bit_writer_t writer = {buffer, 0, 0, 0};
+
+
+  memcpy(buffer, "fLaC", 4);
+  writer.pos = 4;
+
+  /* Last metadata block, of type STREAMINFO. */
+  put_bits(&writer, 0x80, 8);
+  put_bits(&writer, STREAMINFO_LEN, 24);
+
+  put_bits(&writer, encoder->blocksize, 16);
+  put_bits(&writer, encoder->blocksize, 16);
+
+  /* Frame sizes, total samples and checksum are unknown for a live stream. */
+  put_bits(&writer, 0, 24);
+  put_bits(&writer, 0, 24);
+  put_bits(&writer, encoder->sample_rate, 20);
+  put_bits(&writer, encoder->num_channels - 1, 3);
+  put_bits(&writer, encoder->bit_depth - 1, 5);
+  put_bits(&writer, 0, 4);
+  put_bits(&writer, 0, 32);
+  put_bits(&writer, 0, 32);
+  put_bits(&writer, 0, 32);
+  put_bits(&writer, 0, 32);
+  put_bits(&writer, 0, 32);
+
+  flush_bits(&writer);
+
+
+  return writer.pos;
+}
+
+
+
+
+size_t native_encoder_add(struct fj_native_encoder_t *encoder, const int32_t *samples,
+                          const size_t channel_stride, const size_t sample_stride,
+                          const size_t num_samples) {
+
+  size_t num_taken = encoder->blocksize - encoder->num_filled;
+  int32_t *dest;
+  size_t i, c;
+
+  if (num_taken > num_samples) num_taken = num_samples;
+
+  for (c=0; c < encoder->num_channels; ++c) {
+    dest = &(encoder->signal[c * encoder->blocksize + encoder->num_filled]);
+    for (i=0; i < num_taken; ++i) {
+      dest[i] = samples[c * channel_stride + i * sample_stride];
+    }
+  }
+
+  encoder->num_filled += num_taken;
+
+  return num_taken;
+}
+
+
+
+
+const FLAC__byte * native_encoder_encode(struct fj_native_encoder_t *encoder,
+                                         const uint64_t frame_num, size_t *len) {
+
+  const size_t blocksize = encoder->blocksize;
+  const unsigned depth = encoder->bit_depth;
+  struct fj_subframe_plan_t *plans = encoder->plans;
+  struct bit_writer_t writer = {encoder->output, 0, 0, 0};
+  const int32_t *channels[NATIVE_MAX_CHANNELS];
+  const int32_t *residuals[NATIVE_MAX_CHANNELS];
+  unsigned depths[NATIVE_MAX_CHANNELS];
+  unsigned assignment, bs_code;
+  uint64_t bits, best;
+  uint16_t crc;
+  size_t i, c;
+
+
+  for (c=0; c < encoder->num_channels; ++c) {
+    channels[c] = &(encoder->signal[c * blocksize]);
+    residuals[c] = &(encoder->residual[c * blocksize]);
+    depths[c] = depth;
+    plan_subframe(encoder, channels[c], depth, &(encoder->residual[c * blocksize]),
+                  &(plans[c]));
+  }
+
+  assignment = encoder->num_channels - 1;
+
+
+  /* Stereo frames also try coding the side channel, one bit wider, in place of
+  either channel or with the mid channel. */
+  if (encoder->num_channels == 2) {
+    int32_t *mid = &(encoder->signal[2 * blocksize]);
+    int32_t *side = &(encoder->signal[3 * blocksize]);
+
+    for (i=0; i < blocksize; ++i) {
+      mid[i] = (channels[0][i] + channels[1][i]) >> 1;
+      side[i] = channels[0][i] - channels[1][i];
+    }
+
+    plan_subframe(encoder, mid, depth, &(encoder->residual[2 * blocksize]), &(plans[2]));
+    plan_subframe(encoder, side, depth + 1, &(encoder->residual[3 * blocksize]), &(plans[3]));
+
+    best = plans[0].num_bits + plans[1].num_bits;
+
+    if ((bits = plans[0].num_bits + plans[3].num_bits) < best) {
+      best = bits;
+      assignment = CHANNELS_LEFT_SIDE;
+    }
+    if ((bits = plans[3].num_bits + plans[1].num_bits) < best) {
+      best = bits;
+      assignment = CHANNELS_SIDE_RIGHT;
+    }
+    if ((bits = plans[2].num_bits + plans[3].num_bits) < best) {
+      best = bits;
+      assignment = CHANNELS_MID_SIDE;
+    }
+
+    switch (assignment) {
+      case (CHANNELS_LEFT_SIDE):
+        plans[1] = plans[3];
+        channels[1] = side;
+        residuals[1] = &(encoder->residual[3 * blocksize]);
+        depths[1] = depth + 1;
+        break;
+
+      case (CHANNELS_SIDE_RIGHT):
+        plans[0] = plans[3];
+        channels[0] = side;
+        residuals[0] = &(encoder->residual[3 * blocksize]);
+        depths[0] = depth + 1;
+        break;
+
+      case (CHANNELS_MID_SIDE):
+        plans[0] = plans[2];
+        plans[1] = plans[3];
+        channels[0] = mid;
+        channels[1] = side;
+        residuals[0] = &(encoder->residual[2 * blocksize]);
+        residuals[1] = &(encoder->residual[3 * blocksize]);
+        depths[1] = depth + 1;
+        break;
+    }
+  }
+
+
+  /* Frame header with a fixed blocksize, so the frame number counts frames. */
+  bs_code = blocksize_code(blocksize);
+
+  encoder->output[0] = 0xFF;
+  encoder->output[1] = 0xF8;
+  encoder->output[2] = (FLAC__byte) ((bs_code << 4) | sample_rate_code(encoder->sample_rate));
+  encoder->output[3] = (FLAC__byte) ((assignment << 4) | (sample_size_code(depth) << 1));
+  writer.pos = 4 + flac_write_frame_number(frame_num, &(encoder->output[4]));
+
+  if (bs_code == 6) {
+    encoder->output[writer.pos++] = (FLAC__byte) (blocksize - 1);
+  }
+  else if (bs_code == 7) {
+    encoder->output[writer.pos++] = (FLAC__byte) ((blocksize - 1) >> 8);
+    encoder->output[writer.pos++] = (FLAC__byte) (blocksize - 1);
+  }
+
+  encoder->output[writer.pos] = flac_crc8(encoder->output, writer.pos);
+  ++writer.pos;
+
+
+  for (c=0; c < encoder->num_channels; ++c) {
+    write_subframe(&writer, channels[c], blocksize, depths[c], residuals[c], &(plans[c]));
+  }
+
+  flush_bits(&writer);
+
+  crc = flac_crc16(encoder->output, writer.pos);
+  encoder->output[writer.pos++] = (FLAC__byte) (crc >> 8);
+  encoder->output[writer.pos++] = (FLAC__byte) crc;
+
+  encoder->num_filled = 0;
+  *len = writer.pos;
+
+
+  return encoder->output;
+}
@@ -0,0 +1,115 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef FLAC_NATIVE_H
+#define FLAC_NATIVE_H
+
+
+#define NATIVE_BLOCKSIZE 4096           /* Used unless a blocksize is configured. */
+#define NATIVE_HEADER_LEN 42            /* fLaC marker and STREAMINFO block. */
+#define NATIVE_MAX_CHANNELS 8
+#define NATIVE_MAX_FIXED_ORDER 4
+#define NATIVE_MAX_PARTITION_ORDER 8
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <FLAC/stream_encoder.h>
+
+
+
+/* Residual magnitudes of each fixed predictor order over one channel. */
+typedef void (*fj_fixed_sums_func_t)(const int32_t *signal, size_t len,
+                                     uint64_t sums[NATIVE_MAX_FIXED_ORDER + 1]);
+
+/* Residual of one fixed predictor order, one value per sample after the
+warmup samples. */
+typedef void (*fj_fixed_residual_func_t)(const int32_t *signal, size_t len,
+                                         unsigned order, int32_t *residual);
+
+
+/* Subframe chosen for one channel of the frame being encoded. */
+struct fj_subframe_plan_t {
+  enum {SUBFRAME_CONSTANT, SUBFRAME_VERBATIM, SUBFRAME_FIXED} type;
+  unsigned order;
+  unsigned partition_order;
+  bool wide_params;         /* Rice parameters need five bits. */
+  unsigned char params[1 << NATIVE_MAX_PARTITION_ORDER];
+  uint64_t num_bits;
+};
+
+
+/* Minimal FLAC encoder writing fixed-blocksize frames with constant, verbatim
+and fixed predictor subframes and partitioned Rice residuals. It has no
+lookahead, so each frame is written as soon as its last sample arrives. */
+struct fj_native_encoder_t {
+  unsigned num_channels;
+  unsigned bit_depth;
+  unsigned sample_rate;
+  unsigned blocksize;
+
+  int32_t *signal;          /* One run per channel, then mid and side when stereo. */
+  size_t num_filled;        /* Samples per channel staged for the next frame. */
+  int32_t *residual;        /* One run per candidate channel. */
+  struct fj_subframe_plan_t plans[NATIVE_MAX_CHANNELS];
+
+  FLAC__byte *output;
+  size_t output_capacity;
+
+  fj_fixed_sums_func_t fixed_sums;
+  fj_fixed_residual_func_t fixed_residual;
+};
+
+
+
+/* Allocates the buffers of the encoder and picks the residual kernels for
+the running CPU. Returns false if the format is not supported or memory
+cannot be allocated. */
+bool native_encoder_init(struct fj_native_encoder_t *encoder, const unsigned num_channels,
+                         const unsigned bit_depth, const unsigned sample_rate,
+                         const unsigned blocksize);
+
+/* Frees the buffers of the encoder. */
+void native_encoder_free(struct fj_native_encoder_t *encoder);
+
+
+/* Writes the fLaC marker and a STREAMINFO block, which must fit in
+NATIVE_HEADER_LEN bytes, and returns their length. */
+size_t native_encoder_write_header(const struct fj_native_encoder_t *encoder,
+                                   FLAC__byte *buffer);
+
+
+/* Stages samples for the next frame, sample n of channel c being read from
+samples[c * channel_stride + n * sample_stride]. Stops once the frame is full,
+when num_filled reaches the blocksize, and returns the number of samples per
+channel taken. */
+size_t native_encoder_add(struct fj_native_encoder_t *encoder, const int32_t *samples,
+                          const size_t channel_stride, const size_t sample_stride,
+                          const size_t num_samples);
+
+/* Encodes the staged frame, which must be full, with the specified frame number and returns it,
+setting its length. The frame stays valid until the next call. */
+const FLAC__byte * native_encoder_encode(struct fj_native_encoder_t *encoder,
+                                         const uint64_t frame_num, size_t *len);
+
+
+
+#endif /* FLAC_NATIVE_H */
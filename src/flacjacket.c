@@ -37,13 +37,27 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <pthread.h>
 #include <uuid/uuid.h>
 
+#include "convert.h"
+#include "dither.h"
+#include "downmix.h"
+#include "encode_pool.h"
+#include "encoder.h"
+#include "events.h"
 #include "flacjacket_globals.h"
 #include "flacjacket_params.h"
 #include "logging.h"
+#include "media.h"
+#include "resampler.h"
 #include "server.h"
 
 
 
+#define FLAC_MIN_BLOCKSIZE 16
+#define FLAC_MAX_BLOCKSIZE 65535
+#define MAX_COMPRESSION_LEVEL 8
+#define MIN_CAPTURE_RING_MS 250
+
+
 #define MAX_MAGNITUDE_8  127.0
 #define MAX_MAGNITUDE_12 2047.0
 #define MAX_MAGNITUDE_16 32767.0
@@ -76,22 +90,32 @@ const char *CHANNEL_NAMES_8[] = {"Front Left", "Front Right", "Front Center",
 static void signal_handler(int sig) {
   if (sig == SIGINT) {
     debug_log("Caught Control+C signal.");
-    g_exited = true;
+    request_exit();
   }
 }
 
 
 
 
-/* Process handler for JACK audio. Reads input ports, scales the samples and
-converts to integer type, then interleaves channel samples and saves them to the
-buffer consumed by media threads. */
+/* Process handler for JACK audio. Reads input ports, then scales, saturates,
+converts and interleaves the samples into the capture ring consumed by the
+capture thread. Never blocks: if the ring is full the period is dropped and
+counted as an overrun. */
 static int process_audio(jack_nframes_t nframes, void *arg) {
 
-  jack_default_audio_sample_t *sample_buffers[8];
-  int32_t scaled;
-  size_t i, j;
-  
+  const float *sample_buffers[8];
+  struct fj_ring_t *rings = g_shared.capture_rings;
+  size_t len = g_shared.planar ? nframes : nframes * g_shared.num_channels;
+  size_t j;
+
+
+  for (j=0; j < g_shared.num_capture_rings; ++j) {
+    if (!ring_can_write(&(rings[j]), len)) {
+      ring_overrun(&(rings[0]));
+      return 0;
+    }
+  }
+
 
   /* Get latest buffers for each input port. */
   for (j=0; j < g_shared.num_channels; ++j) {
@@ -99,44 +123,25 @@ static int process_audio(jack_nframes_t nframes, void *arg) {
   }
 
 
-  /* Scale and interleave samples into the processor buffer. */
-  for (i=0; i < nframes; ++i) {
+  /* The rings are mirrored, so the whole period converts in one contiguous run
+  even when it crosses the end of a ring. */
+  if (g_shared.planar) {
     for (j=0; j < g_shared.num_channels; ++j) {
-      scaled = (int32_t) (g_shared.out_sample_max * (double) sample_buffers[j][i]);
-      g_shared.processor_buffer[g_shared.processor_buffer_len++] = scaled;
-      if (g_shared.processor_buffer_len >= g_shared.buffer_len_max) {
-        g_shared.processor_buffer_len = 0;
-      }
+      g_shared.convert(&(sample_buffers[j]), 1, nframes, g_shared.out_sample_max,
+                       ring_write_ptr(&(rings[j])));
     }
   }
+  else {
+    g_shared.convert(sample_buffers, g_shared.num_channels, nframes,
+                     g_shared.out_sample_max, ring_write_ptr(&(rings[0])));
+  }
 
-
-
-
-  /* Copy processor buffer to encoder buffer only when lock is available. */
-  if (pthread_mutex_trylock(&(g_shared.encoder_lock)) == 0) {
-
-    memcpy(&(g_shared.encoder_buffer[g_shared.encoder_buffer_len]),
-           g_shared.processor_buffer,
-           g_shared.processor_buffer_len * sizeof(int32_t));
-    g_shared.encoder_buffer_len += g_shared.processor_buffer_len;
-    g_shared.processor_buffer_len = 0;
-
-
-    if (g_shared.encoder_buffer_len >= 2 * g_shared.encoder_buffer_len_threshold) {
-
-      memmove(&(g_shared.encoder_buffer[0]),
-              &(g_shared.encoder_buffer[g_shared.encoder_buffer_len_threshold]),
-              (g_shared.encoder_buffer_len - g_shared.encoder_buffer_len_threshold)
-              * sizeof(int32_t));
-
-      g_shared.encoder_buffer_start_ind += g_shared.encoder_buffer_len_threshold;
-      g_shared.encoder_buffer_len -= g_shared.encoder_buffer_len_threshold;
-    }
-
-    pthread_mutex_unlock(&(g_shared.encoder_lock));
-    
+  /* Commit the first ring last: the capture thread only checks its fill
+  level, and the release orders it after the other rings' commits. */
+  for (j=g_shared.num_capture_rings; j > 0; --j) {
+    ring_commit(&(rings[j-1]), len);
   }
+  event_signal(g_shared.capture_event);
 
 
   return 0;      
@@ -148,7 +153,7 @@ static int process_audio(jack_nframes_t nframes, void *arg) {
 /* If JACK shuts down, just set the exit flag and allow threads to close. */
 void jack_shutdown(void *arg) {
   debug_log("Jack shutdown initiated.");
-  g_exited = true;
+  request_exit();
 }
 
 
@@ -160,6 +165,14 @@ int main (int argc, char *argv[]) {
 
   g_exited = false;
 
+  g_shared.exit_event = event_create();
+  g_shared.capture_event = event_create();
+
+  if (g_shared.exit_event < 0 || g_shared.capture_event < 0) {
+    error_log("Cannot create events: %s", strerror(errno));
+    exit(1);
+  }
+
   
   /* Install signal handler to catch control+c and exit gracefully. */
   struct sigaction sigact;
@@ -173,6 +186,7 @@ int main (int argc, char *argv[]) {
   /* Parse and validate JSON parameters. */
 
   struct fj_params_t params;
+  struct fj_profile_t profile;
 
 
   strcpy(params.name_buffer, "FLACJACKet");
@@ -180,17 +194,56 @@ int main (int argc, char *argv[]) {
   strcpy(params.allowed_cidr_buffer, "127.0.0.1/24");
   params.port = 4000;
   params.max_num_connections = 16;
+  params.max_num_sessions = 256;
+  params.num_media_workers = 2;
   params.compression_level = 4;
+  params.adaptive_compression = false;
+  params.min_compression_level = 0;
+  params.max_compression_level = 8;
+  params.num_encode_threads = 1;
+  params.engine = ENGINE_LIBFLAC;
+  params.idle_ms = 5000;
+  params.resample_rates[0] = 0;
+  params.downmixes[0].preset = DOWNMIX_NONE;
+  params.lpcm_stream = false;
+  params.wav_stream = false;
+  params.ogg_stream = false;
+  params.ogg_frames_per_page = 1;
   params.bit_depth = 16;
   params.num_channels = 8;
   params.encoder_buffer_ms = 60;
+  params.low_latency = false;
+  params.low_latency_periods = 1;
+  params.planar = false;
+  for (size_t i = 0; i < MAX_NUM_STREAMS; ++i) {
+    params.stream_dither[i] = DITHER_NONE;
+  }
+  params.audio_mem.lock = true;
+  params.audio_mem.hugepages = HUGEPAGES_NONE;
+  params.preroll_ms = 500;
+  params.max_lag_ms = 2000;
+  params.lag_policy = LAG_DROP_TO_LIVE;
 
 
 
   g_shared.max_num_connections = params.max_num_connections;
+  g_shared.max_num_sessions = params.max_num_sessions;
+  g_shared.num_media_workers = params.num_media_workers;
   g_shared.name = params.name_buffer;
   g_shared.compression_level = params.compression_level;
 
+  if (params.compression_level > MAX_COMPRESSION_LEVEL) {
+    error_log("Invalid compression level: %d.", params.compression_level);
+    exit(1);
+  }
+  if (params.adaptive_compression
+      && (params.min_compression_level > params.max_compression_level
+          || params.max_compression_level > MAX_COMPRESSION_LEVEL)) {
+    error_log("Invalid adaptive compression level range: %d to %d.",
+              params.min_compression_level, params.max_compression_level);
+    exit(1);
+  }
+
   g_shared.server_url = "http://127.0.0.1:4000";
 
 
@@ -221,7 +274,7 @@ int main (int argc, char *argv[]) {
   }
   g_shared.bit_depth = params.bit_depth;
 
-  
+
 
   switch (params.num_channels) {
     case (1):
@@ -255,6 +308,25 @@ int main (int argc, char *argv[]) {
   g_shared.num_channels = params.num_channels;
 
 
+  /* Each stream requantizes to its bit depth as the last step of its stage,
+  after any downmix or resampling, with the dither it asks for. Capture keeps
+  24 bits whenever a stream dithers, since dithering only matters below the
+  resolution of the float samples. */
+  g_shared.capture_bit_depth = params.bit_depth;
+  for (size_t i = 0; i < MAX_NUM_STREAMS && params.bit_depth < 24; ++i) {
+    if (params.stream_dither[i] != DITHER_NONE) {
+      g_shared.capture_bit_depth = 24;
+      g_shared.out_sample_max = MAX_MAGNITUDE_24;
+    }
+  }
+
+  /* Planar capture converts each channel on its own. */
+  const char *isa_name;
+  g_shared.convert = convert_select(params.planar ? 1 : params.num_channels,
+                                    g_shared.capture_bit_depth, &isa_name);
+  debug_log("Using %s sample conversion.", isa_name);
+
+
 
 
   /* Generate a unique UUID for this running instance. */
@@ -286,7 +358,7 @@ int main (int argc, char *argv[]) {
 
 
   
-  /* Initialize JACK callbacks, open ports, and activate the client. */
+  /* Initialize JACK callbacks and open ports. */
   jack_set_process_callback(g_shared.jack, process_audio, NULL);
   jack_on_shutdown(g_shared.jack, jack_shutdown, NULL);
 
@@ -302,56 +374,146 @@ int main (int argc, char *argv[]) {
     }
   }
 
-  if (jack_activate(g_shared.jack)) {
-    error_log("Cannot activate JACK client.");
-    jack_client_close(g_shared.jack);
-    exit(1);
+  g_shared.sample_rate = (unsigned) jack_get_sample_rate(g_shared.jack);
+
+
+
+
+  /* The native engine has a single fixed predictor mode and is cheap enough
+  to run on one thread. */
+  g_shared.engine = params.engine;
+  if (g_shared.engine == ENGINE_NATIVE) {
+    if (params.adaptive_compression || params.num_encode_threads > 1) {
+      info_log("Adaptive compression and parallel encoding are disabled for the native encoder.");
+    }
+    params.adaptive_compression = false;
+    params.num_encode_threads = 1;
+  }
+
+  /* Segments encoded in parallel are spliced at frame boundaries, which needs
+  every pool thread to run at the same level. */
+  g_shared.num_encode_threads = params.num_encode_threads;
+  if (g_shared.num_encode_threads > MAX_ENCODE_THREADS) {
+    g_shared.num_encode_threads = MAX_ENCODE_THREADS;
+  }
+  if (g_shared.num_encode_threads > 1 && params.adaptive_compression) {
+    info_log("Adaptive compression is disabled when encoding in parallel.");
+    params.adaptive_compression = false;
   }
 
+  /* In low-latency mode every JACK period is published as its own block and
+  each FLAC frame spans a fixed number of periods. libFLAC only emits a frame
+  once the first sample of the next one arrives, so a frame reaches the wire
+  one period after it is complete. The native encoder has no lookahead. */
+  if (params.low_latency) {
+    size_t jack_period = (size_t) jack_get_buffer_size(g_shared.jack);
 
-  g_shared.sample_rate = (size_t) jack_get_sample_rate(g_shared.jack);
+    g_shared.num_samples_threshold = jack_period;
+    g_shared.flac_blocksize = (unsigned) (jack_period * params.low_latency_periods);
 
-  info_log("JACK client activated with sample rate %d.", g_shared.sample_rate);
+    if (g_shared.flac_blocksize < FLAC_MIN_BLOCKSIZE
+        || g_shared.flac_blocksize > FLAC_MAX_BLOCKSIZE) {
+      error_log("Invalid FLAC blocksize for low-latency mode: %u.", g_shared.flac_blocksize);
+      jack_client_close(g_shared.jack);
+      exit(1);
+    }
 
+    info_log("Low-latency mode: FLAC blocksize %u, algorithmic latency %.1f ms.",
+             g_shared.flac_blocksize,
+             1000.0 * (g_shared.flac_blocksize
+                       + (g_shared.engine == ENGINE_NATIVE ? 0 : jack_period))
+             / g_shared.sample_rate);
+  }
+  else {
+    g_shared.num_samples_threshold = (size_t) ceil((g_shared.sample_rate / 1000.0)
+                                                   * params.encoder_buffer_ms);
+    g_shared.flac_blocksize = params.adaptive_compression ? ADAPT_BLOCKSIZE : 0;
+  }
 
+  /* Adaptive encoders keep the blocksize fixed across level changes. */
+  g_shared.adaptive_compression = params.adaptive_compression;
+  g_shared.min_compression_level = params.min_compression_level;
+  g_shared.max_compression_level = params.max_compression_level;
+
+  /* Adaptive encoders start from the configured level moved into their range. */
+  if (g_shared.adaptive_compression
+      && (g_shared.compression_level < g_shared.min_compression_level
+          || g_shared.compression_level > g_shared.max_compression_level)) {
+    g_shared.compression_level = g_shared.compression_level < g_shared.min_compression_level
+                                 ? g_shared.min_compression_level
+                                 : g_shared.max_compression_level;
+    info_log("Compression level %d is outside the adaptive range, starting at %d.",
+             params.compression_level, g_shared.compression_level);
+  }
+  g_shared.adapt_hold_blocks = (size_t) ceil((g_shared.sample_rate / 1000.0) * ADAPT_HOLD_MS
+                                             / g_shared.num_samples_threshold);
 
+  g_shared.max_block_lag = (size_t) ceil((g_shared.sample_rate / 1000.0) * MAX_ENCODER_LAG_MS
+                                         / g_shared.num_samples_threshold);
+  if (g_shared.max_block_lag < 1) g_shared.max_block_lag = 1;
 
-  /* Allocate memory for media buffers. */
-  g_shared.num_samples_threshold = (size_t) ceil((g_shared.sample_rate / 1000.0)
-                                                 * params.encoder_buffer_ms);
+  g_shared.idle_blocks = (size_t) ceil((g_shared.sample_rate / 1000.0) * params.idle_ms
+                                       / g_shared.num_samples_threshold);
 
+
+  /* Allocate memory for media buffers. */
   g_shared.encoder_buffer_len_threshold = g_shared.num_samples_threshold
                                           * g_shared.num_channels;
 
-  g_shared.buffer_len_max = 4 * g_shared.encoder_buffer_len_threshold;
-  g_shared.num_buffer_bytes = sizeof(int32_t) * g_shared.buffer_len_max;
+  g_shared.num_preroll_samples = (size_t) ceil((g_shared.sample_rate / 1000.0)
+                                               * params.preroll_ms);
 
+  g_shared.max_lag_samples = (size_t) ceil((g_shared.sample_rate / 1000.0)
+                                           * params.max_lag_ms);
+  g_shared.lag_policy = params.lag_policy;
 
-  debug_log("Buffer size: %d bytes.", g_shared.num_buffer_bytes);
+  g_shared.planar = params.planar;
+  g_shared.num_capture_rings = g_shared.planar ? g_shared.num_channels : 1;
+
+  /* Hold at least four blocks, and enough periods to ride out scheduling
+  delays of the capture thread when blocks are short. */
+  size_t ring_len = (size_t) ceil((g_shared.sample_rate / 1000.0) * MIN_CAPTURE_RING_MS)
+                    * g_shared.num_channels;
+  if (ring_len < 4 * g_shared.encoder_buffer_len_threshold) {
+    ring_len = 4 * g_shared.encoder_buffer_len_threshold;
+  }
+
+  for (size_t i=0; i < g_shared.num_capture_rings; ++i) {
+    if (!ring_init(&(g_shared.capture_rings[i]), ring_len / g_shared.num_capture_rings,
+                   &(params.audio_mem))) {
+
+      error_log("Cannot map capture ring memory: %s", strerror(errno));
 
+      for (size_t j=0; j <= i; ++j) {
+        ring_free(&(g_shared.capture_rings[j]));
+      }
+      jack_client_close(g_shared.jack);
 
-  g_shared.processor_buffer = (int32_t*) malloc(g_shared.num_buffer_bytes);
-  g_shared.processor_buffer_len = 0;
-  g_shared.encoder_buffer = (int32_t*) malloc(g_shared.num_buffer_bytes);
-  g_shared.encoder_buffer_len = 0;
-  g_shared.encoder_buffer_start_ind = 0;
+      exit(1);
+    }
+  }
 
+  /* The rings round their capacity up to whole pages. */
+  g_shared.buffer_len_max = g_shared.capture_rings[0].capacity;
+  g_shared.num_buffer_bytes = sizeof(int32_t) * g_shared.buffer_len_max
+                              * g_shared.num_capture_rings;
 
-  if (g_shared.processor_buffer == NULL || g_shared.encoder_buffer == NULL) {
+  debug_log("Buffer size: %d bytes.", g_shared.num_buffer_bytes);
 
-    error_log("Cannot allocate buffer memory.");
 
-    if (g_shared.processor_buffer != NULL) free(g_shared.processor_buffer);
-    if (g_shared.encoder_buffer != NULL) free(g_shared.encoder_buffer);
-    jack_client_close(g_shared.jack);
 
+
+  /* Activate the client only once the capture ring can accept samples. */
+  if (jack_activate(g_shared.jack)) {
+    error_log("Cannot activate JACK client.");
+    jack_client_close(g_shared.jack);
     exit(1);
   }
 
-  
+  info_log("JACK client activated with sample rate %u.", g_shared.sample_rate);
+
 
 
-  
 
   /* Start DLNA server. */
   g_shared.http_sockfd = http_bind_and_listen(params.listen_hostname_buffer,
@@ -367,27 +529,139 @@ int main (int argc, char *argv[]) {
 
 
   /* Create and join threads to run until canceled by user. */
-  pthread_mutex_init(&(g_shared.encoder_lock), NULL);
+  block_chain_init(&(g_shared.blocks));
+  pthread_mutex_init(&(g_shared.encoders_lock), NULL);
+  g_shared.num_encoders = 0;
+
+  /* The first media URL streams at the JACK rate, followed by one URL for each
+  distinct supported rate to resample to. */
+  profile.compression_level = g_shared.compression_level;
+  profile.bit_depth = g_shared.bit_depth;
+  profile.num_channels = g_shared.num_channels;
+  profile.sample_rate = g_shared.sample_rate;
+  profile.layout = 0;
+  profile.format = FORMAT_FLAC;
+  profile.dither = DITHER_NONE;
+
+  g_shared.streams[0] = profile;
+  g_shared.num_streams = 1;
+
+  for (size_t i = 0; i < MAX_RESAMPLE_RATES && params.resample_rates[i] != 0; ++i) {
+    bool duplicate = false;
+
+    for (size_t j = 0; j < g_shared.num_streams; ++j) {
+      duplicate |= g_shared.streams[j].sample_rate == params.resample_rates[i];
+    }
+
+    if (duplicate || g_shared.num_streams == MAX_NUM_STREAMS) {
+      continue;
+    }
+
+    if (!resampler_supports(g_shared.sample_rate, params.resample_rates[i])) {
+      error_log("Cannot resample %u Hz to %u Hz, skipping the stream.",
+                g_shared.sample_rate, params.resample_rates[i]);
+      continue;
+    }
+
+    g_shared.streams[g_shared.num_streams] = profile;
+    g_shared.streams[g_shared.num_streams].sample_rate = params.resample_rates[i];
+    ++g_shared.num_streams;
+  }
 
+  /* Each downmix is offered at the JACK rate on a URL of its own. */
+  g_shared.num_downmixes = 0;
+
+  for (size_t i = 0; i < MAX_NUM_DOWNMIXES && params.downmixes[i].preset != DOWNMIX_NONE; ++i) {
+    struct fj_downmix_t *downmix = &(g_shared.downmixes[g_shared.num_downmixes]);
+
+    if (g_shared.num_streams == MAX_NUM_STREAMS) {
+      break;
+    }
+
+    if (!downmix_init(downmix, &(params.downmixes[i]), g_shared.channel_names,
+                      g_shared.num_channels, g_shared.out_sample_max)) {
+      error_log("Cannot build the %s downmix from %d channels, skipping the stream.",
+                downmix_name(params.downmixes[i].preset), g_shared.num_channels);
+      continue;
+    }
+
+    ++g_shared.num_downmixes;
+    g_shared.streams[g_shared.num_streams] = profile;
+    g_shared.streams[g_shared.num_streams].num_channels = (unsigned char) downmix->num_out_channels;
+    g_shared.streams[g_shared.num_streams].layout = (unsigned char) g_shared.num_downmixes;
+    ++g_shared.num_streams;
+  }
+
+  /* Raw streams skip encoding altogether, for renderers with bandwidth to
+  spare. */
+  if (params.lpcm_stream && g_shared.num_streams < MAX_NUM_STREAMS) {
+    g_shared.streams[g_shared.num_streams] = profile;
+    g_shared.streams[g_shared.num_streams++].format = FORMAT_LPCM;
+  }
+  if (params.wav_stream && g_shared.num_streams < MAX_NUM_STREAMS) {
+    g_shared.streams[g_shared.num_streams] = profile;
+    g_shared.streams[g_shared.num_streams++].format = FORMAT_WAV;
+  }
+
+  /* Ogg FLAC shares the FLAC settings and batches frames into pages. */
+  g_shared.ogg_frames_per_page = params.ogg_frames_per_page > 0 ? params.ogg_frames_per_page : 1;
+
+  if (params.ogg_stream && g_shared.num_streams < MAX_NUM_STREAMS) {
+    g_shared.streams[g_shared.num_streams] = profile;
+    g_shared.streams[g_shared.num_streams++].format = FORMAT_OGG_FLAC;
+  }
+
+  /* Dither is chosen per media URL, and only applies to streams narrower than
+  the capture. */
+  for (size_t i = 0; i < g_shared.num_streams; ++i) {
+    if (g_shared.streams[i].bit_depth < g_shared.capture_bit_depth) {
+      g_shared.streams[i].dither = params.stream_dither[i];
+    }
+  }
+
+  /* Keep the server's own profile encoding from the start, so new clients
+  receive the stream header and preroll frames as soon as they connect.
+  Resampled and downmixed streams are only encoded while they have listeners. */
+  if (!encoder_keep_warm(&(g_shared.streams[0]))) {
+    error_log("Cannot create FLAC encoder.");
+    jack_client_close(g_shared.jack);
+    exit(1);
+  }
+
+  if (!create_media_workers()) {
+    error_log("Cannot start media workers.");
+    jack_client_close(g_shared.jack);
+    exit(1);
+  }
+
+  pthread_create(&(g_shared.capture_thread_id), NULL, run_capture_thread, NULL);
   pthread_create(&(g_shared.http_thread_id), NULL, run_http_thread, NULL);
   pthread_create(&(g_shared.sddp_thread_id), NULL, run_sddp_thread, NULL);
 
   pthread_join(g_shared.sddp_thread_id, NULL);
   pthread_join(g_shared.http_thread_id, NULL);
+  pthread_join(g_shared.capture_thread_id, NULL);
 
 
 
 
   /* Clean up. */
-  pthread_mutex_destroy(&(g_shared.encoder_lock));
+  destroy_media_workers();
+  destroy_encoders();
+
+  pthread_mutex_destroy(&(g_shared.encoders_lock));
+  block_chain_destroy(&(g_shared.blocks));
 
   close(g_shared.http_sockfd);
   close(g_shared.sddp_sockfd);
+  close(g_shared.capture_event);
+  close(g_shared.exit_event);
 
   jack_client_close(g_shared.jack);
 
-  free(g_shared.processor_buffer);
-  free(g_shared.encoder_buffer);
+  for (size_t i=0; i < g_shared.num_capture_rings; ++i) {
+    ring_free(&(g_shared.capture_rings[i]));
+  }
 
   sigemptyset(&sigact.sa_mask);
 
@@ -41,25 +41,42 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 
 #include "flacjacket-config.h"
+#include "cache_line.h"
+#include "convert.h"
+#include "downmix.h"
+#include "encoder.h"
+#include "media.h"
+#include "ring_buffer.h"
+#include "sample_block.h"
 
 
 
+/* Server state shared by every thread. Fields are grouped by who writes
+them: configuration written once in main() and read-mostly afterwards, the
+state the JACK thread writes every period, and the registries written by the
+consumer threads. Only the per-period state is kept on its own cache lines;
+the registries change once per block or per connection. */
 struct shared_vars_t {
+
+  /* Configuration, written before the threads start. */
   pthread_t http_thread_id;
   pthread_t sddp_thread_id;
+  pthread_t capture_thread_id;
 
-  pthread_mutex_t encoder_lock;
+  int exit_event;       /* Signaled once when the server should exit. */
+  int capture_event;    /* Signaled by the JACK callback after each period. */
 
+  size_t num_capture_rings;
+  bool planar;
 
-  int32_t *processor_buffer;     /* Holds raw data until encoder buffer is ready. */
-  size_t processor_buffer_len;
-  
-  int32_t *encoder_buffer;      /* Holds raw data for the FLAC encoder. */
-  size_t encoder_buffer_len;
-  uint64_t encoder_buffer_start_ind;
-  size_t encoder_buffer_len_threshold;
+  size_t encoder_buffer_len_threshold;  /* Number of samples in each block. */
 
   size_t num_samples_threshold;
+  unsigned flac_blocksize;      /* Zero to use the blocksize of the compression level. */
+  size_t max_block_lag;         /* Blocks an encoder may fall behind before skipping ahead. */
+  size_t num_preroll_samples;   /* Samples per channel replayed to new clients. */
+  size_t max_lag_samples;       /* Lag behind the live edge before the lag policy fires. */
+  enum fj_lag_policy_t lag_policy;
 
   size_t buffer_len_max;
   size_t num_buffer_bytes;
@@ -71,13 +88,35 @@ struct shared_vars_t {
   unsigned long min_allowed_ip;
   unsigned long max_allowed_ip;
 
-  unsigned short sample_rate;
+  unsigned sample_rate;
   unsigned char bit_depth;
-  double out_sample_max;
+  unsigned char capture_bit_depth;   /* Wider than bit_depth when a stream dithers. */
+  float out_sample_max;         /* Full scale of the captured samples. */
+  fj_convert_func_t convert;   /* Kernel chosen for the running CPU. */
   unsigned char num_channels;
   unsigned char compression_level;
+  bool adaptive_compression;    /* Let encoders step the level to fit the CPU budget. */
+  unsigned char min_compression_level;
+  unsigned char max_compression_level;
+  size_t adapt_hold_blocks;     /* Blocks to encode between level changes. */
+  size_t num_encode_threads;    /* Pool threads per encoder, or one to encode serially. */
+  enum fj_engine_t engine;
+  size_t idle_blocks;           /* Silent blocks before encoders go idle, zero to never. */
+  size_t ogg_frames_per_page;   /* FLAC frames batched into each Ogg page. */
+
+  struct fj_downmix_t downmixes[MAX_NUM_DOWNMIXES];   /* Layouts offered besides the JACK one. */
+  size_t num_downmixes;
+  struct fj_profile_t streams[MAX_NUM_STREAMS];  /* Output profile of each media URL. */
+  size_t num_streams;
+
+  size_t max_num_connections;   /* Pending control connections. */
 
-  size_t max_num_connections;
+  struct fj_media_worker_t *media_workers;
+  size_t num_media_workers;
+
+  struct fj_session_t *sessions;
+  size_t *session_free_list;
+  size_t max_num_sessions;      /* Concurrent media streams. */
 
   const char *uuid;
   const char *name;
@@ -89,6 +128,28 @@ struct shared_vars_t {
   jack_client_t *jack;
   jack_port_t *ports[8];   /* One JACK port for each possible audio channel. */
 
+
+  /* Written by the JACK thread, read by the capture thread. With the planar
+  layout each channel has its own ring, otherwise a single ring holds
+  interleaved frames. Each ring keeps its producer and consumer indices on
+  separate cache lines. */
+  struct fj_ring_t capture_rings[8];
+
+
+  /* Sample blocks shared by all encoders, written by the capture thread. */
+  struct fj_block_chain_t blocks;
+
+
+  /* Encoder registry, written when sessions subscribe. */
+  pthread_mutex_t encoders_lock;
+  struct fj_encoder_t *encoders[MAX_NUM_ENCODERS];  /* One per output profile. */
+  size_t num_encoders;
+
+
+  /* Session slots, written by the HTTP thread and the media workers. */
+  pthread_mutex_t sessions_lock;
+  size_t num_free_sessions;
+
 };
 
 
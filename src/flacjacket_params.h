@@ -24,17 +24,51 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define PARAM_STR_BUFFER_SIZE 256
 
 
+#include <stdbool.h>
+
+#include "audio_memory.h"
+#include "dither.h"
+#include "downmix.h"
+#include "media.h"
+
+
 
 struct fj_params_t {
 
   size_t max_num_connections;
+  size_t max_num_sessions;
+  size_t num_media_workers;
   unsigned char bit_depth;
   unsigned char num_channels;
 
   size_t encoder_buffer_ms;
+  bool low_latency;             /* Encode every JACK period instead of every encoder_buffer_ms. */
+  size_t low_latency_periods;   /* JACK periods in each FLAC frame in low-latency mode. */
+  bool planar;
+  struct fj_audio_mem_t audio_mem;
+  size_t preroll_ms;
+
+  size_t max_lag_ms;
+  enum fj_lag_policy_t lag_policy;
 
   unsigned short port;
   unsigned char compression_level;
+  bool adaptive_compression;
+  unsigned char min_compression_level;
+  unsigned char max_compression_level;
+  size_t num_encode_threads;    /* Threads encoding each stream, one to encode serially.
+                                   Frames wait for a segment of at least two frames, and
+                                   at least one encoder buffer, which adds about 170 ms
+                                   at the 4096 blocksize and 48 kHz. */
+  enum fj_engine_t engine;
+  size_t idle_ms;               /* Silence before encoders go idle, zero to never. */
+  unsigned resample_rates[MAX_RESAMPLE_RATES];  /* Extra stream rates, zero terminated. */
+  struct fj_downmix_config_t downmixes[MAX_NUM_DOWNMIXES];  /* Ended by DOWNMIX_NONE. */
+  bool lpcm_stream;             /* Also serve the JACK channels as raw audio/L16. */
+  bool wav_stream;              /* Also serve the JACK channels as raw audio/wav. */
+  bool ogg_stream;              /* Also serve the JACK channels as Ogg FLAC. */
+  size_t ogg_frames_per_page;   /* More frames per page save overhead but add latency. */
+  enum fj_dither_mode_t stream_dither[MAX_NUM_STREAMS];  /* By media URL, below 24 bits. */
 
   char name_buffer[PARAM_STR_BUFFER_SIZE];
   char listen_hostname_buffer[PARAM_STR_BUFFER_SIZE];
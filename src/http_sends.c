@@ -36,20 +36,21 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "logging.h"
 #include "http_sends.h"
+#include "lpcm.h"
 
 
 
 
-void send_empty_response(const char *server_name, const int sockfd) {
+size_t format_empty_response(const char *server_name, char *send_buffer,
+                             const size_t buffer_size) {
 
   char time_str[32];
-  char send_buffer[512];
   size_t send_len;
   time_t cur_time = time(NULL);
 
   strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&cur_time));
 
-  send_len = snprintf(send_buffer, sizeof(send_buffer),
+  send_len = snprintf(send_buffer, buffer_size,
     "HTTP/1.1 200 OK\r\n"
     "Content-Type:text/plain; charset=\"utf-8\"\r\n"
     "Connection:close\r\n"
@@ -59,23 +60,21 @@ void send_empty_response(const char *server_name, const int sockfd) {
     server_name,
     time_str);
 
-
-  send(sockfd, send_buffer, send_len, 0);
-
+  return send_len < buffer_size ? send_len : buffer_size - 1;
 }
 
 
 
-void send_error_response(const char *server_name, const int sockfd) {
+size_t format_error_response(const char *server_name, char *send_buffer,
+                             const size_t buffer_size) {
 
   char time_str[32];
-  char send_buffer[512];
   size_t send_len;
   time_t cur_time = time(NULL);
 
   strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&cur_time));
 
-  send_len = snprintf(send_buffer, sizeof(send_buffer),
+  send_len = snprintf(send_buffer, buffer_size,
     "HTTP/1.1 500 Internal Server Error\r\n"
     "Content-Type:text/plain; charset=\"utf-8\"\r\n"
     "Connection:close\r\n"
@@ -85,20 +84,18 @@ void send_error_response(const char *server_name, const int sockfd) {
     server_name,
     time_str);
 
-
-  send(sockfd, send_buffer, send_len, 0);
-
+  return send_len < buffer_size ? send_len : buffer_size - 1;
 }
 
 
 
 
 
-void send_root_xml_response(const char *uuid, const char *friendly_name,
-                            const char *server_name, const int sockfd) {
+size_t format_root_xml_response(const char *uuid, const char *friendly_name,
+                                const char *server_name, char *send_buffer,
+                                const size_t buffer_size) {
 
   char time_str[32];
-  char send_buffer[4096];
   char xml_buffer[2048];
   size_t send_len, content_len;
   time_t cur_time = time(NULL);
@@ -128,7 +125,7 @@ void send_root_xml_response(const char *uuid, const char *friendly_name,
     uuid);
 
 
-  send_len = snprintf(send_buffer, sizeof(send_buffer),
+  send_len = snprintf(send_buffer, buffer_size,
     "HTTP/1.1 200 OK\r\n"
     "Content-Type:text/xml; charset=\"utf-8\"\r\n"
     "Connection:close\r\n"
@@ -142,19 +139,17 @@ void send_root_xml_response(const char *uuid, const char *friendly_name,
     content_len,
     xml_buffer);
 
-
-  send(sockfd, send_buffer, send_len, 0);
-
+  return send_len < buffer_size ? send_len : buffer_size - 1;
 }
 
 
 
 
 
-void send_content_dir_xml_response(const char *server_name, const int sockfd) {
+size_t format_content_dir_xml_response(const char *server_name, char *send_buffer,
+                                       const size_t buffer_size) {
 
   char time_str[32];
-  char send_buffer[8192];
   size_t send_len;
   time_t cur_time = time(NULL);
 
@@ -394,7 +389,7 @@ void send_content_dir_xml_response(const char *server_name, const int sockfd) {
       "</scpd>\n";
 
 
-  send_len = snprintf(send_buffer, sizeof(send_buffer),
+  send_len = snprintf(send_buffer, buffer_size,
     "HTTP/1.1 200 OK\r\n"
     "Content-Type:text/xml; charset=\"utf-8\"\r\n"
     "Connection:close\r\n"
@@ -407,28 +402,102 @@ void send_content_dir_xml_response(const char *server_name, const int sockfd) {
     strlen(xml_string),
     xml_string);
 
+  return send_len < buffer_size ? send_len : buffer_size - 1;
+}
+
+
+
+
 
-  send(sockfd, send_buffer, send_len, 0);
+/* Writes the MIME type and DLNA fourth field of a raw format stream, whose
+content type carries the sample layout. Only 16-bit L16 at 44.1 or 48 kHz
+with up to two channels matches the DLNA LPCM profile. */
+static void format_pcm_type(const struct fj_profile_t *profile, char *mime_buffer,
+                            const size_t mime_size, char *features_buffer,
+                            const size_t features_size) {
 
+  const bool dlna_lpcm = profile->format == FORMAT_LPCM && profile->bit_depth == 16
+                         && profile->num_channels <= 2
+                         && (profile->sample_rate == 44100 || profile->sample_rate == 48000);
+
+  if (profile->format == FORMAT_WAV) {
+    snprintf(mime_buffer, mime_size, "audio/wav");
+  }
+  else {
+    snprintf(mime_buffer, mime_size, "audio/L%zu;rate=%u;channels=%u",
+             8 * lpcm_sample_bytes(profile->bit_depth), profile->sample_rate,
+             profile->num_channels);
+  }
+
+  snprintf(features_buffer, features_size,
+           "%sDLNA.ORG_OP=00;DLNA.ORG_CI=0;DLNA.ORG_FLAGS=01700000000000000000000000000000",
+           dlna_lpcm ? "DLNA.ORG_PN=LPCM;" : "");
+}
+
+
+
+
+const char * stream_extension(const enum fj_format_t format) {
+
+  switch (format) {
+    case (FORMAT_LPCM):
+      return ".pcm";
+    case (FORMAT_WAV):
+      return ".wav";
+    case (FORMAT_OGG_FLAC):
+      return ".ogg";
+    default:
+      return ".flac";
+  }
 }
 
 
 
 
 
-void send_content_response(const char *friendly_name, const char *server_name,
-                           const char *server_url, const size_t sample_rate,
-                           const size_t bit_depth, const int sockfd) {
+size_t format_content_response(const char *friendly_name, const char *server_name,
+                               const char *server_url,
+                               const struct fj_profile_t *streams,
+                               const size_t num_streams, char *send_buffer,
+                               const size_t buffer_size) {
 
   char time_str[32];
-  char send_buffer[4096];
-  char xml_buffer[2048];
-  size_t send_len, content_len;
+  char res_buffer[4096];
+  char xml_buffer[6144];
+  size_t send_len, content_len, res_len = 0;
   time_t cur_time = time(NULL);
 
   strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&cur_time));
 
 
+  /* Each stream is an alternative resource of the same broadcast item. */
+  res_buffer[0] = '\0';
+  for (size_t i = 0; i < num_streams && res_len < sizeof(res_buffer); ++i) {
+    char mime[64] = "audio/x-flac", features[128] = "*";
+
+    if (streams[i].format == FORMAT_OGG_FLAC) {
+      snprintf(mime, sizeof(mime), "audio/ogg");
+    }
+    else if (streams[i].format != FORMAT_FLAC) {
+      format_pcm_type(&(streams[i]), mime, sizeof(mime), features, sizeof(features));
+    }
+
+    res_len += snprintf(&res_buffer[res_len], sizeof(res_buffer) - res_len,
+      "&lt;res protocolInfo=&quot;http-get:*:%s:%s&quot; "
+      " sampleFrequency=&quot;%u&quot; bitsPerSample=&quot;%u&quot; "
+      " nrAudioChannels=&quot;%u&quot; &gt;"
+      "%s/media/%zu%s&lt;/res&gt;",
+      mime,
+      features,
+      streams[i].sample_rate,
+      streams[i].bit_depth,
+      streams[i].num_channels,
+      server_url,
+      i,
+      stream_extension(streams[i].format));
+  }
+
+
   content_len = snprintf(xml_buffer, sizeof(xml_buffer),
     "<?xml version=\"1.0\" encoding=\"utf-8\"?><s:Envelope "
     "xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
@@ -442,20 +511,20 @@ void send_content_response(const char *friendly_name, const char *server_name,
     "restricted=&quot;1&quot;&gt;&lt;dc:title&gt;%s"
     "&lt;/dc:title&gt;&lt;upnp:class&gt;object.item.audioItem.audioBroadcast&lt;/upnp:class&gt;"
     "&lt;upnp:channelNr&gt;1&lt;/upnp:channelNr&gt;&lt;upnp:channelName&gt;%s"
-    "&lt;/upnp:channelName&gt;&lt;res protocolInfo=&quot;http-get:*:audio/x-flac:*&quot; "
-    " sampleFrequency=&quot;%d&quot; bitsPerSample=&quot;%d&quot; &gt;"
-    "%s/media/0.flac&lt;/res&gt;&lt;/item&gt;&lt;/DIDL-Lite&gt;"
+    "&lt;/upnp:channelName&gt;%s&lt;/item&gt;&lt;/DIDL-Lite&gt;"
 
     "</Result><NumberReturned>1</NumberReturned><TotalMatches>1</TotalMatches>"
     "<UpdateID>0</UpdateID></u:BrowseResponse></s:Body></s:Envelope>\r\n",
     friendly_name,
     friendly_name,
-    sample_rate,
-    bit_depth,
-    server_url);
+    res_buffer);
+
+  if (content_len >= sizeof(xml_buffer)) {
+    content_len = sizeof(xml_buffer) - 1;
+  }
 
 
-  send_len = snprintf(send_buffer, sizeof(send_buffer),
+  send_len = snprintf(send_buffer, buffer_size,
     "HTTP/1.1 200 OK\r\n"
     "Content-Type:text/xml; charset=\"utf-8\"\r\n"
     "Connection:close\r\n"
@@ -469,10 +538,7 @@ void send_content_response(const char *friendly_name, const char *server_name,
     content_len,
     xml_buffer);
 
-
-  send(sockfd, send_buffer, send_len, 0);
-
-
+  return send_len < buffer_size ? send_len : buffer_size - 1;
 }
 
 
@@ -480,61 +546,67 @@ void send_content_response(const char *friendly_name, const char *server_name,
 
 
 
-void send_chunked_stream_response(const char *server_name, const int sockfd) {
+size_t format_chunked_stream_response(const char *server_name,
+                                      const struct fj_profile_t *profile,
+                                      char *send_buffer, const size_t buffer_size) {
 
   char time_str[32];
-  char send_buffer[2048];
+  char mime[64], features[128];
   size_t send_len;
   time_t cur_time = time(NULL);
 
   strftime(time_str, sizeof(time_str), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&cur_time));
 
-  send_len = snprintf(send_buffer, sizeof(send_buffer),
-    "HTTP/1.1 200 OK\r\n"
-    "Content-Type: audio/flac"
-    "Connection: keep-alive\r\n"
-    "Keep-Alive: timeout=30\r\n"
-    "Transfer-Encoding: chunked\r\n"
-    "Server: %s\r\n"
-    "Date: %s\r\n\r\n",
-    server_name,
-    time_str);
-
-
-  send(sockfd, send_buffer, send_len, 0);
-
+  if (profile->format == FORMAT_FLAC || profile->format == FORMAT_OGG_FLAC) {
+    send_len = snprintf(send_buffer, buffer_size,
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: %s\r\n"
+      "Connection: keep-alive\r\n"
+      "Keep-Alive: timeout=30\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Server: %s\r\n"
+      "Date: %s\r\n\r\n",
+      profile->format == FORMAT_OGG_FLAC ? "audio/ogg" : "audio/flac",
+      server_name,
+      time_str);
+  }
+
+  /* Renderers pick the sample layout of raw formats from the headers. */
+  else {
+    format_pcm_type(profile, mime, sizeof(mime), features, sizeof(features));
+
+    send_len = snprintf(send_buffer, buffer_size,
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: %s\r\n"
+      "Connection: keep-alive\r\n"
+      "Keep-Alive: timeout=30\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "transferMode.dlna.org: Streaming\r\n"
+      "contentFeatures.dlna.org: %s\r\n"
+      "Server: %s\r\n"
+      "Date: %s\r\n\r\n",
+      mime,
+      features,
+      server_name,
+      time_str);
+  }
+
+  return send_len < buffer_size ? send_len : buffer_size - 1;
 }
 
 
 
 
 
-FLAC__StreamEncoderWriteStatus send_flac_callback(const FLAC__StreamEncoder *encoder,
-                                                  const FLAC__byte *buffer,
-                                                  size_t bytes, unsigned samples,
-                                                  unsigned current_frame,
-                                                  void *client_data) {
-
-  int sockfd = *((int*)client_data);
-
-
-  
-
-
-  size_t len_len;
+size_t format_chunk_header(const size_t chunk_len, char *buffer,
+                           const size_t buffer_size) {
 
-  char len_str[32];
+  size_t len;
 
-  len_len = snprintf(len_str, sizeof(len_str), "%x", bytes);
+  len = snprintf(buffer, buffer_size, "%zx\r\n", chunk_len);
 
-  send(sockfd, len_str, len_len, 0);
-  send(sockfd, "\r\n", 2, 0);
-  send(sockfd, buffer, bytes, 0);
-  send(sockfd, "\r\n", 2, 0);
-
-  return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+  return len < buffer_size ? len : buffer_size - 1;
 }
 
 
 
-
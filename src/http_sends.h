@@ -21,44 +21,60 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define HTTP_SENDS_H
 
 
+#define CHUNK_HEADER_SIZE 24
+
+
+#include "encoder.h"
 #include "server.h"
 
 
-/* Sends an empty HTTP OK response to the specified socket. */
-void send_empty_response(const char *server_name, const int sockfd);
+/* Writes an empty HTTP OK response to the buffer and returns its length. */
+size_t format_empty_response(const char *server_name, char *send_buffer,
+                             const size_t buffer_size);
+
+/* Writes a 500 error response to the buffer and returns its length. */
+size_t format_error_response(const char *server_name, char *send_buffer,
+                             const size_t buffer_size);
+
 
-/* Sends a 500 error response to the specified socket. */
-void send_error_response(const char *server_name, const int sockfd);
+/* Writes the DLNA root XML response to the buffer providing a server
+description and content directory service, and returns its length. */
+size_t format_root_xml_response(const char *uuid, const char *friendly_name,
+                                const char *server_name, char *send_buffer,
+                                const size_t buffer_size);
 
 
-/* Sends the DLNA root XML response to the specified socket providing a
-server description and content directory service. */
-void send_root_xml_response(const char *uuid, const char *friendly_name,
-                            const char *server_name, const int sockfd);
+/* Writes the DLNA browse content XML response to the buffer providing one
+resource URL per media stream, and returns its length. */
+size_t format_content_response(const char *friendly_name, const char *server_name,
+                               const char *server_url,
+                               const struct fj_profile_t *streams,
+                               const size_t num_streams, char *send_buffer,
+                               const size_t buffer_size);
 
 
-/* Sends the DLNA browse content XML response to the specified socket providing
-only a single URL to the flac media file. */
-void send_content_response(const char *friendly_name, const char *server_name,
-                           const char *server_url, const size_t sample_rate,
-                           const size_t bit_depth, const int sockfd);
+/* Writes the DLNA ContentDir XML response to the buffer and returns its
+length. */
+size_t format_content_dir_xml_response(const char *server_name, char *send_buffer,
+                                       const size_t buffer_size);
 
 
-/* Sends the DLNA ContentDir XML response to the specified socket. */
-void send_content_dir_xml_response(const char *server_name, const int sockfd);
+/* Writes response headers to initiate a stream of the profile's format with
+chunked transfer encoding to the buffer and returns their length. */
+size_t format_chunked_stream_response(const char *server_name,
+                                      const struct fj_profile_t *profile,
+                                      char *send_buffer, const size_t buffer_size);
 
 
-/* Sends response headers to initiate a stream with chunked transfer encoding. */
-void send_chunked_stream_response(const char *server_name, const int sockfd);
+/* Returns the file extension of media URLs in the format, including the dot. */
+const char * stream_extension(const enum fj_format_t format);
 
 
-/* Encoder callback to send a chunk of FLAC data to the socket specified as
-client data. */
-FLAC__StreamEncoderWriteStatus send_flac_callback(const FLAC__StreamEncoder *encoder,
-                                                  const FLAC__byte *buffer,
-                                                  size_t bytes, unsigned samples,
-                                                  unsigned current_frame,
-                                                  void *client_data);
+/* Writes the hexadecimal size line preceding a chunk of the specified length
+to the buffer and returns its length. The chunk data must be followed by
+CRLF. */
+size_t format_chunk_header(const size_t chunk_len, char *buffer,
+                           const size_t buffer_size);
 
 
 #endif /* HTTP_SENDS_H */
@@ -0,0 +1,164 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lpcm.h"
+
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+
+
+
+static inline uint8_t * put_le16(uint8_t *p, const uint16_t value) {
+  p[0] = value & 0xFF;
+  p[1] = value >> 8;
+  return p + 2;
+}
+
+
+static inline uint8_t * put_le32(uint8_t *p, const uint32_t value) {
+  p[0] = value & 0xFF;
+  p[1] = (value >> 8) & 0xFF;
+  p[2] = (value >> 16) & 0xFF;
+  p[3] = value >> 24;
+  return p + 4;
+}
+
+
+/* Speaker positions in the order of the JACK ports for each channel count,
+as bits of the WAVE_FORMAT_EXTENSIBLE channel mask. */
+static uint32_t channel_mask(const unsigned num_channels) {
+
+  static const uint32_t masks[] = {
+    0x000,
+    0x004,    /* Front center. */
+    0x003,    /* Front left and right. */
+    0x007,    /* Front left, right and center. */
+    0x033,    /* Front and back pairs. */
+    0x037,    /* Front three and back pair. */
+    0x03F,    /* 5.1 with back surrounds. */
+    0x70F,    /* 6.1 with back center and side surrounds. */
+    0x63F     /* 7.1 with back and side surrounds. */
+  };
+
+  return num_channels < sizeof(masks) / sizeof(masks[0]) ? masks[num_channels] : 0;
+}
+
+
+
+
+size_t lpcm_sample_bytes(const unsigned bit_depth) {
+  return bit_depth > 16 ? 3 : 2;
+}
+
+
+
+
+size_t lpcm_write_wav_header(const unsigned num_channels, const unsigned bit_depth,
+                             const unsigned sample_rate, uint8_t *buffer) {
+
+  const unsigned container_bits = 8 * lpcm_sample_bytes(bit_depth);
+  const unsigned block_align = num_channels * container_bits / 8;
+  const bool extensible = num_channels > 2 || container_bits > 16;
+  uint8_t *p = buffer;
+
+
+  memcpy(p, "RIFF", 4);
+  p = put_le32(p + 4, UINT32_MAX);
+  memcpy(p, "WAVEfmt ", 8);
+  p = put_le32(p + 8, extensible ? 40 : 16);
+
+  p = put_le16(p, extensible ? WAVE_FORMAT_EXTENSIBLE : WAVE_FORMAT_PCM);
+  p = put_le16(p, num_channels);
+  p = put_le32(p, sample_rate);
+  p = put_le32(p, sample_rate * block_align);
+  p = put_le16(p, block_align);
+  p = put_le16(p, container_bits);
+
+  /* The extension carries the significant bits, the speaker positions and
+  the PCM subformat GUID. */
+  if (extensible) {
+    static const uint8_t pcm_guid_tail[14] = {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80,
+                                              0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
+    p = put_le16(p, 22);
+    p = put_le16(p, bit_depth);
+    p = put_le32(p, channel_mask(num_channels));
+    p = put_le16(p, WAVE_FORMAT_PCM);
+    memcpy(p, pcm_guid_tail, sizeof(pcm_guid_tail));
+    p += sizeof(pcm_guid_tail);
+  }
+
+  memcpy(p, "data", 4);
+  p = put_le32(p + 4, UINT32_MAX);
+
+
+  return p - buffer;
+}
+
+
+
+
+size_t lpcm_pack(const int32_t *samples, const size_t num_frames,
+                 const unsigned num_channels, const bool planar, const unsigned bit_depth,
+                 const bool big_endian, uint8_t *out) {
+
+  const size_t sample_bytes = lpcm_sample_bytes(bit_depth);
+  const unsigned shift = 8 * sample_bytes - bit_depth;
+  const size_t channel_step = planar ? num_frames : 1;
+  const size_t frame_step = planar ? 1 : num_channels;
+  uint32_t value;
+  size_t f, c;
+
+
+  for (f=0; f < num_frames; ++f) {
+    for (c=0; c < num_channels; ++c) {
+      value = (uint32_t) samples[f * frame_step + c * channel_step] << shift;
+
+      if (sample_bytes == 2 && big_endian) {
+        out[0] = (value >> 8) & 0xFF;
+        out[1] = value & 0xFF;
+      }
+      else if (sample_bytes == 2) {
+        out[0] = value & 0xFF;
+        out[1] = (value >> 8) & 0xFF;
+      }
+      else if (big_endian) {
+        out[0] = (value >> 16) & 0xFF;
+        out[1] = (value >> 8) & 0xFF;
+        out[2] = value & 0xFF;
+      }
+      else {
+        out[0] = value & 0xFF;
+        out[1] = (value >> 8) & 0xFF;
+        out[2] = (value >> 16) & 0xFF;
+      }
+
+      out += sample_bytes;
+    }
+  }
+
+
+  return num_frames * num_channels * sample_bytes;
+}
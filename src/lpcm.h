@@ -0,0 +1,55 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef LPCM_H
+#define LPCM_H
+
+
+#define WAV_HEADER_LEN 44               /* RIFF, fmt with WAVE_FORMAT_PCM and data chunk headers. */
+#define WAV_EXTENSIBLE_HEADER_LEN 68    /* Same with WAVE_FORMAT_EXTENSIBLE. */
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/* Returns the bytes each sample is packed into, two for bit depths up to 16
+and three above. Narrower samples are padded with low zero bits. */
+size_t lpcm_sample_bytes(const unsigned bit_depth);
+
+
+/* Writes a WAV header for a stream of unknown length, with the RIFF and data
+sizes set to their maximum, and returns its length. The buffer must hold
+WAV_EXTENSIBLE_HEADER_LEN bytes. */
+size_t lpcm_write_wav_header(const unsigned num_channels, const unsigned bit_depth,
+                             const unsigned sample_rate, uint8_t *buffer);
+
+
+/* Packs frames of integer samples, interleaved or one run per channel when
+planar, into interleaved bytes, big-endian for audio/L16 and audio/L24 or
+little-endian for WAV, and returns the number of bytes written. */
+size_t lpcm_pack(const int32_t *samples, const size_t num_frames,
+                 const unsigned num_channels, const bool planar, const unsigned bit_depth,
+                 const bool big_endian, uint8_t *out);
+
+
+
+#endif /* LPCM_H */
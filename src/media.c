@@ -0,0 +1,665 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "flacjacket_globals.h"
+#include "encoder.h"
+#include "events.h"
+#include "http_sends.h"
+#include "logging.h"
+#include "media.h"
+#include "server.h"
+
+
+
+
+/* Returns the session slot to the free list. */
+static void release_session(struct fj_media_worker_t *worker, const size_t ind) {
+
+  pthread_mutex_lock(&(g_shared.sessions_lock));
+  g_shared.sessions[ind].active = false;
+  g_shared.sessions[ind].sockfd = -1;
+  ++g_shared.sessions[ind].generation;
+  g_shared.session_free_list[g_shared.num_free_sessions++] = ind;
+  --worker->num_assigned;
+  pthread_mutex_unlock(&(g_shared.sessions_lock));
+}
+
+
+
+
+static void end_session(struct fj_media_worker_t *worker, const size_t ind);
+
+
+
+
+/* Returns true if the session a socket event was registered for still owns
+its slot on this worker, and sets the slot index. A slot released earlier in
+the same batch of events may already belong to a new client. */
+static bool session_owned(struct fj_media_worker_t *worker, const uint64_t tag,
+                          size_t *ind) {
+
+  struct fj_session_t *session;
+  bool owned;
+
+  *ind = SESSION_TAG_IND(tag);
+  if (*ind >= g_shared.max_num_sessions) {
+    return false;
+  }
+  session = &(g_shared.sessions[*ind]);
+
+  pthread_mutex_lock(&(g_shared.sessions_lock));
+  owned = session->active && session->generation == SESSION_TAG_GENERATION(tag)
+          && session->worker_ind == (size_t) (worker - g_shared.media_workers);
+  pthread_mutex_unlock(&(g_shared.sessions_lock));
+
+  return owned;
+}
+
+
+
+
+/* Appends data to the output pending for the session, growing its buffer as
+needed. Returns false if the buffer cannot be grown. */
+static bool queue_output(struct fj_session_t *session, const void *data,
+                         const size_t len) {
+
+  FLAC__byte *buffer;
+  size_t capacity;
+
+  if (session->out_capacity < session->out_len + len) {
+    capacity = session->out_capacity > 0 ? session->out_capacity : SEND_BUFFER_SIZE;
+    while (capacity < session->out_len + len) capacity *= 2;
+
+    buffer = (FLAC__byte*) realloc(session->out_buffer, capacity);
+    if (buffer == NULL) return false;
+    session->out_buffer = buffer;
+    session->out_capacity = capacity;
+  }
+
+  memcpy(&(session->out_buffer[session->out_len]), data, len);
+  session->out_len += len;
+
+  return true;
+}
+
+
+
+
+/* Sets the events the worker waits for on the session socket: readability
+until the client shuts down its side, and writability while output is
+blocked. Returns false if the socket cannot be watched. */
+static bool watch_session(struct fj_media_worker_t *worker, const size_t ind, const int op) {
+
+  struct fj_session_t *session = &(g_shared.sessions[ind]);
+  struct epoll_event ev;
+
+  ev.events = (session->read_closed ? 0 : EPOLLIN | EPOLLRDHUP)
+              | (session->write_blocked ? EPOLLOUT : 0);
+  ev.data.u64 = SESSION_TAG(ind, session->generation);
+
+  if (epoll_ctl(worker->epollfd, op, session->sockfd, &ev) < 0) {
+    error_log("Cannot watch media session: %s", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+
+
+
+/* Writes as much pending output as the socket accepts in a single send per
+attempt. When the socket is full the session waits for EPOLLOUT, and stops
+waiting once the output is drained. Returns false if the connection failed. */
+static bool flush_session(struct fj_media_worker_t *worker, const size_t ind) {
+
+  struct fj_session_t *session = &(g_shared.sessions[ind]);
+  ssize_t num_sent;
+
+
+  while (session->out_pos < session->out_len) {
+
+    num_sent = send(session->sockfd, &(session->out_buffer[session->out_pos]),
+                    session->out_len - session->out_pos, MSG_NOSIGNAL);
+
+    if (num_sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+
+      if (!session->write_blocked) {
+        session->write_blocked = true;
+        return watch_session(worker, ind, EPOLL_CTL_MOD);
+      }
+      return true;
+    }
+
+    session->out_pos += num_sent;
+  }
+
+
+  session->out_len = 0;
+  session->out_pos = 0;
+
+  if (session->write_blocked) {
+    session->write_blocked = false;
+    return watch_session(worker, ind, EPOLL_CTL_MOD);
+  }
+
+  return true;
+}
+
+
+
+
+/* Sends the stream headers and subscribes a new session to the encoder for
+the profile of its stream. Closes the session if that fails. */
+static void start_session(struct fj_media_worker_t *worker, const size_t ind) {
+
+  struct fj_session_t *session = &(g_shared.sessions[ind]);
+  char response_buffer[512];
+  size_t response_len;
+  FLAC__byte header[MAX_HEADER_LEN];
+  size_t header_len;
+  bool ok;
+
+
+  int opt = 1;
+  setsockopt(session->sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+
+
+  session->encoder = encoder_subscribe(&(g_shared.streams[session->stream_ind]),
+                                       worker->frame_event);
+
+  if (session->encoder == NULL) {
+    error_log("Cannot create FLAC encoder.");
+    response_len = format_error_response(SERVER_NAME, response_buffer,
+                                         sizeof(response_buffer));
+    send(session->sockfd, response_buffer, response_len, MSG_NOSIGNAL);
+    close(session->sockfd);
+    release_session(worker, ind);
+    return;
+  }
+
+
+  session->out_len = 0;
+  session->out_pos = 0;
+  session->write_blocked = false;
+  session->read_closed = false;
+  session->num_resyncs = 0;
+  session->lagging = false;
+
+  worker->sessions[worker->num_sessions++] = ind;
+
+  if (!watch_session(worker, ind, EPOLL_CTL_ADD)) {
+    end_session(worker, ind);
+    return;
+  }
+
+
+  /* Replay the stream header as the first chunk, followed by the most recent
+  frames as preroll so playback can start without waiting for the encoder. */
+  response_len = format_chunked_stream_response(SERVER_NAME, &(session->encoder->profile),
+                                                response_buffer, sizeof(response_buffer));
+  ok = queue_output(session, response_buffer, response_len);
+
+  /* Headerless formats must not send an empty chunk, which would end the
+  response. */
+  header_len = encoder_copy_header(session->encoder, header, MAX_HEADER_LEN);
+  if (header_len > 0) {
+    response_len = format_chunk_header(header_len, response_buffer,
+                                       sizeof(response_buffer));
+    ok = ok && queue_output(session, response_buffer, response_len)
+            && queue_output(session, header, header_len)
+            && queue_output(session, "\r\n", 2);
+  }
+
+  session->frame_num = encoder_preroll_frame(session->encoder,
+                                             session->encoder->num_preroll_samples);
+  encoder_copy_frames(session->encoder, &(session->frame_num), &(session->out_buffer),
+                      &(session->out_capacity), &(session->out_len));
+
+  if (!ok || !flush_session(worker, ind)) {
+    end_session(worker, ind);
+    return;
+  }
+
+  debug_log("Media session started.");
+}
+
+
+
+
+/* Unsubscribes and closes the session and recycles its slot. */
+static void end_session(struct fj_media_worker_t *worker, const size_t ind) {
+
+  struct fj_session_t *session = &(g_shared.sessions[ind]);
+  size_t i;
+
+  epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, session->sockfd, NULL);
+  encoder_unsubscribe(session->encoder, worker->frame_event);
+  close(session->sockfd);
+
+  for (i=0; i < worker->num_sessions; ++i) {
+    if (worker->sessions[i] == ind) {
+      worker->sessions[i] = worker->sessions[--worker->num_sessions];
+      break;
+    }
+  }
+
+  debug_log("Media session ended after %zu lag resyncs.", session->num_resyncs);
+
+  release_session(worker, ind);
+}
+
+
+
+
+/* Empties the socket read buffer. Once the client shuts down its side the
+socket is no longer watched for reading, and the stream it requested keeps
+being sent until a send fails. Returns false if the connection was reset. */
+static bool drain_session(struct fj_media_worker_t *worker, const size_t ind) {
+
+  struct fj_session_t *session = &(g_shared.sessions[ind]);
+  char recv_buffer[RECV_SIZE];
+  ssize_t num_received;
+
+  while (1) {
+    num_received = recv(session->sockfd, recv_buffer, RECV_SIZE, 0);
+
+    if (num_received == 0) {
+      session->read_closed = true;
+      return watch_session(worker, ind, EPOLL_CTL_MOD);
+    }
+    if (num_received < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      if (errno == EINTR) continue;
+      return false;
+    }
+  }
+}
+
+
+
+
+bool media_check_lag(struct fj_media_worker_t *worker, struct fj_session_t *session) {
+
+  bool first;
+
+  if (encoder_lag_samples(session->encoder, session->frame_num)
+      <= session->encoder->max_lag_samples) {
+    if (!session->write_blocked) {
+      session->lagging = false;
+    }
+    return true;
+  }
+
+  /* Output already queued is always sent in full, so skipping frames never
+  breaks the chunk framing. */
+  first = !session->lagging;
+  session->lagging = true;
+  if (first) {
+    ++session->num_resyncs;
+  }
+
+  switch (g_shared.lag_policy) {
+
+    case (LAG_DROP_TO_LIVE):
+      session->frame_num = encoder_preroll_frame(session->encoder, 0);
+      if (first) {
+        ++worker->num_drops_to_live;
+        debug_log("Media session lagging, skipped to the live edge.");
+      }
+      return true;
+
+    case (LAG_DROP_OLDEST):
+      session->frame_num = encoder_lag_frame(session->encoder,
+                                             session->encoder->max_lag_samples);
+      if (first) {
+        ++worker->num_drops_oldest;
+        debug_log("Media session lagging, dropping its oldest frames.");
+      }
+      return true;
+
+    case (LAG_DISCONNECT):
+    default:
+      ++worker->num_lag_disconnects;
+      info_log("Disconnecting media session lagging more than %zu samples.",
+               session->encoder->max_lag_samples);
+      return false;
+  }
+}
+
+
+
+
+/* Queues every frame the session's encoder has published since the last
+wakeup and sends the batch. Frames are left in the encoder queue while earlier
+output is still waiting for the socket, until the lag policy fires. Returns
+false if the connection failed or was dropped for lagging. */
+static bool send_frames(struct fj_media_worker_t *worker, const size_t ind) {
+
+  struct fj_session_t *session = &(g_shared.sessions[ind]);
+
+  if (!media_check_lag(worker, session)) {
+    return false;
+  }
+
+  if (session->write_blocked) {
+    return true;
+  }
+
+  if (encoder_copy_frames(session->encoder, &(session->frame_num),
+                          &(session->out_buffer), &(session->out_capacity),
+                          &(session->out_len)) == 0) {
+    return true;
+  }
+
+  return flush_session(worker, ind);
+}
+
+
+
+
+
+
+void * run_media_worker_thread(void *args) {
+
+  struct fj_media_worker_t *worker = (struct fj_media_worker_t*) args;
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  size_t pending[MAX_EPOLL_EVENTS];
+  size_t num_pending, i, j, ind;
+  int num_events;
+  bool ok;
+
+
+  debug_log("Media worker started.");
+
+
+  while (!g_exited) {
+
+    num_events = epoll_wait(worker->epollfd, events, MAX_EPOLL_EVENTS, -1);
+
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      error_log(strerror(errno));
+      request_exit();
+      break;
+    }
+
+
+    for (i=0; i < (size_t) num_events; ++i) {
+
+      if (events[i].data.u64 == EXIT_TAG) {
+        continue;
+      }
+
+
+      /* Start sessions handed over by the HTTP thread. */
+      if (events[i].data.u64 == HANDOFF_TAG) {
+        event_clear(worker->handoff_event);
+
+        do {
+          pthread_mutex_lock(&(worker->lock));
+          num_pending = worker->num_pending < MAX_EPOLL_EVENTS
+                        ? worker->num_pending : MAX_EPOLL_EVENTS;
+          worker->num_pending -= num_pending;
+          memcpy(pending, &(worker->pending[worker->num_pending]),
+                 num_pending * sizeof(size_t));
+          pthread_mutex_unlock(&(worker->lock));
+
+          for (j=0; j < num_pending; ++j) {
+            start_session(worker, pending[j]);
+          }
+        } while (num_pending > 0);
+
+        continue;
+      }
+
+
+      /* Fan the newly published frames out to every session. */
+      if (events[i].data.u64 == FRAMES_TAG) {
+        event_clear(worker->frame_event);
+
+        /* Walk backwards since ending a session moves the last one into
+        its place. */
+        for (j=worker->num_sessions; j > 0; --j) {
+          ind = worker->sessions[j-1];
+          if (!send_frames(worker, ind)) {
+            end_session(worker, ind);
+          }
+        }
+
+        continue;
+      }
+
+
+      if (!session_owned(worker, events[i].data.u64, &ind)) {
+        continue;
+      }
+
+      ok = true;
+
+      /* A hang up or error leaves nothing to send to. */
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        ok = false;
+      }
+      else if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+        ok = drain_session(worker, ind);
+      }
+
+      /* Resume sending once the socket has room again. */
+      if (ok && (events[i].events & EPOLLOUT)) {
+        ok = flush_session(worker, ind) && send_frames(worker, ind);
+      }
+
+      if (!ok) {
+        end_session(worker, ind);
+      }
+    }
+  }
+
+
+  /* Close every session still owned by the worker. */
+  while (worker->num_sessions > 0) {
+    end_session(worker, worker->sessions[worker->num_sessions - 1]);
+  }
+
+
+  debug_log("Exiting media worker.");
+
+  return NULL;
+}
+
+
+
+
+
+
+bool media_start_session(const int sockfd, const size_t stream_ind) {
+
+  struct fj_media_worker_t *worker;
+  size_t ind, i;
+
+
+  pthread_mutex_lock(&(g_shared.sessions_lock));
+
+  if (g_shared.num_free_sessions == 0) {
+    pthread_mutex_unlock(&(g_shared.sessions_lock));
+    return false;
+  }
+
+  ind = g_shared.session_free_list[--g_shared.num_free_sessions];
+  g_shared.sessions[ind].sockfd = sockfd;
+  g_shared.sessions[ind].stream_ind = stream_ind;
+  g_shared.sessions[ind].active = true;
+
+
+  /* Balance sessions across workers by the number each has been assigned. */
+  worker = &(g_shared.media_workers[0]);
+  for (i=1; i < g_shared.num_media_workers; ++i) {
+    if (g_shared.media_workers[i].num_assigned < worker->num_assigned) {
+      worker = &(g_shared.media_workers[i]);
+    }
+  }
+
+  ++worker->num_assigned;
+  g_shared.sessions[ind].worker_ind = worker - g_shared.media_workers;
+
+  pthread_mutex_unlock(&(g_shared.sessions_lock));
+
+
+  pthread_mutex_lock(&(worker->lock));
+  worker->pending[worker->num_pending++] = ind;
+  pthread_mutex_unlock(&(worker->lock));
+
+  event_signal(worker->handoff_event);
+
+
+  return true;
+}
+
+
+
+
+
+
+bool create_media_workers() {
+
+  struct fj_media_worker_t *worker;
+  struct epoll_event ev;
+  size_t i;
+
+
+  /* Sessions are cache line aligned, which calloc() does not guarantee. */
+  if (posix_memalign((void**) &(g_shared.sessions), CACHE_LINE_SIZE,
+                     sizeof(struct fj_session_t) * g_shared.max_num_sessions) != 0) {
+    return false;
+  }
+  memset(g_shared.sessions, 0, sizeof(struct fj_session_t) * g_shared.max_num_sessions);
+
+  g_shared.session_free_list = (size_t*) malloc(sizeof(size_t) * g_shared.max_num_sessions);
+  g_shared.media_workers = (struct fj_media_worker_t*) calloc(
+      g_shared.num_media_workers, sizeof(struct fj_media_worker_t));
+
+  if (g_shared.session_free_list == NULL || g_shared.media_workers == NULL) {
+    return false;
+  }
+
+  pthread_mutex_init(&(g_shared.sessions_lock), NULL);
+
+  g_shared.num_free_sessions = 0;
+  for (i=g_shared.max_num_sessions; i > 0; --i) {
+    g_shared.sessions[i-1].sockfd = -1;
+    g_shared.session_free_list[g_shared.num_free_sessions++] = i-1;
+  }
+
+
+  for (i=0; i < g_shared.num_media_workers; ++i) {
+
+    worker = &(g_shared.media_workers[i]);
+
+    pthread_mutex_init(&(worker->lock), NULL);
+    worker->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    worker->handoff_event = event_create();
+    worker->frame_event = event_create();
+    worker->pending = (size_t*) malloc(sizeof(size_t) * g_shared.max_num_sessions);
+    worker->sessions = (size_t*) malloc(sizeof(size_t) * g_shared.max_num_sessions);
+
+    if (worker->epollfd < 0 || worker->handoff_event < 0 || worker->frame_event < 0
+        || worker->pending == NULL || worker->sessions == NULL) {
+      error_log("Cannot create media worker.");
+      return false;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = EXIT_TAG;
+    if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, g_shared.exit_event, &ev) < 0) {
+      error_log("Cannot create media worker.");
+      return false;
+    }
+
+    ev.data.u64 = HANDOFF_TAG;
+    if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->handoff_event, &ev) < 0) {
+      error_log("Cannot create media worker.");
+      return false;
+    }
+
+    ev.data.u64 = FRAMES_TAG;
+    if (epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, worker->frame_event, &ev) < 0) {
+      error_log("Cannot create media worker.");
+      return false;
+    }
+
+    if (pthread_create(&(worker->thread_id), NULL, run_media_worker_thread, worker) != 0) {
+      error_log("Cannot start media worker.");
+      return false;
+    }
+  }
+
+
+  return true;
+}
+
+
+
+
+void destroy_media_workers() {
+
+  struct fj_media_worker_t *worker;
+  size_t i, j;
+
+
+  for (i=0; i < g_shared.num_media_workers; ++i) {
+
+    worker = &(g_shared.media_workers[i]);
+
+    pthread_join(worker->thread_id, NULL);
+
+    info_log("Media worker %zu lag policy counts: %" PRIu64 " drops to live, %"
+             PRIu64 " oldest frame drops, %" PRIu64 " disconnects.", i,
+             worker->num_drops_to_live, worker->num_drops_oldest,
+             worker->num_lag_disconnects);
+
+    /* Sessions handed off after the worker stopped were never started. */
+    for (j=0; j < worker->num_pending; ++j) {
+      close(g_shared.sessions[worker->pending[j]].sockfd);
+    }
+
+    close(worker->epollfd);
+    close(worker->handoff_event);
+    close(worker->frame_event);
+    free(worker->pending);
+    free(worker->sessions);
+    pthread_mutex_destroy(&(worker->lock));
+  }
+
+  for (i=0; i < g_shared.max_num_sessions; ++i) {
+    free(g_shared.sessions[i].out_buffer);
+  }
+
+  pthread_mutex_destroy(&(g_shared.sessions_lock));
+
+  free(g_shared.media_workers);
+  free(g_shared.session_free_list);
+  free(g_shared.sessions);
+
+  g_shared.media_workers = NULL;
+  g_shared.session_free_list = NULL;
+  g_shared.sessions = NULL;
+}
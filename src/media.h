@@ -0,0 +1,133 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef MEDIA_H
+#define MEDIA_H
+
+
+#define HANDOFF_TAG (UINT64_MAX - 2)
+#define FRAMES_TAG (UINT64_MAX - 3)
+
+/* Session socket events carry the slot index in the low half and the slot
+generation in the high half, so events queued before a slot was recycled can
+be told apart from events for its new session. */
+#define SESSION_TAG(ind, generation) (((uint64_t) (generation) << 32) | (ind))
+#define SESSION_TAG_IND(tag) ((size_t) ((tag) & UINT32_MAX))
+#define SESSION_TAG_GENERATION(tag) ((uint32_t) ((tag) >> 32))
+
+#define MAX_NUM_STREAMS 8       /* Media URLs, each with its own output profile. */
+#define MAX_RESAMPLE_RATES 4
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "cache_line.h"
+#include "encoder.h"
+
+
+
+/* Action taken when a client falls further behind the live edge than the
+configured maximum lag. */
+enum fj_lag_policy_t {
+  LAG_DROP_TO_LIVE,    /* Skip every queued frame and resume at the live edge. */
+  LAG_DROP_OLDEST,     /* Skip just enough frames to be back within the maximum lag. */
+  LAG_DISCONNECT       /* Close the connection. */
+};
+
+
+/* Streaming client served by one of the media workers. Each session starts
+on its own cache line: neighbouring slots may belong to different workers,
+which write their send state on every frame. */
+struct fj_session_t {
+  CACHE_ALIGNED int sockfd;
+  bool active;
+  uint32_t generation;          /* Bumped each time the slot is released. */
+  size_t worker_ind;
+  size_t stream_ind;            /* Index of the requested media URL. */
+
+  struct fj_encoder_t *encoder;
+  uint64_t frame_num;           /* Next frame to send to the client. */
+
+  FLAC__byte *out_buffer;       /* Chunk-framed output not yet accepted by the socket. */
+  size_t out_capacity;
+  size_t out_len;
+  size_t out_pos;
+  bool write_blocked;           /* Waiting for EPOLLOUT after a short write. */
+  bool read_closed;             /* Client shut down its side, keep sending until it fails. */
+
+  size_t num_resyncs;           /* Lag episodes, counted once when each began. */
+  bool lagging;                 /* Over the lag limit since the output last drained. */
+};
+
+
+/* Thread multiplexing many sessions with one epoll instance. */
+struct fj_media_worker_t {
+  pthread_t thread_id;
+  int epollfd;
+  int handoff_event;            /* Signaled when sessions are queued for the worker. */
+  int frame_event;              /* Signaled by encoders when frames are published. */
+
+  pthread_mutex_t lock;         /* Guards the pending session queue. */
+  size_t *pending;
+  size_t num_pending;
+
+  size_t *sessions;             /* Indices of the sessions owned by the worker. */
+  size_t num_sessions;
+  size_t num_assigned;          /* Sessions queued or owned, guarded by sessions_lock. */
+
+  /* Number of times each lag policy fired for the worker's sessions. */
+  uint64_t num_drops_to_live;
+  uint64_t num_drops_oldest;
+  uint64_t num_lag_disconnects;
+};
+
+
+
+/* Allocates the session table and starts the media worker threads. Returns
+false if they cannot be created. */
+bool create_media_workers();
+
+/* Joins the media worker threads, closes every session and frees the pool. */
+void destroy_media_workers();
+
+
+/* Hands a socket that requested the specified media stream to the least loaded
+worker. Returns false if every session slot is in use, in which case the caller
+still owns the socket. */
+bool media_start_session(const int sockfd, const size_t stream_ind);
+
+
+/* Applies the lag policy to a session that has fallen further behind the
+live edge than the maximum lag, and returns false if it should be
+disconnected. A lag episode lasts until the session is back within the limit
+with its output drained. The policy repositions the session on every wakeup
+of the episode, but the episode is counted once. */
+bool media_check_lag(struct fj_media_worker_t *worker, struct fj_session_t *session);
+
+
+/* Runs a worker thread sending encoded frames to its sessions. */
+void * run_media_worker_thread(void *args);
+
+
+
+#endif /* MEDIA_H */
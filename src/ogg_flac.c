@@ -0,0 +1,348 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "ogg_flac.h"
+
+
+#define OGG_FLAG_CONTINUED 0x01
+#define OGG_FLAG_BOS 0x02
+
+#define FLAC_METADATA_HEADER_LEN 4
+#define FLAC_STREAMINFO_LEN 34
+#define FLAC_VORBIS_COMMENT_TYPE 4
+
+#define OGG_FLAC_VENDOR "FLACJACKet"
+
+
+
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+
+/* Builds the table of the Ogg CRC, run once by whichever thread needs it
+first. */
+static void build_crc_table(void) {
+
+  uint32_t c;
+  size_t i;
+  int j;
+
+  for (i=0; i < 256; ++i) {
+    c = (uint32_t) i << 24;
+    for (j=0; j < 8; ++j) {
+      c = (c & 0x80000000u) ? (c << 1) ^ 0x04C11DB7u : c << 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+
+/* Returns the CRC-32 of the data with the polynomial 0x04C11DB7, not
+reflected, as used to protect Ogg pages. */
+static uint32_t ogg_crc(const uint8_t *data, size_t len) {
+
+  uint32_t crc = 0;
+  size_t i;
+
+  pthread_once(&crc_table_once, build_crc_table);
+
+  for (i=0; i < len; ++i) {
+    crc = (crc << 8) ^ crc_table[(crc >> 24) ^ data[i]];
+  }
+
+  return crc;
+}
+
+
+static inline void put_le(uint8_t *p, uint64_t value, const size_t num_bytes) {
+
+  size_t i;
+
+  for (i=0; i < num_bytes; ++i) {
+    p[i] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+
+
+
+/* Closes the current page and appends it to the output. A page on which no
+packet ends has no granule position. */
+static bool close_page(struct fj_ogg_muxer_t *muxer, const uint8_t flags) {
+
+  const size_t page_len = OGG_PAGE_HEADER_LEN + muxer->num_lacing + muxer->body_len;
+  uint8_t *page, *output;
+  size_t capacity;
+
+
+  if (muxer->output_len + page_len > muxer->output_capacity) {
+    capacity = 2 * (muxer->output_len + page_len);
+    output = (uint8_t*) realloc(muxer->output, capacity);
+    if (output == NULL) {
+      return false;
+    }
+    muxer->output = output;
+    muxer->output_capacity = capacity;
+  }
+
+  page = &(muxer->output[muxer->output_len]);
+
+  memcpy(page, "OggS", 4);
+  page[4] = 0;
+  page[5] = flags | (muxer->continued ? OGG_FLAG_CONTINUED : 0);
+  put_le(&(page[6]), muxer->packet_ended ? muxer->granule : UINT64_MAX, 8);
+  put_le(&(page[14]), muxer->serial, 4);
+  put_le(&(page[18]), muxer->page_seq++, 4);
+  put_le(&(page[22]), 0, 4);
+  page[26] = (uint8_t) muxer->num_lacing;
+  memcpy(&(page[OGG_PAGE_HEADER_LEN]), muxer->lacing, muxer->num_lacing);
+  memcpy(&(page[OGG_PAGE_HEADER_LEN + muxer->num_lacing]), muxer->body, muxer->body_len);
+  put_le(&(page[22]), ogg_crc(page, page_len), 4);
+
+  muxer->output_len += page_len;
+  muxer->output_samples += muxer->num_samples;
+
+  muxer->num_lacing = 0;
+  muxer->body_len = 0;
+  muxer->continued = false;
+  muxer->packet_ended = false;
+  muxer->num_packets = 0;
+  muxer->num_samples = 0;
+
+
+  return true;
+}
+
+
+/* Laces a packet onto the current page, continuing it on new pages while the
+segment table is full. */
+static bool add_packet(struct fj_ogg_muxer_t *muxer, const uint8_t *data, const size_t len,
+                       const unsigned samples) {
+
+  size_t pos = 0, segment_len;
+
+  do {
+    if (muxer->num_lacing == OGG_MAX_SEGMENTS) {
+      if (!close_page(muxer, 0)) {
+        return false;
+      }
+      muxer->continued = true;
+    }
+
+    segment_len = len - pos < 255 ? len - pos : 255;
+    muxer->lacing[muxer->num_lacing++] = (uint8_t) segment_len;
+    memcpy(&(muxer->body[muxer->body_len]), &(data[pos]), segment_len);
+    muxer->body_len += segment_len;
+    pos += segment_len;
+  } while (segment_len == 255);
+
+  muxer->granule += samples;
+  muxer->packet_ended = true;
+  muxer->num_samples += samples;
+  ++muxer->num_packets;
+
+
+  return true;
+}
+
+
+
+
+bool ogg_muxer_init(struct fj_ogg_muxer_t *muxer, const uint32_t serial,
+                    const size_t frames_per_page) {
+
+  memset(muxer, 0, sizeof(struct fj_ogg_muxer_t));
+
+  muxer->serial = serial;
+  muxer->frames_per_page = frames_per_page > 0 ? frames_per_page : 1;
+
+  muxer->body = (uint8_t*) malloc(OGG_MAX_BODY_LEN);
+  if (muxer->body == NULL) {
+    return false;
+  }
+
+  return true;
+}
+
+
+
+
+void ogg_muxer_free(struct fj_ogg_muxer_t *muxer) {
+
+  free(muxer->body);
+  free(muxer->output);
+
+  muxer->body = NULL;
+  muxer->output = NULL;
+}
+
+
+
+
+/* Returns the length of the body of the metadata block starting at the
+specified header. */
+static inline size_t metadata_block_len(const uint8_t *block) {
+  return ((size_t) block[1] << 16) | ((size_t) block[2] << 8) | block[3];
+}
+
+
+
+
+size_t ogg_muxer_write_headers(struct fj_ogg_muxer_t *muxer, const uint8_t *flac_header,
+                               const size_t header_len, uint8_t *buffer,
+                               const size_t buffer_size) {
+
+  const size_t streaminfo_end = 4 + FLAC_METADATA_HEADER_LEN + FLAC_STREAMINFO_LEN;
+  const size_t vendor_len = strlen(OGG_FLAC_VENDOR);
+  uint8_t first_packet[OGG_FLAC_FIRST_PACKET_LEN];
+  uint8_t *blocks;
+  size_t pos, len, last = 0, comment_pos = 0, num_blocks = 0;
+  bool ok;
+
+
+  /* The first packet carries STREAMINFO, which must be the first block. */
+  if (header_len < streaminfo_end
+      || memcmp(flac_header, "fLaC", 4) != 0 || (flac_header[4] & 0x7F) != 0) {
+    return 0;
+  }
+
+  for (pos = streaminfo_end; pos < header_len;
+       pos += FLAC_METADATA_HEADER_LEN + metadata_block_len(&(flac_header[pos]))) {
+    if (pos + FLAC_METADATA_HEADER_LEN > header_len) {
+      return 0;
+    }
+    if ((flac_header[pos] & 0x7F) == FLAC_VORBIS_COMMENT_TYPE && comment_pos == 0) {
+      comment_pos = pos;
+    }
+  }
+
+  if (pos != header_len) {
+    return 0;
+  }
+
+
+  /* The mapping requires a VORBIS_COMMENT packet right after the first page.
+  Headers without one, such as the bare STREAMINFO of the native engine, get
+  an empty one naming only the vendor. Every other block follows as a packet
+  of its own, and the last flag moves to the final block. */
+  blocks = (uint8_t*) malloc(header_len - streaminfo_end + FLAC_METADATA_HEADER_LEN
+                             + 8 + vendor_len);
+  if (blocks == NULL) {
+    return 0;
+  }
+
+  len = 0;
+  if (comment_pos > 0) {
+    memcpy(blocks, &(flac_header[comment_pos]),
+           FLAC_METADATA_HEADER_LEN + metadata_block_len(&(flac_header[comment_pos])));
+    len += FLAC_METADATA_HEADER_LEN + metadata_block_len(&(flac_header[comment_pos]));
+  }
+  else {
+    blocks[0] = FLAC_VORBIS_COMMENT_TYPE;
+    blocks[1] = ((8 + vendor_len) >> 16) & 0xFF;
+    blocks[2] = ((8 + vendor_len) >> 8) & 0xFF;
+    blocks[3] = (8 + vendor_len) & 0xFF;
+    put_le(&(blocks[4]), vendor_len, 4);
+    memcpy(&(blocks[8]), OGG_FLAC_VENDOR, vendor_len);
+    put_le(&(blocks[8 + vendor_len]), 0, 4);    /* No comments. */
+    len += FLAC_METADATA_HEADER_LEN + 8 + vendor_len;
+  }
+
+  for (pos = streaminfo_end; pos < header_len;
+       pos += FLAC_METADATA_HEADER_LEN + metadata_block_len(&(flac_header[pos]))) {
+    if (pos != comment_pos) {
+      memcpy(&(blocks[len]), &(flac_header[pos]),
+             FLAC_METADATA_HEADER_LEN + metadata_block_len(&(flac_header[pos])));
+      len += FLAC_METADATA_HEADER_LEN + metadata_block_len(&(flac_header[pos]));
+    }
+  }
+
+  for (pos = 0; pos < len; pos += FLAC_METADATA_HEADER_LEN + metadata_block_len(&(blocks[pos]))) {
+    blocks[pos] &= 0x7F;
+    last = pos;
+    ++num_blocks;
+  }
+  blocks[last] |= 0x80;
+
+
+  first_packet[0] = 0x7F;
+  memcpy(&(first_packet[1]), "FLAC", 4);
+  first_packet[5] = 1;
+  first_packet[6] = 0;
+  first_packet[7] = (num_blocks >> 8) & 0xFF;
+  first_packet[8] = num_blocks & 0xFF;
+  memcpy(&(first_packet[9]), flac_header, streaminfo_end);
+  first_packet[13] &= 0x7F;     /* STREAMINFO is never the last block. */
+
+  muxer->output_len = 0;
+  muxer->output_samples = 0;
+
+  ok = add_packet(muxer, first_packet, OGG_FLAC_FIRST_PACKET_LEN, 0)
+       && close_page(muxer, OGG_FLAG_BOS);
+
+  for (pos = 0; ok && pos < len;
+       pos += FLAC_METADATA_HEADER_LEN + metadata_block_len(&(blocks[pos]))) {
+    ok = add_packet(muxer, &(blocks[pos]),
+                    FLAC_METADATA_HEADER_LEN + metadata_block_len(&(blocks[pos])), 0);
+  }
+
+  free(blocks);
+
+  /* Audio must start on a fresh page. */
+  if (ok && muxer->num_lacing > 0) {
+    ok = close_page(muxer, 0);
+  }
+
+  if (!ok || muxer->output_len > buffer_size) {
+    return 0;
+  }
+
+  memcpy(buffer, muxer->output, muxer->output_len);
+  return muxer->output_len;
+}
+
+
+
+
+bool ogg_muxer_add_frame(struct fj_ogg_muxer_t *muxer, const uint8_t *frame,
+                         const size_t len, const unsigned samples) {
+
+  muxer->output_len = 0;
+  muxer->output_samples = 0;
+
+  if (!add_packet(muxer, frame, len, samples)) {
+    return false;
+  }
+
+  if (muxer->num_packets >= muxer->frames_per_page) {
+    return close_page(muxer, 0);
+  }
+
+  return true;
+}
@@ -0,0 +1,92 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef OGG_FLAC_H
+#define OGG_FLAC_H
+
+
+#define OGG_PAGE_HEADER_LEN 27
+#define OGG_MAX_SEGMENTS 255
+#define OGG_MAX_BODY_LEN (OGG_MAX_SEGMENTS * 255)
+#define OGG_FLAC_FIRST_PACKET_LEN 51    /* Mapping header, fLaC marker and STREAMINFO. */
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/* Muxer wrapping the frames of one FLAC stream in Ogg pages following the
+Ogg FLAC mapping, one packet per frame. Pages are closed after a configured
+number of frames, trading per-page overhead against latency, or earlier when
+the segment table is full. */
+struct fj_ogg_muxer_t {
+  uint32_t serial;
+  uint32_t page_seq;
+  uint64_t granule;             /* Samples per channel in every completed packet. */
+  size_t frames_per_page;
+
+  /* Page being filled. */
+  uint8_t lacing[OGG_MAX_SEGMENTS];
+  size_t num_lacing;
+  uint8_t *body;                /* Holds OGG_MAX_BODY_LEN bytes. */
+  size_t body_len;
+  bool continued;               /* The page starts with the rest of a packet. */
+  bool packet_ended;            /* At least one packet ends on the page. */
+  size_t num_packets;
+  unsigned num_samples;         /* Samples per channel of the packets ending on the page. */
+
+  /* Pages closed by the last call. */
+  uint8_t *output;
+  size_t output_len;
+  size_t output_capacity;
+  unsigned output_samples;
+};
+
+
+
+/* Initializes a muxer for a logical stream with the specified serial number.
+Returns false if memory cannot be allocated. */
+bool ogg_muxer_init(struct fj_ogg_muxer_t *muxer, const uint32_t serial,
+                    const size_t frames_per_page);
+
+/* Frees the page buffers. */
+void ogg_muxer_free(struct fj_ogg_muxer_t *muxer);
+
+
+/* Converts a native FLAC stream header, the fLaC marker followed by the
+metadata blocks, into the Ogg FLAC header pages written to the buffer, and
+returns their length. An empty VORBIS_COMMENT block is added if the header has
+none, since the mapping requires one. Returns zero if the header cannot be parsed or the pages
+do not fit. Must be called before the first frame. */
+size_t ogg_muxer_write_headers(struct fj_ogg_muxer_t *muxer, const uint8_t *flac_header,
+                               const size_t header_len, uint8_t *buffer,
+                               const size_t buffer_size);
+
+
+/* Adds one FLAC frame as a packet. Any pages it closes are left in the
+muxer's output, which is empty while the current page is still open. Returns
+false if memory cannot be allocated. */
+bool ogg_muxer_add_frame(struct fj_ogg_muxer_t *muxer, const uint8_t *frame,
+                         const size_t len, const unsigned samples);
+
+
+
+#endif /* OGG_FLAC_H */
@@ -0,0 +1,302 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define HAVE_X86_KERNELS 1
+  #include <immintrin.h>
+#endif
+
+#include "resampler.h"
+
+
+
+
+static float dot_scalar(const float *coefs, const float *samples, size_t len) {
+
+  float sums[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+  size_t i;
+
+  for (i=0; i < len; i += 4) {
+    sums[0] += coefs[i] * samples[i];
+    sums[1] += coefs[i+1] * samples[i+1];
+    sums[2] += coefs[i+2] * samples[i+2];
+    sums[3] += coefs[i+3] * samples[i+3];
+  }
+
+  return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+}
+
+
+
+
+#ifdef HAVE_X86_KERNELS
+
+
+__attribute__((target("sse2")))
+static float dot_sse2(const float *coefs, const float *samples, size_t len) {
+
+  __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+  float lanes[4];
+  size_t i;
+
+  for (i=0; i < len; i += 8) {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(&(coefs[i])), _mm_loadu_ps(&(samples[i]))));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(&(coefs[i+4])),
+                                       _mm_loadu_ps(&(samples[i+4]))));
+  }
+
+  _mm_storeu_ps(lanes, _mm_add_ps(sum0, sum1));
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float *coefs, const float *samples, size_t len) {
+
+  __m256 sum = _mm256_setzero_ps();
+  __m128 half;
+  float lanes[4];
+  size_t i;
+
+  for (i=0; i < len; i += 8) {
+    sum = _mm256_fmadd_ps(_mm256_loadu_ps(&(coefs[i])), _mm256_loadu_ps(&(samples[i])), sum);
+  }
+
+  half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+  _mm_storeu_ps(lanes, half);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+
+#endif /* HAVE_X86_KERNELS */
+
+
+
+
+/* Zeroth order modified Bessel function of the first kind, for the Kaiser
+window. */
+static double bessel_i0(const double x) {
+
+  double sum = 1.0, term = 1.0;
+  int k;
+
+  for (k=1; k < 50; ++k) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+  }
+
+  return sum;
+}
+
+
+static unsigned gcd(unsigned a, unsigned b) {
+
+  unsigned t;
+
+  while (b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+
+  return a;
+}
+
+
+/* Designs a Kaiser windowed sinc lowpass at the upsampled rate and splits it
+into phases. Interpolating by up spreads each input sample over up phases, so
+the filter has a gain of up. */
+static void design_filter(struct fj_resampler_t *resampler) {
+
+  const size_t len = resampler->num_taps * resampler->up;
+  const double center = (len - 1) / 2.0;
+  const double cutoff = 0.5 * RESAMPLE_ROLLOFF
+                        / (resampler->up > resampler->down ? resampler->up : resampler->down);
+  const double norm = bessel_i0(RESAMPLE_KAISER_BETA);
+  double t, r, h;
+  size_t n, phase, tap;
+
+
+  for (n=0; n < len; ++n) {
+    t = n - center;
+    r = 2.0 * t / (len - 1);
+    h = 2.0 * cutoff * (t == 0.0 ? 1.0 : sin(2.0 * M_PI * cutoff * t) / (2.0 * M_PI * cutoff * t));
+    h *= bessel_i0(RESAMPLE_KAISER_BETA * sqrt(fmax(0.0, 1.0 - r * r))) / norm;
+
+    /* Tap k of phase p weighs the input k samples before the newest, and is
+    stored in reverse so it lines up with the history. */
+    phase = n % resampler->up;
+    tap = n / resampler->up;
+    resampler->filter[phase * resampler->num_taps + resampler->num_taps - 1 - tap] =
+      (float) (h * resampler->up);
+  }
+}
+
+
+
+
+
+
+bool resampler_supports(const unsigned in_rate, const unsigned out_rate) {
+
+  unsigned divisor = gcd(in_rate, out_rate);
+
+  return divisor != 0 && out_rate / divisor <= RESAMPLE_MAX_PHASES;
+}
+
+
+
+bool resampler_init(struct fj_resampler_t *resampler, const unsigned in_rate,
+                    const unsigned out_rate, const size_t num_channels,
+                    const size_t max_in_frames, const float max_magnitude) {
+
+  unsigned divisor = gcd(in_rate, out_rate);
+  double ratio;
+
+
+  memset(resampler, 0, sizeof(struct fj_resampler_t));
+
+  if (!resampler_supports(in_rate, out_rate) ||
+      num_channels < 1 || num_channels > RESAMPLE_MAX_CHANNELS) {
+    return false;
+  }
+
+  resampler->in_rate = in_rate;
+  resampler->out_rate = out_rate;
+  resampler->up = out_rate / divisor;
+  resampler->down = in_rate / divisor;
+  resampler->num_channels = num_channels;
+  resampler->max_in_frames = max_in_frames;
+  resampler->max_magnitude = max_magnitude;
+
+  /* Decimating narrows the passband relative to the input, which needs
+  proportionally more taps for the same transition band. */
+  ratio = (double) resampler->down / resampler->up;
+  resampler->num_taps = (size_t) ceil(RESAMPLE_TAPS * (ratio > 1.0 ? ratio : 1.0) / 8.0) * 8;
+
+  resampler->history_len = resampler->num_taps - 1 + max_in_frames;
+  resampler->filter = (float*) malloc(sizeof(float) * resampler->num_taps * resampler->up);
+  resampler->history = (float*) calloc(resampler->history_len * num_channels, sizeof(float));
+
+  if (resampler->filter == NULL || resampler->history == NULL) {
+    resampler_free(resampler);
+    return false;
+  }
+
+  design_filter(resampler);
+
+
+  resampler->dot = dot_scalar;
+
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    resampler->dot = dot_avx2;
+  }
+  else if (__builtin_cpu_supports("sse2")) {
+    resampler->dot = dot_sse2;
+  }
+#endif
+
+
+  return true;
+}
+
+
+
+
+void resampler_free(struct fj_resampler_t *resampler) {
+
+  free(resampler->filter);
+  free(resampler->history);
+
+  resampler->filter = NULL;
+  resampler->history = NULL;
+}
+
+
+
+
+size_t resampler_max_output(const struct fj_resampler_t *resampler, const size_t num_in_frames) {
+  return (num_in_frames * resampler->up + resampler->down - 1) / resampler->down + 1;
+}
+
+
+
+
+size_t resampler_process(struct fj_resampler_t *resampler, const int32_t *in,
+                         const size_t num_in_frames, const bool planar, int32_t *out) {
+
+  const size_t num_channels = resampler->num_channels;
+  const size_t num_taps = resampler->num_taps;
+  const uint64_t end = (uint64_t) num_in_frames * resampler->up;
+  float *history;
+  float y;
+  uint64_t pos;
+  size_t num_out = 0, c, i;
+
+
+  /* Append the block to each channel's history as floats. */
+  for (c=0; c < num_channels; ++c) {
+    history = &(resampler->history[c * resampler->history_len + num_taps - 1]);
+    for (i=0; i < num_in_frames; ++i) {
+      history[i] = (float) (planar ? in[c * num_in_frames + i] : in[i * num_channels + c]);
+    }
+  }
+
+
+  /* Output n lies at pos / up input samples into the block, and is filtered
+  from the num_taps samples ending at that input sample. */
+  for (pos = resampler->pos; pos < end; pos += resampler->down) {
+    ++num_out;
+  }
+
+  for (c=0; c < num_channels; ++c) {
+    history = &(resampler->history[c * resampler->history_len]);
+
+    for (i=0, pos = resampler->pos; pos < end; ++i, pos += resampler->down) {
+      y = resampler->dot(&(resampler->filter[(pos % resampler->up) * num_taps]),
+                         &(history[pos / resampler->up]), num_taps);
+
+      y = fmaxf(fminf(y, resampler->max_magnitude), -resampler->max_magnitude - 1.0f);
+      if (planar) {
+        out[c * num_out + i] = (int32_t) lrintf(y);
+      }
+      else {
+        out[i * num_channels + c] = (int32_t) lrintf(y);
+      }
+    }
+
+    /* Keep the newest samples for the filters of the next block. */
+    memmove(history, &(history[num_in_frames]), sizeof(float) * (num_taps - 1));
+  }
+
+  resampler->pos = pos - end;
+
+
+  return num_out;
+}
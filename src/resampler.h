@@ -0,0 +1,89 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+
+#define RESAMPLE_TAPS 64          /* Taps per phase when not decimating. */
+#define RESAMPLE_MAX_PHASES 1024
+#define RESAMPLE_ROLLOFF 0.92     /* Passband edge as a share of the lower Nyquist rate. */
+#define RESAMPLE_KAISER_BETA 8.0  /* About 80 dB of stopband attenuation. */
+#define RESAMPLE_MAX_CHANNELS 8
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+
+/* Dot product of one filter phase with the input history. */
+typedef float (*fj_dot_func_t)(const float *coefs, const float *samples, size_t len);
+
+
+/* Rational polyphase resampler converting by up/down, with one windowed sinc
+filter split into up phases. */
+struct fj_resampler_t {
+  unsigned in_rate;
+  unsigned out_rate;
+  unsigned up;
+  unsigned down;
+
+  size_t num_channels;
+  size_t num_taps;          /* Taps per phase, a multiple of eight. */
+  float *filter;            /* Phase p holds its taps at filter[p * num_taps], oldest sample first. */
+
+  float *history;           /* Per channel, num_taps - 1 past samples then the new block. */
+  size_t history_len;
+  size_t max_in_frames;
+  uint64_t pos;             /* Next output time in 1/up input samples, from the new block. */
+
+  float max_magnitude;      /* Full scale of the integer samples. */
+  fj_dot_func_t dot;
+};
+
+
+
+/* Returns true if the ratio between the rates needs few enough phases. */
+bool resampler_supports(const unsigned in_rate, const unsigned out_rate);
+
+/* Designs the filter for converting between the rates and allocates the
+history for blocks of up to the specified number of frames. Returns false if
+the ratio needs too many phases or memory cannot be allocated. */
+bool resampler_init(struct fj_resampler_t *resampler, const unsigned in_rate,
+                    const unsigned out_rate, const size_t num_channels,
+                    const size_t max_in_frames, const float max_magnitude);
+
+/* Frees the filter and history. */
+void resampler_free(struct fj_resampler_t *resampler);
+
+
+/* Returns the most frames a block of the specified length can produce. */
+size_t resampler_max_output(const struct fj_resampler_t *resampler, const size_t num_in_frames);
+
+/* Resamples a block of integer frames, interleaved or one run per channel when
+planar, into the output in the same layout, and returns the number of output
+frames. The output must hold resampler_max_output() frames. */
+size_t resampler_process(struct fj_resampler_t *resampler, const int32_t *in,
+                         const size_t num_in_frames, const bool planar, int32_t *out);
+
+
+
+#endif /* RESAMPLER_H */
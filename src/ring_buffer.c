@@ -0,0 +1,208 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "ring_buffer.h"
+
+
+
+
+/* Maps a memory file of at least the specified number of samples twice back
+to back, rounded and aligned to the page size, taking the pages from the
+hugetlb pool if requested. Returns false and leaves the ring unmapped on
+failure. */
+static bool map_mirror(struct fj_ring_t *ring, size_t min_capacity, size_t page_size,
+                       bool hugetlb) {
+
+  size_t num_bytes, slack;
+  uint8_t *reserved, *addr;
+  int fd;
+
+
+  if (page_size == 0) {
+    errno = ENOSYS;
+    return false;
+  }
+
+  num_bytes = (sizeof(int32_t) * min_capacity + page_size - 1) / page_size * page_size;
+
+
+  fd = memfd_create("flacjacket-ring", MFD_CLOEXEC | (hugetlb ? MFD_HUGETLB : 0));
+  if (fd < 0) {
+    return false;
+  }
+
+  if (ftruncate(fd, num_bytes) != 0) {
+    close(fd);
+    return false;
+  }
+
+
+  /* Reserve twice the size plus room to align to the page size, trim the
+  slack, then map the same pages over both halves. */
+  reserved = (uint8_t*) mmap(NULL, 2 * num_bytes + page_size, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+
+  addr = (uint8_t*) (((uintptr_t) reserved + page_size - 1) & ~(uintptr_t) (page_size - 1));
+  slack = addr - reserved;
+
+  if (slack > 0) {
+    munmap(reserved, slack);
+  }
+  munmap(addr + 2 * num_bytes, page_size - slack);
+
+
+  if (mmap(addr, num_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+           fd, 0) == MAP_FAILED
+      || mmap(addr + num_bytes, num_bytes, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(addr, 2 * num_bytes);
+    close(fd);
+    return false;
+  }
+
+  /* The mappings keep the memory alive. */
+  close(fd);
+
+
+  ring->samples = (int32_t*) addr;
+  ring->capacity = num_bytes / sizeof(int32_t);
+
+  return true;
+}
+
+
+
+
+bool ring_init(struct fj_ring_t *ring, size_t min_capacity,
+               const struct fj_audio_mem_t *mem) {
+
+  ring->samples = NULL;
+  ring->capacity = 0;
+  ring->head = 0;
+  ring->cached_tail = 0;
+  ring->tail = 0;
+  ring->num_overruns = 0;
+
+
+  if (mem->hugepages == HUGEPAGES_EXPLICIT
+      && !map_mirror(ring, min_capacity, audio_mem_hugepage_size(), true)) {
+    error_log("Cannot map the capture ring with explicit hugepages, using normal "
+              "pages: %s", strerror(errno));
+  }
+
+  /* Transparent hugepages can only back whole, aligned hugepages of the
+  file, so size the ring in them. */
+  if (mem->hugepages == HUGEPAGES_TRANSPARENT
+      && !map_mirror(ring, min_capacity, audio_mem_transparent_hugepage_size(), false)) {
+    error_log("Cannot map the capture ring for transparent hugepages, using normal "
+              "pages: %s", strerror(errno));
+  }
+
+  if (ring->samples == NULL
+      && !map_mirror(ring, min_capacity, (size_t) sysconf(_SC_PAGESIZE), false)) {
+    return false;
+  }
+
+
+  /* Prefault and lock both halves, since each has its own page table
+  entries. */
+  audio_mem_prepare(mem, ring->samples, 2 * sizeof(int32_t) * ring->capacity);
+
+  return true;
+}
+
+
+
+void ring_free(struct fj_ring_t *ring) {
+  if (ring->samples != NULL) {
+    munmap(ring->samples, 2 * sizeof(int32_t) * ring->capacity);
+  }
+  ring->samples = NULL;
+  ring->capacity = 0;
+}
+
+
+
+
+bool ring_can_write(struct fj_ring_t *ring, size_t len) {
+
+  if (ring->capacity - (size_t) (ring->head - ring->cached_tail) >= len) {
+    return true;
+  }
+
+  /* The consumer releases samples by storing the tail, so acquire it before
+  reusing their memory. */
+  ring->cached_tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+
+  return ring->capacity - (size_t) (ring->head - ring->cached_tail) >= len;
+}
+
+
+
+int32_t * ring_write_ptr(struct fj_ring_t *ring) {
+  return &(ring->samples[ring->head % ring->capacity]);
+}
+
+
+
+void ring_commit(struct fj_ring_t *ring, size_t len) {
+  __atomic_store_n(&(ring->head), ring->head + len, __ATOMIC_RELEASE);
+}
+
+
+
+void ring_overrun(struct fj_ring_t *ring) {
+  __atomic_fetch_add(&(ring->num_overruns), 1, __ATOMIC_RELAXED);
+}
+
+
+
+
+size_t ring_read_available(const struct fj_ring_t *ring) {
+
+  uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+
+  return (size_t) (head - ring->tail);
+}
+
+
+
+void ring_read(struct fj_ring_t *ring, int32_t *dest, size_t len) {
+
+  memcpy(dest, &(ring->samples[ring->tail % ring->capacity]), len * sizeof(int32_t));
+
+  __atomic_store_n(&(ring->tail), ring->tail + len, __ATOMIC_RELEASE);
+}
+
+
+
+uint64_t ring_num_overruns(const struct fj_ring_t *ring) {
+  return __atomic_load_n(&(ring->num_overruns), __ATOMIC_RELAXED);
+}
@@ -0,0 +1,94 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "audio_memory.h"
+#include "cache_line.h"
+
+
+
+/* Wait-free single-producer single-consumer ring of interleaved samples. The
+head is only written by the producer and the tail only by the consumer, so
+neither side ever blocks the other. The sample memory is mapped twice back to
+back, so any run of up to capacity samples starting inside the ring is
+contiguous and neither side has to split accesses at the wrap point. */
+struct fj_ring_t {
+  int32_t *samples;         /* Mapping of 2 * capacity samples, the second half mirroring the first. */
+  size_t capacity;
+
+  /* Producer side, on its own cache line. */
+  CACHE_ALIGNED uint64_t head;   /* Total samples written by the producer. */
+  uint64_t cached_tail;     /* Tail last loaded by the producer. */
+  uint64_t num_overruns;    /* Writes dropped because the ring was full. */
+
+  /* Consumer side, on its own cache line. */
+  CACHE_ALIGNED uint64_t tail;   /* Total samples read by the consumer. */
+};
+
+
+
+/* Maps the mirrored sample memory for a ring holding at least the specified
+number of samples, backed, prefaulted and locked as configured. The capacity
+is rounded up to a whole number of pages. Falls back to normal pages if no
+explicit hugepages are available. Returns false if the memory cannot be
+mapped. */
+bool ring_init(struct fj_ring_t *ring, size_t min_capacity,
+               const struct fj_audio_mem_t *mem);
+
+/* Unmaps the sample memory of the ring. */
+void ring_free(struct fj_ring_t *ring);
+
+
+/* Returns whether the producer can write the specified number of samples
+without overwriting unread samples. The consumer's tail is only loaded when
+the space seen at the last load is not enough, so the producer rarely touches
+the consumer's cache line. */
+bool ring_can_write(struct fj_ring_t *ring, size_t len);
+
+/* Returns the contiguous memory the producer writes its next samples to. */
+int32_t * ring_write_ptr(struct fj_ring_t *ring);
+
+/* Publishes the specified number of samples written by the producer starting
+at the current head. */
+void ring_commit(struct fj_ring_t *ring, size_t len);
+
+/* Counts a write that the producer dropped because the ring was full. */
+void ring_overrun(struct fj_ring_t *ring);
+
+
+/* Returns the number of samples published and not yet read by the consumer. */
+size_t ring_read_available(const struct fj_ring_t *ring);
+
+/* Copies the specified number of samples to the destination with a single
+copy and releases them back to the producer. */
+void ring_read(struct fj_ring_t *ring, int32_t *dest, size_t len);
+
+/* Returns the number of writes dropped so far. */
+uint64_t ring_num_overruns(const struct fj_ring_t *ring);
+
+
+
+#endif /* RING_BUFFER_H */
@@ -0,0 +1,174 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sample_block.h"
+
+
+
+
+struct fj_block_t * block_new(size_t len) {
+
+  struct fj_block_t *block = (struct fj_block_t*) malloc(sizeof(struct fj_block_t)
+                                                         + len * sizeof(int32_t));
+  if (block == NULL) {
+    return NULL;
+  }
+
+  block->refcount = 1;
+  block->seq = 0;
+  block->next = NULL;
+  block->len = len;
+  block->silent = false;
+
+  return block;
+}
+
+
+
+bool block_detect_silence(struct fj_block_t *block) {
+
+  int32_t bits = 0;
+  size_t i, j, end;
+
+  /* Or whole runs together so the inner loop vectorizes, and stop at the
+  first run holding signal. */
+  for (i=0; i < block->len && bits == 0; i = end) {
+    end = i + 256 < block->len ? i + 256 : block->len;
+    for (j=i; j < end; ++j) {
+      bits |= block->samples[j];
+    }
+  }
+
+  block->silent = bits == 0;
+
+  return block->silent;
+}
+
+
+
+void block_ref(struct fj_block_t *block) {
+  __atomic_fetch_add(&(block->refcount), 1, __ATOMIC_RELAXED);
+}
+
+
+
+void block_unref(struct fj_block_t *block) {
+
+  struct fj_block_t *next;
+
+  /* Free iteratively so a long unreferenced tail does not recurse. */
+  while (block != NULL) {
+    if (__atomic_sub_fetch(&(block->refcount), 1, __ATOMIC_ACQ_REL) != 0) {
+      break;
+    }
+    next = __atomic_load_n(&(block->next), __ATOMIC_ACQUIRE);
+    free(block);
+    block = next;
+  }
+}
+
+
+
+struct fj_block_t * block_next(struct fj_block_t *block) {
+
+  /* The caller's block owns a reference to its successor, so the successor
+  stays alive while the new reference is taken. */
+  struct fj_block_t *next = __atomic_load_n(&(block->next), __ATOMIC_ACQUIRE);
+
+  if (next != NULL) {
+    block_ref(next);
+  }
+
+  return next;
+}
+
+
+
+
+
+void block_chain_init(struct fj_block_chain_t *chain) {
+  pthread_mutex_init(&(chain->lock), NULL);
+  chain->latest = NULL;
+  chain->num_published = 0;
+}
+
+
+
+void block_chain_destroy(struct fj_block_chain_t *chain) {
+
+  if (chain->latest != NULL) {
+    block_unref(chain->latest);
+    chain->latest = NULL;
+  }
+
+  pthread_mutex_destroy(&(chain->lock));
+}
+
+
+
+void block_chain_publish(struct fj_block_chain_t *chain, struct fj_block_t *block) {
+
+  struct fj_block_t *prev;
+
+  pthread_mutex_lock(&(chain->lock));
+
+  block->seq = chain->num_published;
+  prev = chain->latest;
+
+  /* The previous block keeps the caller's reference to the new block, and the
+  chain takes a new one for itself. */
+  if (prev != NULL) {
+    block_ref(block);
+    __atomic_store_n(&(prev->next), block, __ATOMIC_RELEASE);
+  }
+
+  chain->latest = block;
+  __atomic_store_n(&(chain->num_published), chain->num_published + 1, __ATOMIC_RELEASE);
+
+  pthread_mutex_unlock(&(chain->lock));
+
+  if (prev != NULL) {
+    block_unref(prev);
+  }
+}
+
+
+
+struct fj_block_t * block_chain_latest(struct fj_block_chain_t *chain) {
+
+  struct fj_block_t *block;
+
+  pthread_mutex_lock(&(chain->lock));
+  block = chain->latest;
+  if (block != NULL) {
+    block_ref(block);
+  }
+  pthread_mutex_unlock(&(chain->lock));
+
+  return block;
+}
+
+
+
+uint64_t block_chain_num_published(struct fj_block_chain_t *chain) {
+  return __atomic_load_n(&(chain->num_published), __ATOMIC_ACQUIRE);
+}
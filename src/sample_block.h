@@ -0,0 +1,97 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#ifndef SAMPLE_BLOCK_H
+#define SAMPLE_BLOCK_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+
+
+/* Immutable block of samples, either interleaved or stored as one contiguous
+run per channel when the server runs with the planar layout. A block is written
+once by the capture thread and then shared read-only by every encoder. Each
+block holds a reference to the block published after it, so a consumer holding
+any block can walk forward without locking. */
+struct fj_block_t {
+  uint64_t refcount;
+  uint64_t seq;               /* Number of blocks published before this one. */
+  struct fj_block_t *next;    /* Set once when the following block is published. */
+
+  size_t len;                 /* Number of samples in the block. */
+  bool silent;                /* Every sample is zero. */
+  int32_t samples[];
+};
+
+
+/* Chain of published blocks. The lock is only taken to publish a block or to
+join the chain at the newest block; walking the chain is lock-free. */
+struct fj_block_chain_t {
+  pthread_mutex_t lock;
+  struct fj_block_t *latest;
+  uint64_t num_published;
+};
+
+
+
+/* Allocates an unpublished block with room for the specified number of
+samples and a single reference owned by the caller. */
+struct fj_block_t * block_new(size_t len);
+
+/* Sets whether every sample of the block is zero before it is published, and
+returns it. */
+bool block_detect_silence(struct fj_block_t *block);
+
+/* Adds a reference to the block. */
+void block_ref(struct fj_block_t *block);
+
+/* Drops a reference to the block, freeing it and any following blocks that are
+no longer referenced. */
+void block_unref(struct fj_block_t *block);
+
+/* Returns a new reference to the block published after the specified one, or
+NULL if it has not been published yet. */
+struct fj_block_t * block_next(struct fj_block_t *block);
+
+
+/* Initializes an empty block chain. */
+void block_chain_init(struct fj_block_chain_t *chain);
+
+/* Releases the chain's reference to its newest block. */
+void block_chain_destroy(struct fj_block_chain_t *chain);
+
+/* Appends the block to the chain, taking over the caller's reference. The
+block must not be written after it is published. */
+void block_chain_publish(struct fj_block_chain_t *chain, struct fj_block_t *block);
+
+/* Returns a new reference to the newest published block, or NULL if nothing has
+been published yet. */
+struct fj_block_t * block_chain_latest(struct fj_block_chain_t *chain);
+
+/* Returns the number of blocks published to the chain so far. */
+uint64_t block_chain_num_published(struct fj_block_chain_t *chain);
+
+
+
+#endif /* SAMPLE_BLOCK_H */
@@ -18,8 +18,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define _GNU_SOURCE
 
 #include "flacjacket_globals.h"
+#include "encoder.h"
+#include "events.h"
 #include "http_sends.h"
 #include "logging.h"
+#include "media.h"
 #include "sddp_sends.h"
 #include "server.h"
 
@@ -70,326 +73,423 @@ static void parse_uri(const char *buffer, const size_t buffer_len,
 
 
 
-void * run_media_thread(void *args) {
+/* Returns the connection to the free list, closing its socket unless it was
+handed off to a media worker. */
+static void release_connection(struct fj_connection_t *connections, size_t *free_list,
+                               size_t *num_free, const size_t ind, const bool close_socket) {
 
-  struct timespec ts;
-  ts.tv_sec = 0;
-  ts.tv_nsec = 5000000L;  /* 5 ms */
+  if (close_socket) {
+    close(connections[ind].sockfd);
+  }
+  connections[ind].state = CONN_FREE;
+  connections[ind].sockfd = -1;
+  free_list[(*num_free)++] = ind;
+}
 
 
-  int sockfd = *((int*)args);
+
+/* Sets the events the http thread waits for on a connection. Releases the
+connection if it cannot be watched and returns false. */
+static bool watch_connection(const int epollfd, const int op, const uint32_t events,
+                             struct fj_connection_t *connections, size_t *free_list,
+                             size_t *num_free, const size_t ind) {
+
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.u64 = ind;
+
+  if (epoll_ctl(epollfd, op, connections[ind].sockfd, &ev) < 0) {
+    error_log("Cannot watch connection: %s", strerror(errno));
+    release_connection(connections, free_list, num_free, ind, true);
+    return false;
+  }
+
+  return true;
+}
 
 
-  char recv_buffer[RECV_SIZE];
-  size_t num_received;
-  bool request_beginning, encoded;
-  uint64_t start_ind, end, cur_len;
-  int32_t *sample_buffer;
 
-  
-  int opt = 1;
-  setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
-  send_chunked_stream_response(SERVER_NAME, sockfd);
 
+/* Returns true if the URI names one of the media streams, as /media/<n> with
+the extension of the stream's format, and sets its index. */
+static bool parse_stream_uri(const char *uri, size_t *stream_ind) {
 
-  /* Initialize the FLAC encoder. */
-  FLAC__StreamEncoder *encoder;
-  FLAC__bool ok = true;
-  FLAC__StreamEncoderInitStatus init_status;
+  const char *prefix = "/media/";
+  char *end;
+  unsigned long ind;
 
-  encoder = FLAC__stream_encoder_new();
 
-  if (encoder == NULL) {
-    ok = false;
+  if (strncmp(uri, prefix, strlen(prefix)) != 0 ||
+      !isdigit((unsigned char) uri[strlen(prefix)])) {
+    return false;
   }
 
-  if (ok) {
-    ok &= FLAC__stream_encoder_set_compression_level(encoder, g_shared.compression_level);
-    ok &= FLAC__stream_encoder_set_channels(encoder, g_shared.num_channels);
-    ok &= FLAC__stream_encoder_set_bits_per_sample(encoder, g_shared.bit_depth);
-    ok &= FLAC__stream_encoder_set_sample_rate(encoder, g_shared.sample_rate);
+  ind = strtoul(&uri[strlen(prefix)], &end, 10);
+  if (ind >= g_shared.num_streams
+      || strcmp(end, stream_extension(g_shared.streams[ind].format)) != 0) {
+    return false;
   }
 
-  if (ok) {
-    init_status = FLAC__stream_encoder_init_stream(encoder, send_flac_callback,
-                                                   NULL, NULL, NULL, &sockfd);
-    if(init_status != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
-      error_log("Failed to initialize encoder: %s",
-                FLAC__StreamEncoderInitStatusString[init_status]);
-      ok = false;
-    }
+  *stream_ind = ind;
+  return true;
+}
+
+
+
+/* Parses a complete request and fills the connection's send buffer with the
+response. Returns true if the request is for a media stream, in which case the
+socket should be handed to a media worker instead. */
+static bool route_request(struct fj_connection_t *conn) {
+
+  char uri_buffer[MAX_URI_LEN+1];  /* Length+1 to hold terminating null. */
+  bool is_get, is_post;
+
+
+  parse_uri(conn->recv_buffer, conn->recv_len, uri_buffer, &is_get, &is_post);
+
+  if (is_get && parse_stream_uri(uri_buffer, &conn->stream_ind)) {
+    return true;
   }
 
-  if (!ok) {
-    error_log("Cannot create FLAC encoder.");
-    if (encoder != NULL) {
-      FLAC__stream_encoder_delete(encoder);
-    }
-    send_error_response(SERVER_NAME, sockfd);
-    close(sockfd);
-    return NULL;
+
+  if (is_get && strcmp(uri_buffer, "/rootDesc.xml") == 0) {
+    conn->send_len = format_root_xml_response(g_shared.uuid, g_shared.name, SERVER_NAME,
+                                              conn->send_buffer, SEND_BUFFER_SIZE);
   }
 
+  else if (is_get && strcmp(uri_buffer, "/ContentDir.xml") == 0) {
+    conn->send_len = format_content_dir_xml_response(SERVER_NAME, conn->send_buffer,
+                                                     SEND_BUFFER_SIZE);
+  }
 
+  else if (is_post && strcmp(uri_buffer, "/ctl/ContentDir") == 0) {
+    conn->send_len = format_content_response(g_shared.name, SERVER_NAME,
+                                             g_shared.server_url, g_shared.streams,
+                                             g_shared.num_streams, conn->send_buffer,
+                                             SEND_BUFFER_SIZE);
+  }
 
+  else {
+    conn->send_len = format_empty_response(SERVER_NAME, conn->send_buffer,
+                                           SEND_BUFFER_SIZE);
+  }
 
-  /* Get the start of this thread's stream as the latest possible point that is
-  closest to being ready to send. */
-  pthread_mutex_lock(&(g_shared.encoder_lock));
-  end = g_shared.encoder_buffer_start_ind + g_shared.encoder_buffer_len;
-  start_ind = end > g_shared.encoder_buffer_len_threshold
-              ? end - g_shared.encoder_buffer_len_threshold
-              : g_shared.encoder_buffer_start_ind;
-  pthread_mutex_unlock(&(g_shared.encoder_lock));
 
+  conn->send_pos = 0;
+  return false;
+}
 
-  debug_log("Media thread started.");
 
 
-  while (1) {
-    if (g_exited) break;
 
-    encoded = false;
+/* Reads available request bytes. Sets the state to writing once the headers
+and any body announced by Content-Length have been received, even if the
+client has already shut down its side, so the request is still answered.
+Returns false if the connection failed or was closed before the request was
+complete. */
+static bool read_request(struct fj_connection_t *conn) {
 
-    /* Empty the socket read buffer. */
-    request_beginning = true;
-    while (1) {
-      num_received = recv(sockfd, recv_buffer, RECV_SIZE, 0);
-      if (num_received > 0 && num_received <= RECV_SIZE && request_beginning) {
-        recv_buffer[num_received-1] = '\0';
-        debug_log(recv_buffer);
-      }
-      request_beginning = false;
+  ssize_t num_received;
+  size_t room;
+  char discard[RECV_SIZE];
+  const char *header_end, *content_length;
+  bool closed = false;
 
-      if (errno == EAGAIN || errno == EWOULDBLOCK || num_received == 0
-          || num_received > RECV_SIZE) {
-        break;
-      }
+
+  while (1) {
+
+    /* Keep the start of the request for routing and discard the rest of an
+    oversized body. */
+    room = REQUEST_BUFFER_SIZE - conn->recv_len;
+    if (room > 0) {
+      num_received = recv(conn->sockfd, &(conn->recv_buffer[conn->recv_len]), room, 0);
+    }
+    else {
+      num_received = recv(conn->sockfd, discard, RECV_SIZE, 0);
     }
 
+    if (num_received == 0) {
+      closed = true;
+      break;
+    }
+    if (num_received < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      if (errno == EINTR) continue;
+      return false;
+    }
 
 
-    /* Encode the stream samples. */
-    if (pthread_mutex_trylock(&(g_shared.encoder_lock)) == 0) {
+    if (room > 0) {
+      conn->recv_len += num_received;
+      conn->recv_buffer[conn->recv_len] = '\0';
+    }
 
-      end = g_shared.encoder_buffer_start_ind + g_shared.encoder_buffer_len;
-      cur_len = end - start_ind;
+    if (!conn->headers_done) {
+      header_end = strstr(conn->recv_buffer, "\r\n\r\n");
 
-      if (cur_len >= g_shared.encoder_buffer_len_threshold) {
-        sample_buffer = &(g_shared.encoder_buffer[start_ind - g_shared.encoder_buffer_start_ind]);
-        start_ind += g_shared.encoder_buffer_len_threshold;
+      if (header_end != NULL) {
+        conn->headers_done = true;
+        conn->body_remaining = 0;
 
-        FLAC__stream_encoder_process_interleaved(encoder, sample_buffer,
-                                                 g_shared.num_samples_threshold);
+        content_length = strcasestr(conn->recv_buffer, "Content-Length:");
+        if (content_length != NULL && content_length < header_end) {
+          conn->body_remaining = strtoul(content_length + 15, NULL, 10);
+        }
 
-        encoded = true;
+        /* Count body bytes that arrived along with the headers. */
+        num_received = conn->recv_len - (header_end + 4 - conn->recv_buffer);
+      }
+      else if (conn->recv_len == REQUEST_BUFFER_SIZE) {
+        /* Headers too long to buffer; route on the request line alone. */
+        conn->headers_done = true;
+        conn->body_remaining = 0;
       }
-
-      pthread_mutex_unlock(&(g_shared.encoder_lock));
     }
 
+    if (conn->headers_done) {
+      conn->body_remaining -= (size_t) num_received < conn->body_remaining
+                              ? (size_t) num_received : conn->body_remaining;
+    }
+  }
 
 
-    if (!encoded) nanosleep(&ts, NULL);
+  if (conn->headers_done && conn->body_remaining == 0) {
+    conn->state = CONN_WRITING;
   }
 
+  return !closed || conn->state == CONN_WRITING;
+}
 
-  FLAC__stream_encoder_finish(encoder);
-  FLAC__stream_encoder_delete(encoder);
 
-  close(sockfd);
 
 
-  debug_log("Exiting media thread.");
-
-  return NULL;
-}
+/* Writes as much of the pending response as the socket accepts. Returns true
+once the whole response has been sent or the connection failed. */
+static bool write_response(struct fj_connection_t *conn) {
 
+  ssize_t num_sent;
 
+  while (conn->send_pos < conn->send_len) {
+    num_sent = send(conn->sockfd, &(conn->send_buffer[conn->send_pos]),
+                    conn->send_len - conn->send_pos, MSG_NOSIGNAL);
+    if (num_sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+      if (errno == EINTR) continue;
+      return true;
+    }
+    conn->send_pos += num_sent;
+  }
 
+  return true;
+}
 
 
 
-void * run_http_thread() {
 
-  struct timespec ts;
-  ts.tv_sec = 0;
-  ts.tv_nsec = 100000000L;  /* 100 ms */
 
+void * run_http_thread() {
 
-  int connfd;
+  int epollfd, connfd, num_events;
   socklen_t clientnamelen;
   struct sockaddr_in clientname;
+  struct epoll_event ev, events[MAX_EPOLL_EVENTS];
   unsigned long ip;
-  size_t i, j;
+  size_t i, ind;
+  time_t now;
 
-  char recv_buffer[RECV_SIZE];
-  char uri_buffer[MAX_URI_LEN+1];  /* Length+1 to hold terminating null. */
-  size_t num_received;
-  bool request_beginning;
-  bool is_get, is_post;
+  struct fj_connection_t *conn;
 
 
-  pthread_t *media_threads = (pthread_t*) malloc(sizeof(pthread_t)
-                                                 * g_shared.max_num_connections);
-  int *temp_connections = (int*) malloc(sizeof(int) * g_shared.max_num_connections);
-  bool *is_closed = (bool*) malloc(sizeof(bool) * g_shared.max_num_connections);
-  size_t num_connections = 0;
-  size_t num_threads = 0;
+  struct fj_connection_t *connections = (struct fj_connection_t*) calloc(
+      g_shared.max_num_connections, sizeof(struct fj_connection_t));
+  size_t *free_list = (size_t*) malloc(sizeof(size_t) * g_shared.max_num_connections);
+  size_t num_free = 0;
 
-  while (1) {
-    if (g_exited) break;
 
-    
+  epollfd = epoll_create1(EPOLL_CLOEXEC);
 
-    /* Open connection requests and store them in the temp array. */
-    clientnamelen = sizeof(struct sockaddr_in);
-    connfd = accept(g_shared.http_sockfd, (struct sockaddr *)&clientname,
-                    &clientnamelen);
+  if (connections == NULL || free_list == NULL || epollfd < 0) {
+    error_log("Cannot start http thread.");
+    request_exit();
+  }
+  else {
+    for (i=g_shared.max_num_connections; i > 0; --i) {
+      connections[i-1].state = CONN_FREE;
+      connections[i-1].sockfd = -1;
+      free_list[num_free++] = i-1;
+    }
 
-    if (connfd < 0) {
-      if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        error_log(strerror(errno));
-        g_exited = true;
-      }
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTEN_TAG;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, g_shared.http_sockfd, &ev) < 0) {
+      error_log("Cannot start http thread.");
+      request_exit();
     }
-    else {
 
-      ip = ntohl(clientname.sin_addr.s_addr);
+    ev.events = EPOLLIN;
+    ev.data.u64 = EXIT_TAG;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, g_shared.exit_event, &ev) < 0) {
+      error_log("Cannot start http thread.");
+      request_exit();
+    }
+  }
 
-      if (ip < g_shared.min_allowed_ip || ip > g_shared.max_allowed_ip
-          || num_connections >= g_shared.max_num_connections) {
-        close(connfd);
-        debug_log("Rejected connection from %s.", inet_ntoa(clientname.sin_addr));
-      }
-      else {
-        if (fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) | O_NONBLOCK) < 0) {
-          error_log(strerror(errno));
-          close(connfd);
-          g_exited = true;
-        }
-        else {
-          temp_connections[num_connections] = connfd;
-          is_closed[num_connections] = false;
-          ++num_connections;
-          debug_log("Opened connection from %s.", inet_ntoa(clientname.sin_addr));
-        }
-        
-      }
 
-    }
 
+  while (!g_exited) {
+
+    /* Only wake periodically while there are pending connections that may
+    need to be timed out. */
+    num_events = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS,
+                            num_free < g_shared.max_num_connections
+                            ? CONNECTION_TIMEOUT_SEC * 1000 / 4 : -1);
+
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      error_log(strerror(errno));
+      request_exit();
+      break;
+    }
 
+    now = time(NULL);
 
-    /* Service requests from open temp connections. */
-    for (i=0; i < num_connections; ++i) {
 
-      request_beginning = true;
-      is_get = false;
-      is_post = false;
+    for (i=0; i < (size_t) num_events; ++i) {
 
-      while (1) {
-        num_received = recv(temp_connections[i], recv_buffer, RECV_SIZE, 0);
+      if (events[i].data.u64 == EXIT_TAG) {
+        continue;
+      }
 
 
+      /* Accept every pending connection request. */
+      if (events[i].data.u64 == LISTEN_TAG) {
+
+        while (1) {
+          clientnamelen = sizeof(struct sockaddr_in);
+          connfd = accept4(g_shared.http_sockfd, (struct sockaddr *)&clientname,
+                           &clientnamelen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+          if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+                && errno != ECONNABORTED) {
+              error_log(strerror(errno));
+            }
+            break;
+          }
+
+          ip = ntohl(clientname.sin_addr.s_addr);
+
+          if (ip < g_shared.min_allowed_ip || ip > g_shared.max_allowed_ip
+              || num_free == 0) {
+            close(connfd);
+            debug_log("Rejected connection from %s.", inet_ntoa(clientname.sin_addr));
+            continue;
+          }
+
+          ind = free_list[--num_free];
+          conn = &(connections[ind]);
+          conn->sockfd = connfd;
+          conn->state = CONN_READING;
+          conn->last_active = now;
+          conn->recv_len = 0;
+          conn->recv_buffer[0] = '\0';
+          conn->headers_done = false;
+          conn->body_remaining = 0;
+
+          if (!watch_connection(epollfd, EPOLL_CTL_ADD, EPOLLIN | EPOLLRDHUP,
+                                connections, free_list, &num_free, ind)) {
+            continue;
+          }
 
-        if (num_received > 0 && num_received <= RECV_SIZE && request_beginning) {
-          parse_uri(recv_buffer, num_received, uri_buffer, &is_get, &is_post);
+          debug_log("Opened connection from %s.", inet_ntoa(clientname.sin_addr));
         }
-        request_beginning = false;
 
-        if (errno == EAGAIN || errno == EWOULDBLOCK || num_received == 0
-            || num_received > RECV_SIZE) {
-          break;
-        }
+        continue;
       }
 
-      if (is_get) {
 
-        if (strcmp(uri_buffer, "/rootDesc.xml") == 0) {
-          send_root_xml_response(g_shared.uuid, g_shared.name,
-                                 SERVER_NAME, temp_connections[i]);
-          close(temp_connections[i]);
-          is_closed[i] = true;
-        }
+      ind = (size_t) events[i].data.u64;
+      conn = &(connections[ind]);
 
-        else if (strcmp(uri_buffer, "/ContentDir.xml") == 0) {
-          send_content_dir_xml_response(SERVER_NAME, temp_connections[i]);
-          close(temp_connections[i]);
-          is_closed[i] = true;
-        }
+      if (conn->state == CONN_FREE) {
+        continue;
+      }
 
-        else if (strcmp(uri_buffer, "/media/0.flac") == 0
-                 && num_threads < g_shared.max_num_connections) {
-          int sockfd = temp_connections[i];
-          pthread_create(&(media_threads[num_threads]), NULL, run_media_thread, &sockfd);
-          ++num_threads;
-          is_closed[i] = true;
+      conn->last_active = now;
+
+
+      if (conn->state == CONN_READING) {
+
+        if (!read_request(conn)) {
+          epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+          release_connection(connections, free_list, &num_free, ind, true);
+          continue;
         }
 
-        else {
-          send_empty_response(SERVER_NAME, temp_connections[i]);
-          close(temp_connections[i]);
-          is_closed[i] = true;
+        if (conn->state == CONN_READING) {
+          continue;
         }
 
-        
-      }
 
-      else if (is_post) {
-        if (strcmp(uri_buffer, "/ctl/ContentDir") == 0) {
-          send_content_response(g_shared.name, SERVER_NAME,
-                                g_shared.server_url, g_shared.sample_rate,
-                                g_shared.bit_depth, temp_connections[i]);
-          close(temp_connections[i]);
-          is_closed[i] = true;
+        /* Hand media requests to a media worker, which takes ownership of
+        the socket. */
+        if (route_request(conn)) {
+          if (epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->sockfd, NULL) < 0) {
+            error_log("Cannot hand off media connection: %s", strerror(errno));
+            release_connection(connections, free_list, &num_free, ind, true);
+          }
+          else if (media_start_session(conn->sockfd, conn->stream_ind)) {
+            release_connection(connections, free_list, &num_free, ind, false);
+          }
+          else {
+            debug_log("Rejected media request, all sessions in use.");
+            release_connection(connections, free_list, &num_free, ind, true);
+          }
+          continue;
         }
-        else {
-          send_empty_response(SERVER_NAME, temp_connections[i]);
-          close(temp_connections[i]);
-          is_closed[i] = true;
+
+        /* Try to send the response right away and only wait for writability
+        if the socket buffer is full. */
+        if (!watch_connection(epollfd, EPOLL_CTL_MOD, EPOLLOUT, connections, free_list,
+                              &num_free, ind)) {
+          continue;
         }
       }
 
-      else {
-          send_empty_response(SERVER_NAME, temp_connections[i]);
-          close(temp_connections[i]);
-          is_closed[i] = true;
-        }
 
+      if (conn->state == CONN_WRITING && write_response(conn)) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+        release_connection(connections, free_list, &num_free, ind, true);
+      }
     }
 
 
 
-    /* Remove closed connections from temp array. */
-    for (i=0; i < num_connections; ++i) {
-      if (is_closed[i]) {
-        for (j=i+1; j < num_connections; ++j) {
-          is_closed[j-1] = is_closed[j];
-          temp_connections[j-1] = temp_connections[j];
-        }
-        --num_connections;
+    /* Close connections that have been idle too long. */
+    for (ind=0; ind < g_shared.max_num_connections && num_free < g_shared.max_num_connections;
+         ++ind) {
+      if (connections[ind].state != CONN_FREE
+          && now - connections[ind].last_active > CONNECTION_TIMEOUT_SEC) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, connections[ind].sockfd, NULL);
+        release_connection(connections, free_list, &num_free, ind, true);
+        debug_log("Timed out connection.");
       }
     }
-
-
-    nanosleep(&ts, NULL);
   }
 
 
 
   /* Clean up. */
-  for (i=0; i < num_connections; ++i) {
-    close(temp_connections[i]);
-  }
-
-  for (i=0; i < num_threads; ++i) {
-    pthread_join(media_threads[i], NULL);
+  for (ind=0; connections != NULL && ind < g_shared.max_num_connections; ++ind) {
+    if (connections[ind].state != CONN_FREE) {
+      close(connections[ind].sockfd);
+    }
   }
 
-  free(temp_connections);
-  free(is_closed);
-  free(media_threads);
+  if (epollfd >= 0) close(epollfd);
+  free(connections);
+  free(free_list);
 
   debug_log("Exiting http thread.");
 
@@ -24,6 +24,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define HTTP_BACKLOG 16
 #define RECV_SIZE 1024
 #define MAX_URI_LEN 256
+#define REQUEST_BUFFER_SIZE 4096
+#define SEND_BUFFER_SIZE 8192
+#define MAX_EPOLL_EVENTS 32
+#define CONNECTION_TIMEOUT_SEC 10
+
+#define LISTEN_TAG UINT64_MAX
+#define EXIT_TAG (UINT64_MAX - 1)
 
 #define SDDP_ADDRESS "239.255.255.250"
 #define SDDP_PORT 1900
@@ -53,6 +60,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -60,6 +68,34 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 
 
+/* States of a control connection handled by the HTTP event loop. */
+enum fj_conn_state_t {
+  CONN_FREE,       /* Slot is unused. */
+  CONN_READING,    /* Waiting for the complete request. */
+  CONN_WRITING     /* Sending the buffered response. */
+};
+
+
+/* Control connection serviced by the HTTP thread until its response is sent
+or it is handed off to a media thread. */
+struct fj_connection_t {
+  int sockfd;
+  enum fj_conn_state_t state;
+  time_t last_active;
+
+  char recv_buffer[REQUEST_BUFFER_SIZE+1];  /* Length+1 to hold terminating null. */
+  size_t recv_len;
+  bool headers_done;
+  size_t body_remaining;
+  size_t stream_ind;                        /* Media URL requested, set by routing. */
+
+  char send_buffer[SEND_BUFFER_SIZE];
+  size_t send_len;
+  size_t send_pos;
+};
+
+
+
 /* Parses the CIDR string and returns the start ip and end ip as unsigned
 long integers in host byte order. */
 void get_allowed_address_range(const char *cidr, unsigned long *start_ip,
@@ -76,10 +112,6 @@ int sddp_bind(const char *hostname);
 
 
 
-/* Runs the thread for encoding and transferring FLAC media to the specified
-client socket. */
-void * run_media_thread(void *args);
-
 /* Runs the thread for listening and responding to HTTP requests. */
 void * run_http_thread();
 
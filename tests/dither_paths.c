@@ -0,0 +1,204 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dither.h"
+
+/* The portable lane loop, built here under other names next to the vector
+kernel of src/dither.c. */
+#define DITHER_PORTABLE
+#define dither_init portable_dither_init
+#define dither_requantize portable_dither_requantize
+#include "dither.c"
+#undef dither_init
+#undef dither_requantize
+
+
+#define IN_BIT_DEPTH 24
+#define MAX_BLOCK_FRAMES 1024
+
+
+
+/* Vector kernel against the portable lane loop. Both requantize the same
+sequence of blocks, of varying lengths and with channels falling silent and
+coming back, and must write identical samples: the same noise, the same
+error feedback and the same clipping. Every channel that is silent for a
+whole block must come out as exact zeros, whatever the shaping history. On
+builds without the vector kernel both sides are the portable loop, and only
+the silence is really checked. */
+
+
+
+struct test_case_t {
+  enum fj_dither_mode_t mode;
+  unsigned num_channels;
+  unsigned out_bit_depth;
+  bool planar;
+};
+
+
+static const size_t block_frames[] = {1000, 3, 256, 1, 4, 1024, 777, 2, 512};
+
+
+
+
+static uint32_t next_random(uint32_t *state) {
+
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+
+  return *state;
+}
+
+
+/* Fills one block of a tone under noise, loud enough to clip on some
+channels. Channel c is silent in block b when b + c is a multiple of three. */
+static void fill_block(int32_t *samples, const struct test_case_t *test, const size_t block,
+                       const size_t num_frames, uint32_t *seed) {
+
+  const int32_t full_scale = ((int32_t) 1 << (IN_BIT_DEPTH - 1)) - 1;
+  size_t f, c, i;
+  int32_t value;
+
+  for (c=0; c < test->num_channels; ++c) {
+    for (f=0; f < num_frames; ++f) {
+      i = test->planar ? c * num_frames + f : f * test->num_channels + c;
+
+      if ((block + c) % 3 == 0) {
+        samples[i] = 0;
+        continue;
+      }
+
+      value = (int32_t) (next_random(seed) % 2001) - 1000
+              + (int32_t) ((f * (c + 1) * 7919 + block * 104729) % 65536) * 64 - 2097152;
+      if (c == 1) {
+        value *= 8;     /* Beyond full scale, clipped. */
+      }
+      samples[i] = value > full_scale ? full_scale
+                   : value < -full_scale - 1 ? -full_scale - 1 : value;
+    }
+  }
+}
+
+
+static bool run_case(const struct test_case_t *test) {
+
+  const size_t num_blocks = sizeof(block_frames) / sizeof(block_frames[0]);
+  struct fj_dither_t vector, portable;
+  int32_t in[MAX_BLOCK_FRAMES * DITHER_MAX_CHANNELS];
+  int32_t out[MAX_BLOCK_FRAMES * DITHER_MAX_CHANNELS];
+  int32_t expected[MAX_BLOCK_FRAMES * DITHER_MAX_CHANNELS];
+  uint32_t seed = 1;
+  size_t b, f, c, i, len;
+
+
+  if (!dither_init(&vector, test->mode, test->num_channels, IN_BIT_DEPTH,
+                   test->out_bit_depth)
+      || !portable_dither_init(&portable, test->mode, test->num_channels, IN_BIT_DEPTH,
+                               test->out_bit_depth)) {
+    fprintf(stderr, "  cannot initialize the dither\n");
+    return false;
+  }
+
+  for (b=0; b < num_blocks; ++b) {
+    len = block_frames[b] * test->num_channels;
+    fill_block(in, test, b, block_frames[b], &seed);
+
+    /* The portable side works in place, as the encoder stage may. */
+    memcpy(expected, in, sizeof(int32_t) * len);
+    portable_dither_requantize(&portable, expected, block_frames[b], test->planar, expected);
+    dither_requantize(&vector, in, block_frames[b], test->planar, out);
+
+    for (i=0; i < len && out[i] == expected[i]; ++i);
+    if (i < len) {
+      fprintf(stderr, "  block %zu, sample %zu: %d instead of %d\n", b, i, out[i],
+              expected[i]);
+      return false;
+    }
+
+    for (c=0; c < test->num_channels; ++c) {
+      if ((b + c) % 3 != 0) continue;
+      for (f=0; f < block_frames[b]; ++f) {
+        i = test->planar ? c * block_frames[b] + f : f * test->num_channels + c;
+        if (out[i] != 0) {
+          fprintf(stderr, "  block %zu, channel %zu: silence dithered to %d\n", b, c,
+                  out[i]);
+          return false;
+        }
+      }
+    }
+  }
+
+
+  return true;
+}
+
+
+
+
+int main() {
+
+  static const enum fj_dither_mode_t modes[] = {
+    DITHER_NONE, DITHER_TPDF, DITHER_SHAPED, DITHER_LIPSHITZ
+  };
+  static const char *mode_names[] = {"none", "TPDF", "shaped", "Lipshitz"};
+  static const unsigned channel_counts[] = {1, 2, 3, 4, 5, 8};
+  static const unsigned bit_depths[] = {8, 16, 20};
+  struct test_case_t test;
+  size_t i, j, k, num_run = 0, num_passed = 0;
+  int planar;
+
+
+  for (i=0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+    for (j=0; j < sizeof(channel_counts) / sizeof(channel_counts[0]); ++j) {
+      for (k=0; k < sizeof(bit_depths) / sizeof(bit_depths[0]); ++k) {
+        for (planar=0; planar < 2; ++planar) {
+
+          test.mode = modes[i];
+          test.num_channels = channel_counts[j];
+          test.out_bit_depth = bit_depths[k];
+          test.planar = planar;
+
+          ++num_run;
+          if (run_case(&test)) {
+            ++num_passed;
+          }
+          else {
+            fprintf(stderr, "FAIL: %s dither, %u channels, %u bits, %s\n", mode_names[i],
+                    test.num_channels, test.out_bit_depth,
+                    planar ? "planar" : "interleaved");
+          }
+        }
+      }
+    }
+  }
+
+  printf("%zu of %zu dither cases passed.\n", num_passed, num_run);
+
+
+  return num_passed == num_run ? 0 : 1;
+}
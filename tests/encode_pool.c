@@ -0,0 +1,501 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <poll.h>
+
+#include <FLAC/stream_encoder.h>
+
+#include "flacjacket_globals.h"
+#include "encode_pool.h"
+#include "encoder.h"
+#include "events.h"
+#include "flac_native.h"
+#include "sample_block.h"
+
+
+#define TEST_BLOCKSIZE 576
+#define TEST_BLOCK_FRAMES 1000
+#define TEST_NUM_BLOCKS 40
+#define TEST_BIT_DEPTH 16
+#define TEST_SAMPLE_RATE 48000
+#define TEST_NUM_THREADS 3
+#define TEST_TIMEOUT_SEC 10
+
+
+
+/* Encode pool against a stand-in for the libFLAC stream encoder, which the
+test links instead of libFLAC. The stand-in follows libFLAC's framing: a
+frame is only written once the sample after it has arrived, frames are
+numbered from zero on every stream, finishing flushes the partial frame, and
+a metadata write with no samples comes first. It writes the frames with the
+native engine, so every frame the pool publishes must equal, byte for byte,
+the native encoding of the same samples at the same position. That checks
+the silent frames that realign a reused stream are dropped, the renumbering,
+the order of the segments, and the native re-encode of the segments a pool
+thread fails, which the stand-in forces by failing stream starts or sample
+writes. */
+
+
+
+/* State of a stand-in stream, holding up to one frame and one sample per
+channel. libFLAC's public encoder only points to its private state, so the
+stand-in keeps its own there. */
+struct FLAC__StreamEncoderPrivate {
+  FLAC__StreamEncoderWriteCallback callback;
+  void *client_data;
+  struct fj_native_encoder_t native;
+  bool open;
+
+  unsigned num_channels;
+  int32_t held[8][TEST_BLOCKSIZE + 1];
+  size_t num_held;
+  unsigned frame_num;
+};
+
+
+/* Forced failures of the current case, counted over every stream. */
+static struct {
+  unsigned fail_init_every;
+  unsigned fail_process_every;
+  unsigned num_inits;
+  unsigned num_processes;
+  unsigned num_failures;
+} g_mock;
+
+
+/* Reference signal and the frames published so far. */
+static struct {
+  int32_t *samples;           /* Interleaved, TEST_NUM_BLOCKS blocks. */
+  unsigned num_channels;
+  struct fj_native_encoder_t native;
+  uint64_t num_frames;
+  uint64_t num_mismatches;
+} g_stream;
+
+
+
+
+FLAC__StreamEncoder * FLAC__stream_encoder_new(void) {
+
+  FLAC__StreamEncoder *flac;
+
+  flac = (FLAC__StreamEncoder*) calloc(1, sizeof(FLAC__StreamEncoder));
+  if (flac == NULL) {
+    return NULL;
+  }
+
+  flac->private_ = (struct FLAC__StreamEncoderPrivate*) calloc(
+      1, sizeof(struct FLAC__StreamEncoderPrivate));
+  if (flac->private_ == NULL) {
+    free(flac);
+    return NULL;
+  }
+
+  return flac;
+}
+
+
+/* Writes the first blocksize held samples as a frame and keeps the rest. */
+static bool write_frame(FLAC__StreamEncoder *flac, const size_t num_samples) {
+
+  struct FLAC__StreamEncoderPrivate *stream = flac->private_;
+  const FLAC__byte *frame;
+  size_t len, c;
+
+  native_encoder_add(&(stream->native), &(stream->held[0][0]), TEST_BLOCKSIZE + 1, 1,
+                     TEST_BLOCKSIZE);
+  frame = native_encoder_encode(&(stream->native), stream->frame_num++, &len);
+
+  for (c=0; c < stream->num_channels; ++c) {
+    memmove(&(stream->held[c][0]), &(stream->held[c][num_samples]),
+            sizeof(int32_t) * (stream->num_held - num_samples));
+  }
+  stream->num_held -= num_samples;
+
+  return stream->callback(flac, frame, len, num_samples, stream->frame_num - 1,
+                          stream->client_data) == FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+
+FLAC__bool FLAC__stream_encoder_finish(FLAC__StreamEncoder *flac) {
+
+  struct FLAC__StreamEncoderPrivate *stream = flac->private_;
+  size_t c;
+
+  if (!stream->open) {
+    return true;
+  }
+
+  /* The partial frame is flushed as a short frame, padded here since the
+  native engine writes whole frames only. */
+  if (stream->num_held > 0) {
+    for (c=0; c < stream->num_channels; ++c) {
+      memset(&(stream->held[c][stream->num_held]), 0,
+             sizeof(int32_t) * (TEST_BLOCKSIZE + 1 - stream->num_held));
+    }
+    write_frame(flac, stream->num_held);
+  }
+
+  native_encoder_free(&(stream->native));
+  stream->open = false;
+  return true;
+}
+
+
+void FLAC__stream_encoder_delete(FLAC__StreamEncoder *flac) {
+  FLAC__stream_encoder_finish(flac);
+  free(flac->private_);
+  free(flac);
+}
+
+
+FLAC__StreamEncoderInitStatus FLAC__stream_encoder_init_stream(
+    FLAC__StreamEncoder *flac, FLAC__StreamEncoderWriteCallback write_callback,
+    FLAC__StreamEncoderSeekCallback seek_callback,
+    FLAC__StreamEncoderTellCallback tell_callback,
+    FLAC__StreamEncoderMetadataCallback metadata_callback, void *client_data) {
+
+  struct FLAC__StreamEncoderPrivate *stream = flac->private_;
+  const FLAC__byte marker[4] = {'f', 'L', 'a', 'C'};
+  unsigned num_inits;
+
+  (void) seek_callback; (void) tell_callback; (void) metadata_callback;
+
+  num_inits = __atomic_add_fetch(&(g_mock.num_inits), 1, __ATOMIC_RELAXED);
+  if (g_mock.fail_init_every > 0 && num_inits % g_mock.fail_init_every == 0) {
+    __atomic_add_fetch(&(g_mock.num_failures), 1, __ATOMIC_RELAXED);
+    return FLAC__STREAM_ENCODER_INIT_STATUS_ENCODER_ERROR;
+  }
+
+  if (!native_encoder_init(&(stream->native), g_stream.num_channels, TEST_BIT_DEPTH,
+                           TEST_SAMPLE_RATE, TEST_BLOCKSIZE)) {
+    return FLAC__STREAM_ENCODER_INIT_STATUS_ENCODER_ERROR;
+  }
+
+  stream->callback = write_callback;
+  stream->client_data = client_data;
+  stream->num_channels = g_stream.num_channels;
+  stream->num_held = 0;
+  stream->frame_num = 0;
+  stream->open = true;
+
+  write_callback(flac, marker, sizeof(marker), 0, 0, client_data);
+  return FLAC__STREAM_ENCODER_INIT_STATUS_OK;
+}
+
+
+/* Holds the samples, writing a frame whenever the sample after it arrives. */
+static FLAC__bool process(FLAC__StreamEncoder *flac, const FLAC__int32 * const channels[],
+                          const FLAC__int32 *interleaved, const uint32_t num_samples) {
+
+  struct FLAC__StreamEncoderPrivate *stream = flac->private_;
+  uint32_t i;
+  unsigned num_processes;
+  size_t c;
+
+  if (!stream->open) {
+    return false;
+  }
+
+  num_processes = __atomic_add_fetch(&(g_mock.num_processes), 1, __ATOMIC_RELAXED);
+  if (g_mock.fail_process_every > 0 && num_processes % g_mock.fail_process_every == 0) {
+    __atomic_add_fetch(&(g_mock.num_failures), 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  for (i=0; i < num_samples; ++i) {
+    for (c=0; c < stream->num_channels; ++c) {
+      stream->held[c][stream->num_held] = channels != NULL ? channels[c][i]
+                                          : interleaved[i * stream->num_channels + c];
+    }
+    if (++stream->num_held == TEST_BLOCKSIZE + 1 && !write_frame(flac, TEST_BLOCKSIZE)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+FLAC__bool FLAC__stream_encoder_process(FLAC__StreamEncoder *flac,
+                                        const FLAC__int32 * const buffer[],
+                                        uint32_t samples) {
+  return process(flac, buffer, NULL, samples);
+}
+
+
+FLAC__bool FLAC__stream_encoder_process_interleaved(FLAC__StreamEncoder *flac,
+                                                    const FLAC__int32 buffer[],
+                                                    uint32_t samples) {
+  return process(flac, NULL, buffer, samples);
+}
+
+
+
+
+/* Stand-ins for the encoder stage around the pool. */
+bool encoder_init_flac(struct fj_encoder_t *encoder, FLAC__StreamEncoder *flac,
+                       const unsigned level, FLAC__StreamEncoderWriteCallback callback,
+                       void *client_data) {
+
+  (void) encoder; (void) level;
+
+  return FLAC__stream_encoder_init_stream(flac, callback, NULL, NULL, NULL, client_data)
+         == FLAC__STREAM_ENCODER_INIT_STATUS_OK;
+}
+
+
+/* Compares each published frame with the native encoding of the same
+samples at the same position. */
+bool encoder_publish_frame(struct fj_encoder_t *encoder, const FLAC__byte *buffer,
+                           size_t len, unsigned samples) {
+
+  const FLAC__byte *expected;
+  size_t expected_len;
+
+  (void) encoder;
+
+  native_encoder_add(&(g_stream.native),
+                     &(g_stream.samples[g_stream.num_frames * TEST_BLOCKSIZE
+                                        * g_stream.num_channels]),
+                     1, g_stream.num_channels, TEST_BLOCKSIZE);
+  expected = native_encoder_encode(&(g_stream.native), g_stream.num_frames, &expected_len);
+
+  if (samples != TEST_BLOCKSIZE || len != expected_len
+      || memcmp(buffer, expected, len) != 0) {
+    if (g_stream.num_mismatches++ == 0) {
+      fprintf(stderr, "  frame %" PRIu64 " differs\n", g_stream.num_frames);
+    }
+  }
+
+  ++g_stream.num_frames;
+  return true;
+}
+
+
+
+
+/* Waits for a pool thread to finish a segment, as the encoder thread does
+between blocks, giving up after a second so a stalled pool fails the case
+instead of hanging it. The event is cleared before publishing, so a segment
+finished after the publish signals it again. */
+static void wait_for_segments(struct fj_encoder_t *encoder) {
+
+  struct pollfd pfd;
+
+  pfd.fd = encoder->block_event;
+  pfd.events = POLLIN;
+
+  if (poll(&pfd, 1, 1000) > 0) {
+    event_clear(encoder->block_event);
+  }
+}
+
+
+
+
+struct test_case_t {
+  unsigned num_channels;
+  bool planar;
+  unsigned fail_init_every;
+  unsigned fail_process_every;
+};
+
+
+/* Feeds the signal through a pool block by block, publishing as the encoder
+thread does, until every dispatched segment is published. */
+static bool run_case(const struct test_case_t *test) {
+
+  struct fj_encoder_t *encoder;
+  struct fj_encode_pool_t pool;
+  struct fj_block_t *block;
+  uint32_t seed = 1;
+  size_t b, f, c;
+  uint64_t num_segments;
+  time_t deadline;
+  bool ok = true;
+
+
+  memset(&g_mock, 0, sizeof(g_mock));
+  g_mock.fail_init_every = test->fail_init_every;
+  g_mock.fail_process_every = test->fail_process_every;
+
+  g_shared.planar = test->planar;
+  g_stream.num_channels = test->num_channels;
+  g_stream.num_frames = 0;
+  g_stream.num_mismatches = 0;
+
+  g_stream.samples = (int32_t*) malloc(sizeof(int32_t) * TEST_NUM_BLOCKS * TEST_BLOCK_FRAMES
+                                       * test->num_channels);
+  encoder = (struct fj_encoder_t*) calloc(1, sizeof(struct fj_encoder_t));
+  block = block_new(TEST_BLOCK_FRAMES * test->num_channels);
+  if (g_stream.samples == NULL || encoder == NULL || block == NULL
+      || !native_encoder_init(&(g_stream.native), test->num_channels, TEST_BIT_DEPTH,
+                              TEST_SAMPLE_RATE, TEST_BLOCKSIZE)) {
+    fprintf(stderr, "  cannot set up the case\n");
+    return false;
+  }
+
+  /* Noise on a tone, so the frames are neither constant nor verbatim. */
+  for (f=0; f < TEST_NUM_BLOCKS * TEST_BLOCK_FRAMES; ++f) {
+    for (c=0; c < test->num_channels; ++c) {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      g_stream.samples[f * test->num_channels + c] =
+          (int32_t) (8000.0 * sin(0.01 * f * (c + 1))) + (int32_t) (seed % 64) - 32;
+    }
+  }
+
+  encoder->profile.num_channels = test->num_channels;
+  encoder->profile.bit_depth = TEST_BIT_DEPTH;
+  encoder->profile.sample_rate = TEST_SAMPLE_RATE;
+  encoder->blocksize = TEST_BLOCKSIZE;
+  encoder->max_block_frames = TEST_BLOCK_FRAMES;
+  encoder->block_event = event_create();
+
+  if (!encode_pool_init(&pool, encoder, TEST_NUM_THREADS)) {
+    fprintf(stderr, "  cannot start the pool\n");
+    return false;
+  }
+
+
+  deadline = time(NULL) + TEST_TIMEOUT_SEC;
+  for (b=0; b < TEST_NUM_BLOCKS; ++b) {
+    for (f=0; f < TEST_BLOCK_FRAMES; ++f) {
+      for (c=0; c < test->num_channels; ++c) {
+        block->samples[test->planar ? c * TEST_BLOCK_FRAMES + f : f * test->num_channels + c]
+            = g_stream.samples[(b * TEST_BLOCK_FRAMES + f) * test->num_channels + c];
+      }
+    }
+
+    while (!encode_pool_can_feed(&pool) && time(NULL) < deadline) {
+      wait_for_segments(encoder);
+      encode_pool_publish(&pool);
+    }
+    if (!encode_pool_can_feed(&pool)) {
+      break;
+    }
+    encode_pool_feed(&pool, block);
+  }
+
+  /* The segment still filling is never dispatched. */
+  num_segments = pool.num_dispatched;
+  while (pool.num_published < num_segments && time(NULL) < deadline) {
+    wait_for_segments(encoder);
+    encode_pool_publish(&pool);
+  }
+
+
+  if (pool.num_published < num_segments) {
+    fprintf(stderr, "  published %" PRIu64 " of %" PRIu64 " segments\n",
+            pool.num_published, num_segments);
+    ok = false;
+  }
+  if (g_stream.num_frames != num_segments * pool.frames_per_segment
+      || g_stream.num_frames < TEST_NUM_BLOCKS * TEST_BLOCK_FRAMES / TEST_BLOCKSIZE
+                               - 2 * pool.frames_per_segment) {
+    fprintf(stderr, "  published %" PRIu64 " frames of %" PRIu64 " segments\n",
+            g_stream.num_frames, num_segments);
+    ok = false;
+  }
+  if (g_stream.num_mismatches > 0) {
+    fprintf(stderr, "  %" PRIu64 " of %" PRIu64 " frames differ\n", g_stream.num_mismatches,
+            g_stream.num_frames);
+    ok = false;
+  }
+
+  /* Make sure the forced failures happened, and that streams are reused
+  rather than started for every segment. */
+  if ((test->fail_init_every > 0 || test->fail_process_every > 0)
+      && g_mock.num_failures == 0) {
+    fprintf(stderr, "  no failure was forced\n");
+    ok = false;
+  }
+  if (test->fail_init_every == 0 && test->fail_process_every == 0
+      && g_mock.num_inits > TEST_NUM_THREADS) {
+    fprintf(stderr, "  started %u streams for %zu threads\n", g_mock.num_inits,
+            pool.num_threads);
+    ok = false;
+  }
+
+
+  encode_pool_destroy(&pool);
+  native_encoder_free(&(g_stream.native));
+  close(encoder->block_event);
+  block_unref(block);
+  free(encoder);
+  free(g_stream.samples);
+
+
+  return ok;
+}
+
+
+
+
+int main() {
+
+  static const struct test_case_t tests[] = {
+    {2, false, 0, 0},
+    {2, true, 0, 0},
+    {6, false, 0, 0},
+    {1, true, 0, 0},
+    {2, false, 3, 0},       /* Every third stream fails to start. */
+    {2, true, 0, 7},        /* Every seventh sample write fails mid-segment. */
+    {3, false, 4, 5}
+  };
+  size_t i, num_passed = 0;
+  const size_t num_run = sizeof(tests) / sizeof(tests[0]);
+
+
+  /* Waits on events return early once the exit event is signaled. */
+  g_shared.exit_event = event_create();
+  if (g_shared.exit_event < 0) {
+    fprintf(stderr, "FAIL: cannot create the exit event\n");
+    return 1;
+  }
+
+  for (i=0; i < num_run; ++i) {
+    if (run_case(&(tests[i]))) {
+      ++num_passed;
+    }
+    else {
+      fprintf(stderr, "FAIL: %u channels, %s, failing every %u starts and %u writes\n",
+              tests[i].num_channels, tests[i].planar ? "planar" : "interleaved",
+              tests[i].fail_init_every, tests[i].fail_process_every);
+    }
+  }
+
+  printf("%zu of %zu encode pool cases passed.\n", num_passed, num_run);
+
+
+  return num_passed == num_run ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flacjacket_globals.h"
+#include "encoder.h"
+#include "media.h"
+
+
+#define TEST_QUEUE_LEN 64
+#define TEST_FRAME_SAMPLES 4096
+#define TEST_MAX_LAG_SAMPLES 96000    /* 2 s at 48 kHz, not a multiple of the frame. */
+#define TEST_NUM_WAKEUPS 40
+
+
+
+/* Lag policies of a session whose socket stays blocked while the encoder keeps
+publishing frames. Every published frame wakes the session up and applies the
+policy, which must bring the session back within the maximum lag each time
+but count the episode only once, until the output drains. */
+
+
+
+/* Publishes one frame to the queue the way the encoder thread does, without
+any payload. */
+static void publish_frame(struct fj_encoder_t *encoder) {
+
+  struct fj_frame_t *frame = &(encoder->frames[encoder->num_frames % encoder->queue_len]);
+
+  frame->num_samples = TEST_FRAME_SAMPLES;
+  frame->sample_num = encoder->num_samples;
+  encoder->num_samples += TEST_FRAME_SAMPLES;
+  ++encoder->num_frames;
+}
+
+
+/* Runs one episode of a blocked session under the policy, followed by the
+output draining, and returns false if the policy misbehaved. */
+static bool run_episode(struct fj_media_worker_t *worker, struct fj_session_t *session,
+                        const enum fj_lag_policy_t policy) {
+
+  struct fj_encoder_t *encoder = session->encoder;
+  size_t num_resyncs = session->num_resyncs;
+  size_t i, lag;
+
+
+  g_shared.lag_policy = policy;
+  session->write_blocked = true;
+
+  for (i=0; i < TEST_NUM_WAKEUPS; ++i) {
+    publish_frame(encoder);
+
+    if (!media_check_lag(worker, session)) {
+      return policy == LAG_DISCONNECT && session->num_resyncs == num_resyncs + 1;
+    }
+
+    lag = encoder_lag_samples(encoder, session->frame_num);
+    if (lag > TEST_MAX_LAG_SAMPLES) {
+      fprintf(stderr, "  still %zu samples behind after the policy\n", lag);
+      return false;
+    }
+
+    /* Dropping the oldest frames keeps as many frames as fit in the limit. */
+    if (policy == LAG_DROP_OLDEST && session->num_resyncs > num_resyncs
+        && lag + TEST_FRAME_SAMPLES <= TEST_MAX_LAG_SAMPLES) {
+      fprintf(stderr, "  dropped too much, %zu samples behind\n", lag);
+      return false;
+    }
+  }
+
+  if (policy == LAG_DISCONNECT) {
+    fprintf(stderr, "  never disconnected\n");
+    return false;
+  }
+
+  if (session->num_resyncs != num_resyncs + 1) {
+    fprintf(stderr, "  counted %zu resyncs for one episode\n",
+            session->num_resyncs - num_resyncs);
+    return false;
+  }
+
+
+  /* The socket drains and the session sends every frame. */
+  session->write_blocked = false;
+  session->frame_num = encoder->num_frames;
+  media_check_lag(worker, session);
+
+  if (session->lagging) {
+    fprintf(stderr, "  episode did not end once the output drained\n");
+    return false;
+  }
+
+  return true;
+}
+
+
+
+
+int main() {
+
+  static const enum fj_lag_policy_t policies[] = {
+    LAG_DROP_OLDEST, LAG_DROP_OLDEST, LAG_DROP_TO_LIVE, LAG_DISCONNECT
+  };
+  static const char *policy_names[] = {"drop to live", "drop oldest", "disconnect"};
+  struct fj_encoder_t encoder;
+  struct fj_media_worker_t worker;
+  struct fj_session_t session;
+  size_t i, num_passed = 0;
+  const size_t num_run = sizeof(policies) / sizeof(policies[0]);
+
+
+  memset(&encoder, 0, sizeof(encoder));
+  memset(&worker, 0, sizeof(worker));
+  memset(&session, 0, sizeof(session));
+
+  pthread_mutex_init(&(encoder.lock), NULL);
+  encoder.queue_len = TEST_QUEUE_LEN;
+  encoder.frames = (struct fj_frame_t*) calloc(TEST_QUEUE_LEN, sizeof(struct fj_frame_t));
+  encoder.max_lag_samples = TEST_MAX_LAG_SAMPLES;
+  if (encoder.frames == NULL) {
+    fprintf(stderr, "FAIL: cannot allocate the frame queue\n");
+    return 1;
+  }
+
+  session.encoder = &encoder;
+
+  for (i=0; i < num_run; ++i) {
+    if (run_episode(&worker, &session, policies[i])) {
+      ++num_passed;
+    }
+    else {
+      fprintf(stderr, "FAIL: episode %zu, %s\n", i + 1, policy_names[policies[i]]);
+    }
+  }
+
+  /* One count per episode, never one per wakeup. */
+  if (worker.num_drops_oldest != 2 || worker.num_drops_to_live != 1
+      || worker.num_lag_disconnects != 1) {
+    fprintf(stderr, "FAIL: policy counters %" PRIu64 " oldest, %" PRIu64 " to live, %"
+            PRIu64 " disconnects\n", worker.num_drops_oldest, worker.num_drops_to_live,
+            worker.num_lag_disconnects);
+    num_passed = 0;
+  }
+
+  printf("%zu of %zu lag episodes passed.\n", num_passed, num_run);
+
+  free(encoder.frames);
+
+
+  return num_passed == num_run ? 0 : 1;
+}
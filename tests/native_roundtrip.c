@@ -0,0 +1,324 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <FLAC/stream_decoder.h>
+
+#include "flac_native.h"
+
+
+#define NUM_TEST_FRAMES 3
+
+
+
+/* Round trip of the native engine through the libFLAC decoder. Every case
+encodes a few frames, decodes the stream and compares the samples and the
+position of every frame, so both the bitstream and the frame numbering are
+checked. libFLAC verifies the header and frame CRCs along the way. */
+
+
+
+enum signal_t {
+  SIGNAL_TONE,          /* Smooth, takes the fixed predictors. */
+  SIGNAL_CONSTANT,      /* Constant subframes. */
+  SIGNAL_NOISE,         /* Full-scale noise, verbatim subframes. */
+  SIGNAL_WIDE,          /* Loud noise on a tone, Rice parameters above 14. */
+  SIGNAL_ANTIPHASE      /* Right is minus left, so the side channel needs a bit more. */
+};
+
+
+struct test_case_t {
+  unsigned num_channels;
+  unsigned bit_depth;
+  unsigned blocksize;
+  enum signal_t signal;
+};
+
+
+/* Stream being decoded and the samples it should decode to. */
+struct stream_t {
+  const FLAC__byte *data;
+  size_t len;
+  size_t pos;
+
+  const int32_t *expected;    /* Interleaved. */
+  unsigned num_channels;
+  size_t num_frames;
+  size_t num_decoded;
+  bool failed;
+};
+
+
+
+
+static uint32_t next_random(uint32_t *state) {
+
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+
+/* Returns a random value spanning the specified number of bits, signed. */
+static int32_t random_bits(uint32_t *state, const unsigned bits) {
+  return (int32_t) (next_random(state) >> (32 - bits)) - (1 << (bits - 1));
+}
+
+
+static void fill_signal(int32_t *samples, const struct test_case_t *test,
+                        const size_t num_frames) {
+
+  const int32_t max_value = (1 << (test->bit_depth - 1)) - 1;
+  uint32_t seed = 12345;
+  int32_t value;
+  size_t f, c;
+
+  for (f=0; f < num_frames; ++f) {
+    for (c=0; c < test->num_channels; ++c) {
+
+      switch (test->signal) {
+        case (SIGNAL_TONE):
+          value = (int32_t) (0.5 * max_value * sin(0.01 * (f + 7.0 * c)));
+          break;
+        case (SIGNAL_CONSTANT):
+          value = (int32_t) c * 3 - max_value / 2;
+          break;
+        case (SIGNAL_NOISE):
+          value = random_bits(&seed, test->bit_depth);
+          break;
+        case (SIGNAL_WIDE):
+          value = (int32_t) (0.25 * max_value * sin(0.01 * f))
+                  + random_bits(&seed, test->bit_depth - 4);
+          break;
+        default:
+          value = random_bits(&seed, test->bit_depth);
+          if (value < -max_value) value = -max_value;
+          if (c % 2 == 1) value = -samples[f * test->num_channels + c - 1];
+          break;
+      }
+
+      samples[f * test->num_channels + c] = value;
+    }
+  }
+}
+
+
+
+
+static FLAC__StreamDecoderReadStatus read_stream(const FLAC__StreamDecoder *decoder,
+                                                 FLAC__byte buffer[], size_t *bytes,
+                                                 void *client_data) {
+
+  struct stream_t *stream = (struct stream_t*) client_data;
+  size_t len = stream->len - stream->pos;
+
+  (void) decoder;
+
+  if (len == 0) {
+    *bytes = 0;
+    return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+  }
+
+  if (len > *bytes) len = *bytes;
+  memcpy(buffer, &(stream->data[stream->pos]), len);
+  stream->pos += len;
+  *bytes = len;
+
+  return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+
+static FLAC__StreamDecoderWriteStatus check_frame(const FLAC__StreamDecoder *decoder,
+                                                  const FLAC__Frame *frame,
+                                                  const FLAC__int32 * const buffer[],
+                                                  void *client_data) {
+
+  struct stream_t *stream = (struct stream_t*) client_data;
+  const unsigned blocksize = frame->header.blocksize;
+  size_t i, c;
+
+  (void) decoder;
+
+  /* Fixed-blocksize frame numbers are reported as sample numbers. */
+  if (frame->header.number_type != FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER
+      || frame->header.number.sample_number != stream->num_decoded
+      || frame->header.channels != stream->num_channels
+      || stream->num_decoded + blocksize > stream->num_frames) {
+    fprintf(stderr, "  unexpected frame at sample %zu\n", stream->num_decoded);
+    stream->failed = true;
+    return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+  }
+
+  for (i=0; i < blocksize; ++i) {
+    for (c=0; c < stream->num_channels; ++c) {
+      if (buffer[c][i] != stream->expected[(stream->num_decoded + i) * stream->num_channels + c]) {
+        fprintf(stderr, "  sample %zu of channel %zu differs\n", stream->num_decoded + i, c);
+        stream->failed = true;
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+      }
+    }
+  }
+
+  stream->num_decoded += blocksize;
+  return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+
+static void report_error(const FLAC__StreamDecoder *decoder,
+                         FLAC__StreamDecoderErrorStatus status, void *client_data) {
+
+  (void) decoder;
+
+  fprintf(stderr, "  decoder error: %s\n", FLAC__StreamDecoderErrorStatusString[status]);
+  ((struct stream_t*) client_data)->failed = true;
+}
+
+
+
+
+/* Encodes and decodes one case. Returns true if it round trips, and counts
+the subframes that used five bit Rice parameters. */
+static bool run_case(const struct test_case_t *test, size_t *num_wide) {
+
+  const size_t num_frames = (size_t) NUM_TEST_FRAMES * test->blocksize;
+  struct fj_native_encoder_t encoder;
+  struct stream_t stream;
+  FLAC__StreamDecoder *decoder;
+  FLAC__byte *data;
+  const FLAC__byte *frame;
+  int32_t *samples;
+  size_t len, n, c;
+
+
+  samples = (int32_t*) malloc(sizeof(int32_t) * num_frames * test->num_channels);
+  data = (FLAC__byte*) malloc(NATIVE_HEADER_LEN + num_frames * test->num_channels * 4
+                              + NUM_TEST_FRAMES * 64);
+  if (samples == NULL || data == NULL
+      || !native_encoder_init(&encoder, test->num_channels, test->bit_depth, 48000,
+                              test->blocksize)) {
+    fprintf(stderr, "  cannot set up the case\n");
+    return false;
+  }
+
+  fill_signal(samples, test, num_frames);
+
+  memset(&stream, 0, sizeof(stream));
+  stream.data = data;
+  stream.len = native_encoder_write_header(&encoder, data);
+  stream.expected = samples;
+  stream.num_channels = test->num_channels;
+  stream.num_frames = num_frames;
+
+  for (n=0; n < NUM_TEST_FRAMES; ++n) {
+    native_encoder_add(&encoder, &(samples[n * test->blocksize * test->num_channels]), 1,
+                       test->num_channels, test->blocksize);
+    frame = native_encoder_encode(&encoder, n, &len);
+    memcpy(&(data[stream.len]), frame, len);
+    stream.len += len;
+
+    for (c=0; c < test->num_channels; ++c) {
+      if (encoder.plans[c].type == SUBFRAME_FIXED && encoder.plans[c].wide_params) {
+        ++*num_wide;
+      }
+    }
+  }
+
+
+  decoder = FLAC__stream_decoder_new();
+  if (FLAC__stream_decoder_init_stream(decoder, read_stream, NULL, NULL, NULL, NULL,
+                                       check_frame, NULL, report_error, &stream)
+      != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+    fprintf(stderr, "  cannot initialize the decoder\n");
+    stream.failed = true;
+  }
+  else {
+    FLAC__stream_decoder_process_until_end_of_stream(decoder);
+    FLAC__stream_decoder_finish(decoder);
+  }
+  FLAC__stream_decoder_delete(decoder);
+
+  if (stream.num_decoded != num_frames) {
+    fprintf(stderr, "  decoded %zu of %zu samples\n", stream.num_decoded, num_frames);
+    stream.failed = true;
+  }
+
+  native_encoder_free(&encoder);
+  free(samples);
+  free(data);
+
+  return !stream.failed;
+}
+
+
+
+
+int main() {
+
+  static const unsigned channel_counts[] = {1, 2, 3, 8};
+  static const unsigned bit_depths[] = {8, 16, 24};
+  static const unsigned blocksizes[] = {100, 192, 576, 1000, 4096, 4608};
+  static const char *signal_names[] = {"tone", "constant", "noise", "wide", "antiphase"};
+  struct test_case_t test;
+  size_t i, j, k, num_run = 0, num_passed = 0, num_wide = 0;
+  int s;
+
+
+  for (i=0; i < sizeof(channel_counts) / sizeof(channel_counts[0]); ++i) {
+    for (j=0; j < sizeof(bit_depths) / sizeof(bit_depths[0]); ++j) {
+      for (k=0; k < sizeof(blocksizes) / sizeof(blocksizes[0]); ++k) {
+        for (s=SIGNAL_TONE; s <= SIGNAL_ANTIPHASE; ++s) {
+
+          test.num_channels = channel_counts[i];
+          test.bit_depth = bit_depths[j];
+          test.blocksize = blocksizes[k];
+          test.signal = (enum signal_t) s;
+
+          ++num_run;
+          if (run_case(&test, &num_wide)) {
+            ++num_passed;
+          }
+          else {
+            fprintf(stderr, "FAIL: %u channels, %u bits, blocksize %u, %s\n",
+                    test.num_channels, test.bit_depth, test.blocksize, signal_names[s]);
+          }
+        }
+      }
+    }
+  }
+
+  printf("%zu of %zu cases passed, %zu subframes with five bit Rice parameters.\n",
+         num_passed, num_run, num_wide);
+
+  /* The wide signal must actually reach the five bit parameters. */
+  if (num_wide == 0) {
+    fprintf(stderr, "FAIL: no subframe used five bit Rice parameters\n");
+    return 1;
+  }
+
+
+  return num_passed == num_run ? 0 : 1;
+}
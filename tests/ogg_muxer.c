@@ -0,0 +1,434 @@
+/*
+Copyright (C) 2018. See AUTHORS.
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ogg_flac.h"
+
+
+#define TEST_SERIAL 0x5EED1234u
+#define MAX_TEST_FRAMES 16
+#define MAX_TEST_PACKETS (MAX_TEST_FRAMES + 8)
+
+
+
+/* Demuxes the header and audio pages written by the muxer and checks them
+against the Ogg framing and the Ogg FLAC mapping: capture pattern, CRC, serial
+and sequence numbers, BOS and continuation flags, lacing with its 255-byte
+terminators, and the granule position of every page. The packets must come
+back byte for byte, headers first with VORBIS_COMMENT right after the BOS
+page. */
+
+
+
+/* Stream header in native framing, as handed to the muxer. */
+struct header_t {
+  const char *name;
+  uint8_t data[128];
+  size_t len;
+};
+
+
+struct test_case_t {
+  const struct header_t *header;
+  size_t frames_per_page;
+  size_t frame_lens[MAX_TEST_FRAMES];
+  size_t num_frames;
+};
+
+
+/* Packets reassembled from the pages, and the state of the page walk. */
+struct demux_t {
+  uint8_t *packets[MAX_TEST_PACKETS];
+  size_t packet_lens[MAX_TEST_PACKETS];
+  size_t num_packets;
+  bool open;                  /* The last segment read was 255 bytes long. */
+
+  uint32_t page_seq;
+  size_t num_pages;
+  uint64_t granule;           /* Samples of the packets completed so far. */
+  const unsigned *frame_samples;
+};
+
+
+
+
+static uint32_t crc_table[256];
+
+
+static void init_crc_table(void) {
+
+  uint32_t c;
+  size_t i;
+  int j;
+
+  for (i=0; i < 256; ++i) {
+    c = (uint32_t) i << 24;
+    for (j=0; j < 8; ++j) {
+      c = (c & 0x80000000u) ? (c << 1) ^ 0x04C11DB7u : c << 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+
+static uint64_t get_le(const uint8_t *p, const size_t num_bytes) {
+
+  uint64_t value = 0;
+  size_t i;
+
+  for (i=num_bytes; i > 0; --i) {
+    value = (value << 8) | p[i-1];
+  }
+  return value;
+}
+
+
+/* Returns the CRC of the page with its CRC field taken as zero. */
+static uint32_t page_crc(const uint8_t *page, const size_t len) {
+
+  uint32_t crc = 0;
+  size_t i;
+
+  for (i=0; i < len; ++i) {
+    crc = (crc << 8) ^ crc_table[(crc >> 24) ^ (i >= 22 && i < 26 ? 0 : page[i])];
+  }
+  return crc;
+}
+
+
+
+
+/* Reads the pages in the data, appending their packets. Header packets count
+no samples, audio packet n counts frame_samples[n]. Returns false if a page
+breaks the framing. */
+static bool demux_pages(struct demux_t *demux, const uint8_t *data, const size_t len,
+                        const size_t num_header_packets) {
+
+  const uint8_t *page, *body;
+  size_t pos = 0, num_segments, body_len, i, ind;
+  uint64_t granule;
+  bool ended;
+  uint8_t *packet;
+
+
+  while (pos < len) {
+
+    page = &(data[pos]);
+    if (len - pos < OGG_PAGE_HEADER_LEN || memcmp(page, "OggS", 4) != 0 || page[4] != 0) {
+      fprintf(stderr, "  no page header at byte %zu\n", pos);
+      return false;
+    }
+
+    num_segments = page[26];
+    body_len = 0;
+    for (i=0; i < num_segments; ++i) {
+      body_len += page[OGG_PAGE_HEADER_LEN + i];
+    }
+    if (len - pos < OGG_PAGE_HEADER_LEN + num_segments + body_len) {
+      fprintf(stderr, "  page %zu is truncated\n", demux->num_pages);
+      return false;
+    }
+
+    if (get_le(&(page[22]), 4)
+        != page_crc(page, OGG_PAGE_HEADER_LEN + num_segments + body_len)) {
+      fprintf(stderr, "  page %zu has a bad CRC\n", demux->num_pages);
+      return false;
+    }
+    if (get_le(&(page[14]), 4) != TEST_SERIAL
+        || get_le(&(page[18]), 4) != demux->page_seq++) {
+      fprintf(stderr, "  page %zu has the wrong serial or sequence number\n",
+              demux->num_pages);
+      return false;
+    }
+    if (((page[5] & 0x02) != 0) != (demux->num_pages == 0) || (page[5] & 0x04) != 0
+        || ((page[5] & 0x01) != 0) != demux->open) {
+      fprintf(stderr, "  page %zu has the wrong flags 0x%02x\n", demux->num_pages, page[5]);
+      return false;
+    }
+
+
+    /* Walk the lacing, splitting the body into packets. */
+    body = &(page[OGG_PAGE_HEADER_LEN + num_segments]);
+    ended = false;
+
+    for (i=0; i < num_segments; ++i) {
+      if (!demux->open) {
+        if (demux->num_packets == MAX_TEST_PACKETS) {
+          fprintf(stderr, "  too many packets\n");
+          return false;
+        }
+        demux->packets[demux->num_packets] = NULL;
+        demux->packet_lens[demux->num_packets] = 0;
+        ++demux->num_packets;
+      }
+
+      ind = demux->num_packets - 1;
+      packet = (uint8_t*) realloc(demux->packets[ind],
+                                  demux->packet_lens[ind] + page[OGG_PAGE_HEADER_LEN + i] + 1);
+      if (packet == NULL) {
+        return false;
+      }
+      memcpy(&(packet[demux->packet_lens[ind]]), body, page[OGG_PAGE_HEADER_LEN + i]);
+      demux->packets[ind] = packet;
+      demux->packet_lens[ind] += page[OGG_PAGE_HEADER_LEN + i];
+      body += page[OGG_PAGE_HEADER_LEN + i];
+
+      demux->open = page[OGG_PAGE_HEADER_LEN + i] == 255;
+      if (!demux->open) {
+        ended = true;
+        if (ind >= num_header_packets) {
+          demux->granule += demux->frame_samples[ind - num_header_packets];
+        }
+      }
+    }
+
+
+    /* The granule is the sample count at the last packet ending on the page,
+    or -1 if none ends there. */
+    granule = get_le(&(page[6]), 8);
+    if (granule != (ended ? demux->granule : UINT64_MAX)) {
+      fprintf(stderr, "  page %zu has granule %lld, expected %lld\n", demux->num_pages,
+              (long long) granule, ended ? (long long) demux->granule : -1LL);
+      return false;
+    }
+
+    ++demux->num_pages;
+    pos += OGG_PAGE_HEADER_LEN + num_segments + body_len;
+  }
+
+
+  return true;
+}
+
+
+
+
+/* Checks the header packets against the native header they came from: the
+mapping packet with STREAMINFO, then VORBIS_COMMENT, then every other block,
+with the last flag only on the final one. */
+static bool check_headers(const struct demux_t *demux, const struct header_t *header,
+                          size_t *num_header_packets) {
+
+  const uint8_t *first = demux->packets[0];
+  size_t num_blocks, i;
+
+
+  if (demux->num_packets < 2 || demux->packet_lens[0] != OGG_FLAC_FIRST_PACKET_LEN
+      || memcmp(first, "\x7F" "FLAC\x01\x00", 7) != 0 || memcmp(&(first[9]), "fLaC", 4) != 0
+      || first[13] != 0 || memcmp(&(first[17]), &(header->data[8]), 34) != 0) {
+    fprintf(stderr, "  bad mapping packet\n");
+    return false;
+  }
+
+  num_blocks = ((size_t) first[7] << 8) | first[8];
+  *num_header_packets = 1 + num_blocks;
+  if (*num_header_packets > demux->num_packets) {
+    fprintf(stderr, "  mapping packet announces %zu blocks\n", num_blocks);
+    return false;
+  }
+
+  if ((demux->packets[1][0] & 0x7F) != 4) {
+    fprintf(stderr, "  first packet after the BOS page is not a VORBIS_COMMENT\n");
+    return false;
+  }
+
+  for (i=1; i < *num_header_packets; ++i) {
+    if (demux->packet_lens[i] < 4
+        || demux->packet_lens[i] != 4 + (((size_t) demux->packets[i][1] << 16)
+                                         | ((size_t) demux->packets[i][2] << 8)
+                                         | demux->packets[i][3])
+        || ((demux->packets[i][0] & 0x80) != 0) != (i == *num_header_packets - 1)) {
+      fprintf(stderr, "  bad metadata block packet %zu\n", i);
+      return false;
+    }
+  }
+
+
+  return true;
+}
+
+
+
+
+/* Fills the frame with a recognizable pattern for its index. */
+static void fill_frame(uint8_t *frame, const size_t len, const size_t ind) {
+
+  size_t i;
+
+  for (i=0; i < len; ++i) {
+    frame[i] = (uint8_t) (i * 7 + ind * 31);
+  }
+}
+
+
+static bool run_case(const struct test_case_t *test) {
+
+  static uint8_t header_pages[8192];
+  struct fj_ogg_muxer_t muxer;
+  struct demux_t demux;
+  unsigned frame_samples[MAX_TEST_FRAMES];
+  uint8_t *frame;
+  size_t header_len, num_header_packets = 0, num_waiting, i;
+  bool ok = true;
+
+
+  if (!ogg_muxer_init(&muxer, TEST_SERIAL, test->frames_per_page)) {
+    fprintf(stderr, "  cannot initialize the muxer\n");
+    return false;
+  }
+
+  memset(&demux, 0, sizeof(demux));
+  demux.frame_samples = frame_samples;
+
+
+  header_len = ogg_muxer_write_headers(&muxer, test->header->data, test->header->len,
+                                       header_pages, sizeof(header_pages));
+  if (header_len == 0) {
+    fprintf(stderr, "  cannot write the header pages\n");
+    ogg_muxer_free(&muxer);
+    return false;
+  }
+
+  /* Header pages carry no samples, so every packet on them is a header. */
+  ok = demux_pages(&demux, header_pages, header_len, MAX_TEST_PACKETS)
+       && check_headers(&demux, test->header, &num_header_packets)
+       && num_header_packets == demux.num_packets && !demux.open;
+  if (!ok) {
+    fprintf(stderr, "  header pages do not hold exactly the header packets\n");
+  }
+
+
+  for (i=0; ok && i < test->num_frames; ++i) {
+    frame = (uint8_t*) malloc(test->frame_lens[i]);
+    if (frame == NULL) {
+      ok = false;
+      break;
+    }
+    fill_frame(frame, test->frame_lens[i], i);
+    frame_samples[i] = 1152 + (unsigned) i;
+
+    ok = ogg_muxer_add_frame(&muxer, frame, test->frame_lens[i], frame_samples[i])
+         && demux_pages(&demux, muxer.output, muxer.output_len, num_header_packets);
+
+    /* A page closes once the configured number of frames end on it, or
+    earlier when its segment table is full, so fewer frames than that may
+    wait on the open page. */
+    num_waiting = num_header_packets + i + 1 - (demux.num_packets - (demux.open ? 1 : 0));
+    if (ok && num_waiting >= test->frames_per_page) {
+      fprintf(stderr, "  %zu frames still waiting after frame %zu\n", num_waiting, i);
+      ok = false;
+    }
+
+    free(frame);
+  }
+
+
+  /* Every completed packet must come back unchanged. */
+  for (i=0; ok && num_header_packets + i < demux.num_packets
+            && !(demux.open && num_header_packets + i == demux.num_packets - 1); ++i) {
+    frame = (uint8_t*) malloc(test->frame_lens[i] + 1);
+    if (frame == NULL) {
+      ok = false;
+      break;
+    }
+    fill_frame(frame, test->frame_lens[i], i);
+    if (demux.packet_lens[num_header_packets + i] != test->frame_lens[i]
+        || memcmp(demux.packets[num_header_packets + i], frame, test->frame_lens[i]) != 0) {
+      fprintf(stderr, "  frame %zu came back changed\n", i);
+      ok = false;
+    }
+    free(frame);
+  }
+
+
+
+  for (i=0; i < demux.num_packets; ++i) {
+    free(demux.packets[i]);
+  }
+  ogg_muxer_free(&muxer);
+
+
+  return ok;
+}
+
+
+
+
+int main() {
+
+  /* Bare STREAMINFO, as the native engine writes it. */
+  static const struct header_t native = {
+    "native header",
+    {'f', 'L', 'a', 'C', 0x80, 0, 0, 34,
+     0x10, 0x00, 0x10, 0x00, 0, 0, 0, 0, 0, 0, 0x0B, 0xB8, 0x03, 0x70,
+     0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16},
+    42
+  };
+
+  /* STREAMINFO, a SEEKTABLE placeholder, VORBIS_COMMENT and PADDING, in an
+  order the mapping does not allow, to check the comment is moved first. */
+  static const struct header_t libflac = {
+    "libFLAC-like header",
+    {'f', 'L', 'a', 'C', 0x00, 0, 0, 34,
+     0x10, 0x00, 0x10, 0x00, 0, 0, 0, 0, 0, 0, 0x0B, 0xB8, 0x03, 0x70,
+     0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+     0x03, 0, 0, 18, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+     0x04, 0, 0, 12, 4, 0, 0, 0, 't', 'e', 's', 't', 0, 0, 0, 0,
+     0x81, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0},
+    42 + 22 + 16 + 12
+  };
+
+  /* Frame lengths around the 255-byte segments: a zero terminator after an
+  exact multiple, and frames long enough to fill a segment table and
+  continue on the next page. */
+  static const struct test_case_t tests[] = {
+    {&native, 1, {100, 255, 510, 0x10000, 3000}, 5},
+    {&libflac, 1, {100, 255, 510, 0x10000, 3000}, 5},
+    {&native, 3, {100, 255, 510, 700, 64770, 1, 2000, 254, 256}, 9},
+    {&libflac, 4, {255, 255, 255, 255, 70000, 10, 10, 10}, 8},
+    {&native, 2, {65025, 65024, 65026, 300000}, 4}
+  };
+  size_t i, num_passed = 0;
+  const size_t num_run = sizeof(tests) / sizeof(tests[0]);
+
+
+  init_crc_table();
+
+  for (i=0; i < num_run; ++i) {
+    if (run_case(&(tests[i]))) {
+      ++num_passed;
+    }
+    else {
+      fprintf(stderr, "FAIL: case %zu, %s, %zu frames per page\n", i + 1,
+              tests[i].header->name, tests[i].frames_per_page);
+    }
+  }
+
+  printf("%zu of %zu Ogg FLAC cases passed.\n", num_passed, num_run);
+
+
+  return num_passed == num_run ? 0 : 1;
+}